@@ -1,6 +1,6 @@
 // A benchmark for the FIFO message queue.
 //
-// Benchmarks the --queue implemention: "EfficientMQ", "SimpleMQ" or "DummyMQ".
+// Benchmarks the --queue implemention: "EfficientMQ", "LockFreeMQ", "ShardedMQ", "SimpleMQ" or "DummyMQ".
 //
 // Measures:
 //
@@ -10,6 +10,15 @@
 //
 //   2) Thread lock time.
 //      The time for which the thread pushing events is blocked when pushing an event.
+//      Reported as percentiles, from the log-linear histograms of push latencies of all the producer threads.
+//
+//   3) Consumer wakeups.
+//      For the queues that only wake up their consumer thread when it is parked, the number of times
+//      producers notified it, and the number of times it woke up, per second.
+//
+//   4) End-to-end latency.
+//      The time from right before the message is pushed to when the consumer receives it.
+//      Messages of at least 15 bytes carry the push timestamp, see `StampMessage()`.
 //
 // Entries pushing side is:
 //
@@ -21,10 +30,36 @@
 // Entries receiving side emulates processing messages at --process_mbps rate, exponentialy distributed as well.
 //
 // The test runs for --seconds seconds.
+//
+// For EfficientMQ, the --overflow policy defines what happens when the buffer is full: "DropOldest",
+// "DropNewest", "BlockWithTimeout" (with --block_timeout_ms) or "Spill" (to --spill_file, if set).
+//
+// For ShardedMQ, --shards is the number of shards, each with the buffer of --buffer_size messages,
+// and --shard_merge_order is the order in which the consumer thread merges them: "RoundRobin" or "ByTimestamp".
+//
+// Producers and the consumer keep their pace by waiting until the next message is due, according to --pacing:
+// "spin" keeps checking the clock, taking up a CPU core per thread, while "hybrid" (default) sleeps until
+// shortly before the deadline and only spins for the remaining --pacing_spin_us microseconds. Unless set,
+// the spin time is calibrated at startup to cover the typical oversleep of the OS.
+// With --pin_threads, on Linux, the consumer threads are pinned to the first CPU cores, and producers
+// to the rest.
+//
+// With --consumer_threads above one, EfficientMQ is replaced by PartitionedMQ with as many partitions,
+// each with its own consumer thread processing at --process_mbps. The messages are partitioned by producer.
+//
+// With --message_type=payload, messages are of the `mq::Payload` type instead of `std::string`,
+// which keeps short messages inline and recycles the memory of longer ones, see `mq_payload.h`.
+// The number of heap allocations made by the producers to push the messages is reported per message pushed.
+//
+// With --json_file set, the results are also written into that file as one JSON object, for tracking over time.
+//
+// With --zero_copy, the queues that support it (EfficientMQ) get the messages populated directly in their
+// buffer slots, via `ReserveMessage()`, instead of having them copied over. The push time then covers
+// reserving and committing the slot, but not populating the message.
 
 /*
 
-# Example messages in human-readable format.
+# Example messages in human-readable format. Their first bytes carry the push timestamp.
 ./build/benchmark \
   --dump \
   --push_threads 5 \
@@ -33,7 +68,7 @@
   --push_mbps_per_thread=0.00001
 
 # Load test, mid-sized messages from several threads.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=1000 \
@@ -42,7 +77,7 @@ for q in DummyMQ SimpleMQ EfficientMQ ; do \
 done
 
 # Heavy load test, large messages from many threads.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=1000000 \
@@ -50,10 +85,67 @@ for q in DummyMQ SimpleMQ EfficientMQ ; do \
   --process_mbps=100 ; \
 done
 
+# Overflow policies of EfficientMQ: push latency and drop rate with a slow consumer.
+for p in DropOldest DropNewest BlockWithTimeout Spill ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --overflow=$p \
+  --average_message_length=100 \
+  --push_threads=4 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=5 \
+  --seconds=15 ; \
+done
+
+# Contention of many producers on one buffer vs. on one buffer per producer.
+for q in EfficientMQ ShardedMQ ; do \
+  ./build/benchmark \
+  --queue=$q \
+  --shards=100 \
+  --average_message_length=100 \
+  --push_threads=100 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=1000 ; \
+done
+
+# Copying vs. populating the messages in place, for EfficientMQ.
+for z in false true ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --zero_copy=$z \
+  --average_message_length=1000 \
+  --push_threads=5 \
+  --process_mbps=10 ; \
+done
+
+# Drop rate with a slow consumer, as consumer threads are added.
+for c in 1 2 4 8 ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --consumer_threads=$c \
+  --average_message_length=100 \
+  --push_threads=8 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=2 \
+  --seconds=15 ; \
+done
+
+# Heap allocations per message with std::string vs. recycled payloads.
+# Payloads only stop allocating once every slot of the buffer has been used, thus the small buffer.
+for t in string payload ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --message_type=$t \
+  --buffer_size=64 \
+  --average_message_length=1000 \
+  --push_threads=5 \
+  --process_mbps=10 ; \
+done
+
 # Consumer slow relative to producers.
 # Observe produce speed adjusted to the consumer rate and/or messages dropped.
 # Need more time and smaller packets, otherwith most of them end up in the circular buffer of EfficientMQ.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=100 \
@@ -65,22 +157,42 @@ done
 
 */
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <gflags/gflags.h>
 
 #include "mq_efficient.h"
+#include "mq_payload.h"
+#include "mq_lockfree.h"
+#include "mq_partitioned.h"
+#include "mq_sharded.h"
 #include "mq_simple.h"
 #include "mq_dummy.h"
 
-DEFINE_string(queue, "DummyMQ", "EfficientMQ / SimpleMQ / DummyMQ");
+#include "latency_histogram.h"
+
+DEFINE_string(queue, "DummyMQ", "EfficientMQ / LockFreeMQ / ShardedMQ / SimpleMQ / DummyMQ");
 
 DEFINE_int32(push_threads, 8, "The number of threads that push in messages.");
 DEFINE_double(push_mbps_per_thread,
@@ -98,15 +210,231 @@ DEFINE_double(process_mbps,
 
 DEFINE_double(seconds, 3.0, "The time to run the benchmark for, in seconds.");
 
+DEFINE_int32(buffer_size,
+             1024,
+             "The size of the circular buffer, for EfficientMQ, or of each shard, for ShardedMQ.");
+DEFINE_int32(shards, 8, "The number of shards, for ShardedMQ.");
+DEFINE_string(shard_merge_order,
+              "RoundRobin",
+              "The order to merge shards in for ShardedMQ: RoundRobin / ByTimestamp.");
+DEFINE_string(overflow,
+              "DropOldest",
+              "The overflow policy for EfficientMQ: DropOldest / DropNewest / BlockWithTimeout / Spill.");
+DEFINE_int32(block_timeout_ms, 100, "The timeout for --overflow=BlockWithTimeout, in milliseconds.");
+DEFINE_string(spill_file,
+              "",
+              "The file to append messages to with --overflow=Spill. Only count them if empty.");
+DEFINE_int32(consumer_threads,
+             1,
+             "The number of consumer threads, for EfficientMQ. "
+             "Above one, PartitionedMQ keyed by producer is used.");
+DEFINE_bool(zero_copy,
+            false,
+            "Set to true to populate the messages in place in the buffer, for the queues that support it.");
+
+DEFINE_string(pacing, "hybrid", "How producers and the consumer keep their pace: spin / hybrid.");
+DEFINE_int32(pacing_spin_us, 0, "With --pacing=hybrid, the time to spin for after sleeping. 0 to calibrate.");
+DEFINE_bool(pin_threads, false, "Set to true to pin the threads to CPU cores. Linux only.");
+
+DEFINE_string(message_type, "string", "The type of messages: string / payload.");
+
+DEFINE_string(json_file, "", "If set, the file to write the results into, in JSON format.");
+
 DEFINE_bool(log, false, "When debugging, set to true to output more information on the progress of the test.");
 DEFINE_bool(dump, false, "When debugging or reading the code, set to true to log all the events.");
 
-// Use wall time in nanoseconds.
-double wall_time_ns() {
-  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
-                                 std::chrono::system_clock::now().time_since_epoch()).count());
+// Whether the queue supports populating messages in place, via `ReserveMessage()`.
+template <typename T_MESSAGE_QUEUE>
+struct HasReserveMessage {
+  template <typename Q>
+  static constexpr decltype(std::declval<Q&>().ReserveMessage(), bool()) Test(int) {
+    return true;
+  }
+  template <typename Q>
+  static constexpr bool Test(...) {
+    return false;
+  }
+  static constexpr bool value = Test<T_MESSAGE_QUEUE>(0);
+};
+
+// Counts heap allocations made by the calling thread, for the producers to report the number of allocations
+// per message pushed.
+thread_local uint64_t number_of_heap_allocations_in_this_thread = 0;
+
+// The replacements are not inlined, for GCC not to mistake the memory from `std::malloc()`
+// released with `std::free()` for a mismatch.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) {
+  ++number_of_heap_allocations_in_this_thread;
+  if (void* result = std::malloc(size ? size : 1)) {
+    return result;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  operator delete(ptr);
+}
+
+// Monotonic time in nanoseconds, for the timestamps carried by the messages.
+uint64_t monotonic_time_ns() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch()).count());
 }
 
+// Sleeps until the monotonic time of `deadline_ns`.
+void SleepUntil(uint64_t deadline_ns) {
+#ifdef __linux__
+  // `std::chrono::steady_clock` is CLOCK_MONOTONIC on Linux.
+  struct timespec deadline;
+  deadline.tv_sec = static_cast<time_t>(deadline_ns / 1000000000ull);
+  deadline.tv_nsec = static_cast<long>(deadline_ns % 1000000000ull);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {
+  }
+#else
+  std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline_ns)));
+#endif
+}
+
+// With --pacing=hybrid, the time to spin for after sleeping, in nanoseconds.
+uint64_t pacing_spin_ns = 0;
+
+// Sets `pacing_spin_ns` to --pacing_spin_us, or, if it is zero, to the worst oversleep of a few short sleeps,
+// within [1us, 1ms].
+void CalibratePacing() {
+  if (FLAGS_pacing_spin_us > 0) {
+    pacing_spin_ns = 1000ull * FLAGS_pacing_spin_us;
+  } else {
+    uint64_t max_oversleep_ns = 0;
+    for (int i = 0; i < 20; ++i) {
+      const uint64_t deadline_ns = monotonic_time_ns() + 50000;
+      SleepUntil(deadline_ns);
+      max_oversleep_ns = std::max(max_oversleep_ns, monotonic_time_ns() - deadline_ns);
+    }
+    pacing_spin_ns =
+        std::min(std::max(max_oversleep_ns, static_cast<uint64_t>(1000)), static_cast<uint64_t>(1000000));
+  }
+}
+
+// Waits until the monotonic time of `deadline_ns`, the way --pacing says.
+// Returns false if interrupted by `done`, which is checked at least every 10ms.
+bool WaitUntil(double deadline_ns, const std::atomic_bool& done) {
+  const bool hybrid = (FLAGS_pacing == "hybrid");
+  while (true) {
+    if (done) {
+      return false;
+    }
+    const uint64_t now_ns = monotonic_time_ns();
+    if (now_ns >= deadline_ns) {
+      return true;
+    }
+    const double remaining_ns = deadline_ns - now_ns;
+    if (hybrid && remaining_ns > pacing_spin_ns) {
+      SleepUntil(now_ns + static_cast<uint64_t>(std::min(remaining_ns - pacing_spin_ns, 1e7)));
+    }
+  }
+}
+
+// Pins the calling thread to the CPU core number `index`, modulo the number of cores, with --pin_threads.
+void PinThisThread(size_t index) {
+  if (FLAGS_pin_threads) {
+#ifdef __linux__
+    const size_t number_of_cores = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(index % number_of_cores, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#endif
+  }
+}
+
+// The push timestamp is written into the message as 12 hex digits, following the ':' at position 2,
+// in place of the random letters. 48 bits of nanoseconds wrap around every 78 hours,
+// thus the latency is computed modulo 2^48.
+const size_t kStampBegin = 3;
+const size_t kStampDigits = 12;
+const uint64_t kStampMask = (1ull << (4 * kStampDigits)) - 1;
+
+template <typename T_MESSAGE>
+void StampMessage(T_MESSAGE& message) {
+  if (message.size() >= kStampBegin + kStampDigits) {
+    static const char kHexDigits[] = "0123456789abcdef";
+    uint64_t stamp = monotonic_time_ns() & kStampMask;
+    message[kStampBegin - 1] = ':';
+    for (size_t i = kStampBegin + kStampDigits; i > kStampBegin; --i) {
+      message[i - 1] = kHexDigits[stamp & 15];
+      stamp >>= 4;
+    }
+  }
+}
+
+// Returns true and sets `latency_ns` if the message carries the push timestamp.
+template <typename T_MESSAGE>
+bool MessageLatency(const T_MESSAGE& message, uint64_t& latency_ns) {
+  if (message.size() < kStampBegin + kStampDigits || message[kStampBegin - 1] != ':') {
+    return false;
+  }
+  uint64_t stamp = 0;
+  for (size_t i = kStampBegin; i < kStampBegin + kStampDigits; ++i) {
+    const char c = message[i];
+    stamp = (stamp << 4) | static_cast<uint64_t>(c <= '9' ? c - '0' : c - 'a' + 10);
+  }
+  latency_ns = (monotonic_time_ns() - stamp) & kStampMask;
+  return true;
+}
+
+// Whether the queue counts how many times its consumer thread was woken up.
+template <typename T_MESSAGE_QUEUE>
+struct HasWakeupStats {
+  template <typename Q>
+  static constexpr decltype(std::declval<const Q&>().NumberOfNotifications(), bool()) Test(int) {
+    return true;
+  }
+  template <typename Q>
+  static constexpr bool Test(...) {
+    return false;
+  }
+  static constexpr bool value = Test<T_MESSAGE_QUEUE>(0);
+};
+
+template <typename T_MESSAGE_QUEUE>
+void PrintWakeupStats(const T_MESSAGE_QUEUE& queue, double seconds, std::true_type) {
+  const uint64_t notifications = queue.NumberOfNotifications();
+  const uint64_t wakeups = queue.NumberOfWakeups();
+  printf("Consumer notifications: %14llu (%.2lf per second)\n",
+         static_cast<unsigned long long>(notifications),
+         notifications / seconds);
+  printf("Consumer wakeups:       %14llu (%.2lf per second)\n",
+         static_cast<unsigned long long>(wakeups),
+         wakeups / seconds);
+}
+
+template <typename T_MESSAGE_QUEUE>
+void PrintWakeupStats(const T_MESSAGE_QUEUE&, double, std::false_type) {
+}
+
+// The number of consumer threads of the queue, which take the first CPU cores with --pin_threads.
+// Only PartitionedMQ has more than one, see its specialization below.
+template <typename T_MESSAGE_QUEUE>
+struct NumberOfConsumerThreads {
+  static size_t Get() {
+    return 1;
+  }
+};
+
 // The producer pushes the messages, of messages averaging --average_message_length bytes,
 // at the rate averaging --push_mbps.
 // The producing speed is stateful, an error is auto-corrected on sending the future events.
@@ -118,6 +446,8 @@ double wall_time_ns() {
 // either some events will be dropped, or inserting events will block the thread for longer.
 template <typename T_MESSAGE_QUEUE>
 struct Producer {
+  typedef typename T_MESSAGE_QUEUE::T_MESSAGE T_MESSAGE;
+
   T_MESSAGE_QUEUE& message_queue_;
 
   const int thread_index_;
@@ -129,9 +459,8 @@ struct Producer {
 
   int number_of_messages_pushed_ = 0;
   uint64_t total_bytes_pushed_ = 0;
-  int total_pushes_above_1ms_ = 0;
-  int total_pushes_above_10ms_ = 0;
-  int total_pushes_above_100ms_ = 0;
+  uint64_t number_of_heap_allocations_ = 0;
+  LatencyHistogram push_latency_ns_;
 
   Producer(T_MESSAGE_QUEUE& message_queue,
            int thread_index,
@@ -150,14 +479,13 @@ struct Producer {
   }
 
   void RunProducingThread(std::atomic_bool& done) {
-    double last_ns = wall_time_ns();
+    // The first cores are for the consumer threads.
+    PinThisThread(NumberOfConsumerThreads<T_MESSAGE_QUEUE>::Get() - 1 + thread_index_);
+    double last_ns = monotonic_time_ns();
     double next_cutoff_ns = last_ns;
     while (!done) {
-      while (wall_time_ns() < next_cutoff_ns) {
-        // Spin lock.
-        if (done) {
-          return;
-        }
+      if (!WaitUntil(next_cutoff_ns, done)) {
+        return;
       }
 
       const size_t message_length_in_b =
@@ -168,82 +496,285 @@ struct Producer {
 
       next_cutoff_ns += send_time_in_ns;
 
-      std::string message(message_length_in_b, ' ');
-      message[0] = '0' + ((thread_index_ / 10) % 10);
-      message[1] = '0' + (thread_index_ % 10);
-      for (size_t i = 3; i < message.length(); ++i) {
-        message[i] = d_random_letter_(rng_);
-      }
-
-      if (FLAGS_dump) {
-        printf("SEND: %s\n", message.c_str());
-      }
-
       {
-        // Send this message and measure the time it took.
-        const double ns_before = wall_time_ns();
-        message_queue_.PushMessage(message);
-        const double ns_after = wall_time_ns();
-        const double push_ns = ns_after - ns_before;
+        // Send this message and measure the time it took, and the heap allocations it made.
+        const uint64_t heap_allocations_before = number_of_heap_allocations_in_this_thread;
+        const double push_ns = PushMessage(
+            message_length_in_b,
+            std::integral_constant<bool, HasReserveMessage<T_MESSAGE_QUEUE>::value>());
+        number_of_heap_allocations_ += number_of_heap_allocations_in_this_thread - heap_allocations_before;
         ++number_of_messages_pushed_;
-        total_bytes_pushed_ += message.length();
-        if (push_ns >= 1e6) {
-          ++total_pushes_above_1ms_;
-          if (push_ns >= 1e7) {
-            ++total_pushes_above_10ms_;
-            if (push_ns >= 1e8) {
-              ++total_pushes_above_100ms_;
-            }
-          }
-        }
+        total_bytes_pushed_ += message_length_in_b;
+        push_latency_ns_.Record(static_cast<uint64_t>(std::max(push_ns, 0.0)));
       }
     }
   }
+
+  void PopulateMessage(T_MESSAGE& message, size_t message_length_in_b) {
+    message.resize(message_length_in_b);
+    message[0] = '0' + ((thread_index_ / 10) % 10);
+    message[1] = '0' + (thread_index_ % 10);
+    message[2] = ' ';
+    for (size_t i = 3; i < message.size(); ++i) {
+      message[i] = d_random_letter_(rng_);
+    }
+    // Stamp the message last, right before it is pushed.
+    StampMessage(message);
+
+    if (FLAGS_dump) {
+      printf("SEND: %.*s\n", static_cast<int>(message.size()), message.data());
+    }
+  }
+
+  // Pushes the message by copying it into the queue. Returns the time the push took, in nanoseconds.
+  double PushMessage(size_t message_length_in_b, std::false_type) {
+    T_MESSAGE message;
+    PopulateMessage(message, message_length_in_b);
+    const double ns_before = monotonic_time_ns();
+    message_queue_.PushMessage(message);
+    return monotonic_time_ns() - ns_before;
+  }
+
+  // Pushes the message by populating it in place if --zero_copy is set.
+  // Returns the time it took to reserve and to commit the slot, in nanoseconds.
+  double PushMessage(size_t message_length_in_b, std::true_type) {
+    if (!FLAGS_zero_copy) {
+      return PushMessage(message_length_in_b, std::false_type());
+    }
+    const double ns_before_reserve = monotonic_time_ns();
+    auto slot = message_queue_.ReserveMessage();
+    const double reserve_ns = monotonic_time_ns() - ns_before_reserve;
+    PopulateMessage(slot.message(), message_length_in_b);
+    const double ns_before_commit = monotonic_time_ns();
+    slot.Commit();
+    return reserve_ns + (monotonic_time_ns() - ns_before_commit);
+  }
 };
 
-// The consumer accepts the messages, at the rate averaging --process_mbps.
+// The consumer accepts the messages, at the rate averaging --process_mbps per consumer thread.
+// Thread safe, since the queues with several consumer threads call it from all of them.
 struct Consumer {
   std::atomic_bool& done_;
+  const double process_mbps_;
+  const int random_seed_;
+
+  std::atomic<int> total_messages_processed_{0};
+  std::atomic<uint64_t> total_bytes_processed_{0};
+  std::atomic<size_t> total_messages_dropped_{0};
+  std::atomic<int> total_batches_processed_{0};
+
+  // The state of one consumer thread.
+  struct ThreadState {
+    std::mt19937 rng;
+    std::exponential_distribution<> process_mbps_distribution;
+    LatencyHistogram end_to_end_latency_ns;
+    ThreadState(int random_seed, double process_mbps)
+        : rng(random_seed), process_mbps_distribution(1.0 / process_mbps) {
+    }
+  };
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadState>> thread_states_;
 
-  int total_messages_processed_ = 0;
-  uint64_t total_bytes_processed_ = 0;
-  size_t total_messages_dropped_ = 0;
+  Consumer(std::atomic_bool& done, double process_mbps, int random_seed = 0)
+      : done_(done), process_mbps_(process_mbps), random_seed_(random_seed) {
+  }
 
-  std::mt19937 rng_;
-  std::exponential_distribution<> process_mbps_distribution_;
+  // The state of the calling thread, created the first time the thread calls the consumer.
+  // The consumer thread number `i` gets pinned to the CPU core number `i`.
+  ThreadState& State() {
+    static thread_local const Consumer* owner = nullptr;
+    static thread_local ThreadState* state = nullptr;
+    if (owner != this) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const size_t thread_index = thread_states_.size();
+      thread_states_.emplace_back(
+          new ThreadState(random_seed_ + static_cast<int>(thread_index), process_mbps_));
+      state = thread_states_.back().get();
+      owner = this;
+      PinThisThread(thread_index);
+    }
+    return *state;
+  }
 
-  Consumer(std::atomic_bool& done, double process_mbps, int random_seed = 0)
-      : done_(done), rng_(random_seed), process_mbps_distribution_(1.0 / process_mbps) {
+  // End-to-end latencies of all the consumer threads.
+  LatencyHistogram EndToEndLatency() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LatencyHistogram result;
+    for (const auto& state : thread_states_) {
+      result.Merge(state->end_to_end_latency_ns);
+    }
+    return result;
   }
 
-  void OnMessage(const std::string& message, size_t dropped_count) {
+  template <typename T_MESSAGE>
+  void OnMessage(const T_MESSAGE& message, size_t dropped_count) {
+    // Dropped messages are counted even after the benchmark is over, since batching queues
+    // may only get to report them after a while.
+    total_messages_dropped_ += dropped_count;
+    ThreadState& state = State();
     if (!done_) {
-      const double timestamp_ns = wall_time_ns();
+      const double timestamp_ns = monotonic_time_ns();
+
+      uint64_t latency_ns;
+      if (MessageLatency(message, latency_ns)) {
+        state.end_to_end_latency_ns.Record(latency_ns);
+      }
 
       ++total_messages_processed_;
-      total_bytes_processed_ += message.length();
-      total_messages_dropped_ += dropped_count;
+      total_bytes_processed_ += message.size();
 
       if (FLAGS_dump) {
-        printf("RECV: %s\n", message.c_str());
+        printf("RECV: %.*s\n", static_cast<int>(message.size()), message.data());
       }
 
       // Emulate event processing delay assuming --process_mbps average processing rate.
       // Note that mathematically the processing rate will be slightly lower :) -- D.K.
-      const double rate_in_mbps = process_mbps_distribution_(rng_);
-      const double size_in_mb = 1e-6 * message.length();
+      const double rate_in_mbps = state.process_mbps_distribution(state.rng);
+      const double size_in_mb = 1e-6 * message.size();
       const double processing_time_in_s = size_in_mb / rate_in_mbps;
 
       const double wait_end_ns = timestamp_ns + 1e9 * processing_time_in_s;
-      while (wall_time_ns() < wait_end_ns) {
-        if (done_) {
-          return;
-        }
-      }
+      WaitUntil(wait_end_ns, done_);
+    }
+  }
+
+  // The batch version, used by the queues that hand over all the ready messages at once.
+  template <typename ITERATOR>
+  void OnMessages(ITERATOR begin, ITERATOR end, size_t dropped_count) {
+    if (!done_) {
+      ++total_batches_processed_;
+    }
+    for (ITERATOR it = begin; it != end; ++it) {
+      OnMessage(*it, dropped_count);
+      dropped_count = 0;
+    }
+  }
+};
+
+// The spill function for `--overflow=Spill`: Counts spilled messages and appends them to --spill_file, if set.
+struct Spiller {
+  std::mutex mutex_;
+  std::ofstream file_;
+
+  int total_messages_spilled_ = 0;
+  uint64_t total_bytes_spilled_ = 0;
+
+  Spiller() {
+    if (!FLAGS_spill_file.empty()) {
+      file_.open(FLAGS_spill_file, std::ofstream::trunc | std::ofstream::binary);
+    }
+  }
+
+  template <typename T_MESSAGE>
+  void Spill(const T_MESSAGE& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++total_messages_spilled_;
+    total_bytes_spilled_ += message.size();
+    if (file_.is_open()) {
+      file_.write(message.data(), message.size());
     }
   }
 };
 
+// Creates the queue to benchmark. Specialized for the queues that accept extra parameters.
+template <typename T_MESSAGE_QUEUE>
+struct QueueFactory {
+  static std::unique_ptr<T_MESSAGE_QUEUE> Create(Consumer& consumer, Spiller&) {
+    return std::unique_ptr<T_MESSAGE_QUEUE>(new T_MESSAGE_QUEUE(consumer));
+  }
+};
+
+// The --overflow policy of EfficientMQ, or of each partition of PartitionedMQ.
+template <typename T_MESSAGE_QUEUE>
+typename T_MESSAGE_QUEUE::OverflowPolicy OverflowPolicyFromFlags(Spiller& spiller) {
+  typedef typename T_MESSAGE_QUEUE::OverflowPolicy OverflowPolicy;
+  typedef typename T_MESSAGE_QUEUE::T_MESSAGE T_MESSAGE;
+  if (FLAGS_overflow == "DropOldest") {
+    return OverflowPolicy::DropOldest();
+  } else if (FLAGS_overflow == "DropNewest") {
+    return OverflowPolicy::DropNewest();
+  } else if (FLAGS_overflow == "BlockWithTimeout") {
+    return OverflowPolicy::BlockWithTimeout(std::chrono::milliseconds(FLAGS_block_timeout_ms));
+  } else if (FLAGS_overflow == "Spill") {
+    return OverflowPolicy::Spill([&spiller](const T_MESSAGE& message) { spiller.Spill(message); });
+  } else {
+    printf("Undefined overflow policy: '%s'.\n", FLAGS_overflow.c_str());
+    exit(-1);
+  }
+}
+
+template <typename T_MESSAGE>
+struct QueueFactory<EfficientMQ<Consumer, T_MESSAGE>> {
+  typedef EfficientMQ<Consumer, T_MESSAGE> T_MESSAGE_QUEUE;
+  static std::unique_ptr<T_MESSAGE_QUEUE> Create(Consumer& consumer, Spiller& spiller) {
+    return std::unique_ptr<T_MESSAGE_QUEUE>(
+        new T_MESSAGE_QUEUE(consumer, FLAGS_buffer_size, OverflowPolicyFromFlags<T_MESSAGE_QUEUE>(spiller)));
+  }
+};
+
+template <typename T_MESSAGE>
+struct QueueFactory<PartitionedMQ<Consumer, T_MESSAGE>> {
+  typedef PartitionedMQ<Consumer, T_MESSAGE> T_MESSAGE_QUEUE;
+  static std::unique_ptr<T_MESSAGE_QUEUE> Create(Consumer& consumer, Spiller& spiller) {
+    // The messages from the same producer go to the same partition, keyed by the index of the producer.
+    const auto partitioner = [](const T_MESSAGE& message) {
+      return static_cast<size_t>((message[0] - '0') * 10 + (message[1] - '0'));
+    };
+    return std::unique_ptr<T_MESSAGE_QUEUE>(
+        new T_MESSAGE_QUEUE(consumer,
+                            FLAGS_consumer_threads,
+                            partitioner,
+                            FLAGS_buffer_size,
+                            OverflowPolicyFromFlags<T_MESSAGE_QUEUE>(spiller)));
+  }
+};
+
+template <typename T_MESSAGE>
+struct NumberOfConsumerThreads<PartitionedMQ<Consumer, T_MESSAGE>> {
+  static size_t Get() {
+    return static_cast<size_t>(FLAGS_consumer_threads);
+  }
+};
+
+template <typename T_MESSAGE>
+struct QueueFactory<ShardedMQ<Consumer, T_MESSAGE>> {
+  typedef ShardedMQ<Consumer, T_MESSAGE> T_MESSAGE_QUEUE;
+  typedef typename T_MESSAGE_QUEUE::MergeOrder MergeOrder;
+  static std::unique_ptr<T_MESSAGE_QUEUE> Create(Consumer& consumer, Spiller&) {
+    MergeOrder merge_order;
+    if (FLAGS_shard_merge_order == "RoundRobin") {
+      merge_order = MergeOrder::RoundRobin;
+    } else if (FLAGS_shard_merge_order == "ByTimestamp") {
+      merge_order = MergeOrder::ByTimestamp;
+    } else {
+      printf("Undefined shard merge order: '%s'.\n", FLAGS_shard_merge_order.c_str());
+      exit(-1);
+    }
+    return std::unique_ptr<T_MESSAGE_QUEUE>(
+        new T_MESSAGE_QUEUE(consumer, FLAGS_shards, FLAGS_buffer_size, merge_order));
+  }
+};
+
+// Prints the percentiles of the latencies, in microseconds.
+void PrintLatencies(const char* caption, const LatencyHistogram& histogram) {
+  printf("%s p50 %.2lfus, p90 %.2lfus, p99 %.2lfus, p99.9 %.2lfus, max %.2lfus\n",
+         caption,
+         1e-3 * histogram.Percentile(50),
+         1e-3 * histogram.Percentile(90),
+         1e-3 * histogram.Percentile(99),
+         1e-3 * histogram.Percentile(99.9),
+         1e-3 * histogram.Max());
+}
+
+// The count and the percentiles of the latencies, in nanoseconds, as a JSON object.
+std::string LatenciesJSON(const LatencyHistogram& histogram) {
+  std::ostringstream os;
+  os << "{\"count\":" << histogram.Count() << ",\"p50\":" << histogram.Percentile(50)
+     << ",\"p90\":" << histogram.Percentile(90) << ",\"p99\":" << histogram.Percentile(99)
+     << ",\"p99_9\":" << histogram.Percentile(99.9) << ",\"max\":" << histogram.Max() << "}";
+  return os.str();
+}
+
 template <typename T_MESSAGE_QUEUE>
 void RunBenchmark(const std::string& queue_name) {
   const int number_of_threads = FLAGS_push_threads;
@@ -264,13 +795,24 @@ void RunBenchmark(const std::string& queue_name) {
       1e-6 * FLAGS_average_message_length,
       FLAGS_min_message_length,
       1e-6 * FLAGS_min_message_length);
+  if (FLAGS_pacing == "hybrid") {
+    printf("  paced by sleeping, then spinning for the last %.2lf us\n", 1e-3 * pacing_spin_ns);
+  } else {
+    printf("  paced by spinning\n");
+  }
+  if (FLAGS_pin_threads) {
+    printf("  with threads pinned to CPU cores\n");
+  }
 
   std::atomic_bool done(false);
 
   Consumer consumer(done, FLAGS_process_mbps);
+  Spiller spiller;
 
   {
-    T_MESSAGE_QUEUE queue(consumer);
+    const std::unique_ptr<T_MESSAGE_QUEUE> queue_instance =
+        QueueFactory<T_MESSAGE_QUEUE>::Create(consumer, spiller);
+    T_MESSAGE_QUEUE& queue = *queue_instance;
 
     std::vector<std::unique_ptr<Producer<T_MESSAGE_QUEUE>>> producers(number_of_threads);
     for (size_t i = 0; i < number_of_threads; ++i) {
@@ -308,14 +850,14 @@ void RunBenchmark(const std::string& queue_name) {
     int N2 = 0;                                // Total messages processed.
     uint64_t B2 = 0;                           // Total bytes processed.
     int M = consumer.total_messages_dropped_;  // Messages dropped.
-    int C1ms = 0, C10ms = 0, C100ms = 0;       // Total messages that took longer than { 1ms, 10ms, 100ms }.
+    uint64_t heap_allocations = 0;             // Heap allocations made by the producers to push the messages.
+    LatencyHistogram push_latency_ns;          // Push latencies across all producers.
 
     for (size_t i = 0; i < number_of_threads; ++i) {
       N += producers[i]->number_of_messages_pushed_;
       B += producers[i]->total_bytes_pushed_;
-      C1ms += producers[i]->total_pushes_above_1ms_;
-      C10ms += producers[i]->total_pushes_above_10ms_;
-      C100ms += producers[i]->total_pushes_above_100ms_;
+      heap_allocations += producers[i]->number_of_heap_allocations_;
+      push_latency_ns.Merge(producers[i]->push_latency_ns_);
     }
 
     N2 = consumer.total_messages_processed_;
@@ -325,10 +867,47 @@ void RunBenchmark(const std::string& queue_name) {
     printf(
         "Total messages parsed:  %14d (%.3lf GB, %.3lf MB/s)\n", N2, 1e-9 * B2, 1e-6 * B2 / benchmark_seconds);
     printf("Total messages dropped: %14d (%.2lf%%)\n", M, 100.0 * M / N);
+    if (spiller.total_messages_spilled_) {
+      printf("Total messages spilled: %14d (%.2lf%%, %.3lf GB)\n",
+             spiller.total_messages_spilled_,
+             100.0 * spiller.total_messages_spilled_ / N,
+             1e-9 * spiller.total_bytes_spilled_);
+    }
+    if (consumer.total_batches_processed_) {
+      printf("Total batches parsed:   %14d (%.2lf messages per batch)\n",
+             consumer.total_batches_processed_.load(),
+             1.0 * N2 / consumer.total_batches_processed_);
+    }
 
-    printf("Push time >= 1ms:   %18d (%.2lf%%)\n", C1ms, 100.0 * C1ms / N);
-    printf("Push time >= 10ms:  %18d (%.2lf%%)\n", C10ms, 100.0 * C10ms / N);
-    printf("Push time >= 100ms: %18d (%.2lf%%)\n", C100ms, 100.0 * C100ms / N);
+    PrintWakeupStats(
+        queue, benchmark_seconds, std::integral_constant<bool, HasWakeupStats<T_MESSAGE_QUEUE>::value>());
+    printf("Heap allocations:   %18llu (%.3lf per message pushed)\n",
+           static_cast<unsigned long long>(heap_allocations),
+           1.0 * heap_allocations / N);
+
+    PrintLatencies("Push latency:       ", push_latency_ns);
+    const LatencyHistogram end_to_end_latency_ns = consumer.EndToEndLatency();
+    PrintLatencies("End-to-end latency: ", end_to_end_latency_ns);
+
+    if (!FLAGS_json_file.empty()) {
+      std::ofstream json(FLAGS_json_file);
+      json << "{\"queue\":\"" << queue_name << "\""
+           << ",\"seconds\":" << benchmark_seconds << ",\"push_threads\":" << number_of_threads
+           << ",\"push_mbps_per_thread\":" << FLAGS_push_mbps_per_thread
+           << ",\"process_mbps\":" << FLAGS_process_mbps
+           << ",\"average_message_length\":" << FLAGS_average_message_length
+           << ",\"min_message_length\":" << FLAGS_min_message_length << ",\"messages_pushed\":" << N
+           << ",\"bytes_pushed\":" << B << ",\"messages_parsed\":" << N2 << ",\"bytes_parsed\":" << B2
+           << ",\"messages_dropped\":" << M << ",\"messages_spilled\":" << spiller.total_messages_spilled_
+           << ",\"consumer_threads\":" << FLAGS_consumer_threads
+           << ",\"batches_parsed\":" << consumer.total_batches_processed_
+           << ",\"heap_allocations\":" << heap_allocations
+           << ",\"push_latency_ns\":" << LatenciesJSON(push_latency_ns)
+           << ",\"end_to_end_latency_ns\":" << LatenciesJSON(end_to_end_latency_ns) << "}\n";
+      if (!json) {
+        printf("Can not write the results to '%s'.\n", FLAGS_json_file.c_str());
+      }
+    }
 
     if (FLAGS_log) {
       printf("\n");
@@ -341,18 +920,49 @@ void RunBenchmark(const std::string& queue_name) {
   }
 }
 
+// Runs the benchmark of the --queue implementation, with messages of type `T_MESSAGE`.
+template <typename T_MESSAGE>
+int RunBenchmarkOfQueue(const std::string& queue_name_suffix) {
+  if (FLAGS_queue == "EfficientMQ" && FLAGS_consumer_threads > 1) {
+    RunBenchmark<PartitionedMQ<Consumer, T_MESSAGE>>(
+        "PartitionedMQ of " + std::to_string(FLAGS_consumer_threads) + " EfficientMQ-s, overflow policy " +
+        FLAGS_overflow + queue_name_suffix);
+  } else if (FLAGS_queue == "EfficientMQ") {
+    RunBenchmark<EfficientMQ<Consumer, T_MESSAGE>>(FLAGS_queue + ", overflow policy " + FLAGS_overflow +
+                                                   (FLAGS_zero_copy ? ", zero copy" : "") + queue_name_suffix);
+  } else if (FLAGS_queue == "LockFreeMQ") {
+    RunBenchmark<LockFreeMQ<Consumer, T_MESSAGE>>(FLAGS_queue + queue_name_suffix);
+  } else if (FLAGS_queue == "ShardedMQ") {
+    RunBenchmark<ShardedMQ<Consumer, T_MESSAGE>>(FLAGS_queue + ", " + std::to_string(FLAGS_shards) +
+                                                 " shards merged " + FLAGS_shard_merge_order +
+                                                 queue_name_suffix);
+  } else if (FLAGS_queue == "SimpleMQ") {
+    RunBenchmark<SimpleMQ<Consumer, T_MESSAGE>>(FLAGS_queue + queue_name_suffix);
+  } else if (FLAGS_queue == "DummyMQ") {
+    RunBenchmark<DummyMQ<Consumer, T_MESSAGE>>(FLAGS_queue + queue_name_suffix);
+  } else {
+    printf("Undefined queue implementation: '%s'.\n", FLAGS_queue.c_str());
+    return -1;
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   if (!google::ParseCommandLineFlags(&argc, &argv, true)) {
     return -1;
   }
-  if (FLAGS_queue == "EfficientMQ") {
-    RunBenchmark<EfficientMQ<Consumer>>(FLAGS_queue);
-  } else if (FLAGS_queue == "SimpleMQ") {
-    RunBenchmark<SimpleMQ<Consumer>>(FLAGS_queue);
-  } else if (FLAGS_queue == "DummyMQ") {
-    RunBenchmark<DummyMQ<Consumer>>(FLAGS_queue);
+  if (FLAGS_pacing == "hybrid") {
+    CalibratePacing();
+  } else if (FLAGS_pacing != "spin") {
+    printf("Undefined pacing: '%s'.\n", FLAGS_pacing.c_str());
+    return -1;
+  }
+  if (FLAGS_message_type == "string") {
+    return RunBenchmarkOfQueue<std::string>("");
+  } else if (FLAGS_message_type == "payload") {
+    return RunBenchmarkOfQueue<mq::Payload<>>(", payload messages");
   } else {
-    printf("Undefined queue implementation: '%s'.\n", FLAGS_queue.c_str());
+    printf("Undefined message type: '%s'.\n", FLAGS_message_type.c_str());
     return -1;
   }
 }
@@ -0,0 +1,102 @@
+#ifndef SANDBOX_LATENCY_HISTOGRAM_H
+#define SANDBOX_LATENCY_HISTOGRAM_H
+
+// LatencyHistogram is a log-linear histogram of latencies, in the spirit of HdrHistogram.
+// Intent:    To compare queue implementations whose operations take from nanoseconds to seconds.
+// Objective: To record values in O(1) with no allocations, and to report percentiles within ~6%
+//            of the true ones.
+//
+// Each power of two is split into 16 equal buckets, and the values below 32 get one bucket each.
+// Thus, the relative error of the reported value is under 1/16, while the whole 64-bit range
+// fits into less than a thousand buckets.
+//
+// Not thread safe: keep one histogram per thread, and `Merge()` them once the threads are done.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+class LatencyHistogram final {
+ public:
+  LatencyHistogram() : buckets_(kNumberOfBuckets, 0) {
+  }
+
+  void Record(uint64_t value) {
+    ++buckets_[BucketIndex(value)];
+    ++count_;
+    max_ = std::max(max_, value);
+  }
+
+  void Merge(const LatencyHistogram& rhs) {
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      buckets_[i] += rhs.buckets_[i];
+    }
+    count_ += rhs.count_;
+    max_ = std::max(max_, rhs.max_);
+  }
+
+  uint64_t Count() const {
+    return count_;
+  }
+
+  uint64_t Max() const {
+    return max_;
+  }
+
+  // The value below or at which are `percentile` percent of the recorded values, 0 if there are none.
+  // Reports the upper bound of the bucket, but never above the maximum recorded value.
+  uint64_t Percentile(double percentile) const {
+    if (!count_) {
+      return 0;
+    }
+    const double rank = count_ * std::min(std::max(percentile, 0.0), 100.0) / 100.0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      seen += buckets_[i];
+      if (seen && seen >= rank) {
+        return std::min(BucketUpperBound(i), max_);
+      }
+    }
+    return max_;
+  }
+
+ private:
+  // The top five significant bits of the value define its bucket: 16 buckets per power of two.
+  enum : size_t { kSubBuckets = 16, kNumberOfBuckets = (64 - 4 + 1) * kSubBuckets };
+
+  // For non-zero values only.
+  static size_t MostSignificantBit(uint64_t value) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(value);
+#else
+    size_t result = 0;
+    while (value >>= 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  static size_t BucketIndex(uint64_t value) {
+    if (value < 2 * kSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    const size_t shift = MostSignificantBit(value) - 4;
+    return shift * kSubBuckets + static_cast<size_t>(value >> shift);
+  }
+
+  static uint64_t BucketUpperBound(size_t index) {
+    if (index < 2 * kSubBuckets) {
+      return index;
+    }
+    const size_t shift = index / kSubBuckets - 1;
+    const uint64_t mantissa = index % kSubBuckets + kSubBuckets;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+#endif  // SANDBOX_LATENCY_HISTOGRAM_H
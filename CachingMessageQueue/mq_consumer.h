@@ -0,0 +1,70 @@
+#ifndef SANDBOX_MQ_CONSUMER_H
+#define SANDBOX_MQ_CONSUMER_H
+
+// Hands batches of messages over to the consumer.
+//
+// A consumer may expose the batch method,
+//   template <typename ITERATOR>
+//   void OnMessages(ITERATOR begin, ITERATOR end, size_t number_of_dropped_events);
+// in which case it receives all the messages that are ready to be exported in one call.
+//
+// Consumers that only expose the per-message method,
+//   void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+// receive the messages of the batch one by one, with the number of dropped events passed along with
+// the first one.
+//
+// The choice is made at compile time.
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace mq {
+
+namespace impl {
+
+template <typename CONSUMER, typename ITERATOR>
+struct HasOnMessages {
+  template <typename C>
+  static constexpr decltype(std::declval<C&>().OnMessages(
+                                std::declval<ITERATOR>(), std::declval<ITERATOR>(), static_cast<size_t>(0)),
+                            bool()) Test(int) {
+    return true;
+  }
+  template <typename C>
+  static constexpr bool Test(...) {
+    return false;
+  }
+  static constexpr bool value = Test<CONSUMER>(0);
+};
+
+template <typename CONSUMER, typename ITERATOR>
+inline void DeliverMessages(
+    CONSUMER& consumer, ITERATOR begin, ITERATOR end, size_t number_of_dropped_events, std::true_type) {
+  consumer.OnMessages(begin, end, number_of_dropped_events);
+}
+
+template <typename CONSUMER, typename ITERATOR>
+inline void DeliverMessages(
+    CONSUMER& consumer, ITERATOR begin, ITERATOR end, size_t number_of_dropped_events, std::false_type) {
+  for (ITERATOR it = begin; it != end; ++it) {
+    consumer.OnMessage(*it, number_of_dropped_events);
+    number_of_dropped_events = 0;
+  }
+}
+
+}  // namespace impl
+
+// Delivers the non-empty range of messages [begin, end) to the consumer.
+template <typename CONSUMER, typename ITERATOR>
+inline void DeliverMessages(CONSUMER& consumer, ITERATOR begin, ITERATOR end, size_t number_of_dropped_events) {
+  impl::DeliverMessages(consumer,
+                        begin,
+                        end,
+                        number_of_dropped_events,
+                        std::integral_constant<bool, impl::HasOnMessages<CONSUMER, ITERATOR>::value>());
+}
+
+}  // namespace mq
+
+#endif  // SANDBOX_MQ_CONSUMER_H
@@ -4,13 +4,42 @@
 // EfficientMQ is an efficient in-memory layer to buffer logged events before exporting them.
 // Intent:    To buffer events before they get to be send over the network or appended to a log file.
 // Objective: To miminize the time during which the thread that emits the message to be logged is blocked.
+//
+// When the buffer is full, the behavior is defined by the overflow policy, selected in the constructor:
+// 1) DropOldest (default): The oldest message is dropped to make room for the new one.
+// 2) DropNewest:           The new message is dropped.
+// 3) BlockWithTimeout:     The pushing thread waits for up to the timeout for the room to free up,
+//                          and the new message is dropped if it does not.
+// 4) Spill:                The new message is handed over to the user-provided spill function,
+//                          for example, one that appends it to a file. The spill function is called
+//                          from the pushing thread, outside the lock, and in no particular order
+//                          with the consumer.
+// The consumer is notified of the number of dropped messages, no matter which message got dropped.
+//
+// Besides `PushMessage()`, which copies or moves the message into the buffer, messages can be
+// 1) constructed in place, in their slot of the buffer, with `EmplaceMessage(args...)`, or
+// 2) written directly into their slot of the buffer, by reserving the slot with `ReserveMessage()`,
+//    populating the message it exposes, and committing it. The slot keeps the capacity of the message
+//    that occupied it before, so, for instance, a producer can serialize into an `std::string` slot
+//    without allocating a temporary string or copying it.
+//
+// Producers only wake up the consumer thread if it is parked, and it spins for a while before parking,
+// see `mq_wakeup.h`.
 
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include "mq_consumer.h"
+#include "mq_wakeup.h"
+
 template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_BUFFER_SIZE = 1024>
 class EfficientMQ final {
  public:
@@ -19,15 +48,53 @@ class EfficientMQ final {
 
   // Type of the processor of the entries.
   // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
-  // This method will be called from one thread, which is spawned and owned by an instance of EfficientMQ.
+  // It may also expose the batch method, OnMessages(begin, end, number_of_dropped_events), see `mq_consumer.h`.
+  // These methods will be called from one thread, which is spawned and owned by an instance of EfficientMQ.
   typedef CONSUMER T_CONSUMER;
 
+  // What to do with a message pushed into the full buffer, see the top of this file.
+  enum class OverflowMode { DropOldest, DropNewest, BlockWithTimeout, Spill };
+  struct OverflowPolicy {
+    OverflowMode mode = OverflowMode::DropOldest;
+    std::chrono::milliseconds block_timeout = std::chrono::milliseconds(0);
+    std::function<void(const T_MESSAGE&)> spill;
+
+    static OverflowPolicy DropOldest() {
+      return OverflowPolicy();
+    }
+    static OverflowPolicy DropNewest() {
+      OverflowPolicy policy;
+      policy.mode = OverflowMode::DropNewest;
+      return policy;
+    }
+    static OverflowPolicy BlockWithTimeout(std::chrono::milliseconds timeout) {
+      OverflowPolicy policy;
+      policy.mode = OverflowMode::BlockWithTimeout;
+      policy.block_timeout = timeout;
+      return policy;
+    }
+    static OverflowPolicy Spill(std::function<void(const T_MESSAGE&)> spill) {
+      OverflowPolicy policy;
+      policy.mode = OverflowMode::Spill;
+      policy.spill = spill;
+      return policy;
+    }
+  };
+
   // The only constructor requires the refence to the instance of the consumer of entries.
-  explicit EfficientMQ(T_CONSUMER& consumer, size_t buffer_size = DEFAULT_BUFFER_SIZE)
+  // Throws `std::invalid_argument` if the overflow policy is to spill, but the spill function is empty.
+  explicit EfficientMQ(T_CONSUMER& consumer,
+                       size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                       const OverflowPolicy& overflow_policy = OverflowPolicy::DropOldest())
       : consumer_(consumer),
         circular_buffer_size_(buffer_size),
         circular_buffer_(circular_buffer_size_),
-        consumer_thread_(&EfficientMQ::ConsumerThread, this) {
+        overflow_policy_(overflow_policy) {
+    if (overflow_policy_.mode == OverflowMode::Spill && !overflow_policy_.spill) {
+      throw std::invalid_argument("EfficientMQ: the spill function of the overflow policy is empty.");
+    }
+    // Start the consumer thread only after all the members, the mutex included, are initialized.
+    consumer_thread_ = std::thread(&EfficientMQ::ConsumerThread, this);
   }
 
   // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
@@ -37,21 +104,157 @@ class EfficientMQ final {
       destructing_ = true;
     }
     condition_variable_.notify_all();
+    room_available_condition_variable_.notify_all();
     consumer_thread_.join();
   }
 
   // Adds an message to the buffer.
   // Supports both copy and move semantics.
+  // Returns true if the message was added or spilled, false if it was dropped due to the overflow policy.
   // THREAD SAFE. Blocks the calling thread for as short period of time as possible.
-  void PushMessage(const T_MESSAGE& message) {
-    const size_t index = PushEventAllocate();
-    circular_buffer_[index].message_body = message;
-    PushEventCommit(index);
+  bool PushMessage(const T_MESSAGE& message) {
+    size_t index;
+    const Allocation allocation = PushEventAllocate(index);
+    if (allocation == Allocation::Allocated) {
+      circular_buffer_[index].message_body = message;
+      PushEventCommit(index);
+      return true;
+    } else if (allocation == Allocation::Spill) {
+      overflow_policy_.spill(message);
+      return true;
+    } else {
+      return false;
+    }
   }
-  void PushMessage(T_MESSAGE&& message) {
-    const size_t index = PushEventAllocate(message);
-    circular_buffer_[index].message_body = std::move(message);
-    PushEventCommit(index);
+  bool PushMessage(T_MESSAGE&& message) {
+    size_t index;
+    const Allocation allocation = PushEventAllocate(index);
+    if (allocation == Allocation::Allocated) {
+      circular_buffer_[index].message_body = std::move(message);
+      PushEventCommit(index);
+      return true;
+    } else if (allocation == Allocation::Spill) {
+      overflow_policy_.spill(message);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+ private:
+  // The outcome of the attempt to allocate room in the buffer for the new message.
+  enum class Allocation { Allocated, Dropped, Spill };
+
+ public:
+  // The slot of the buffer reserved for one message, for the producer to populate the message in place.
+  // The message becomes visible to the consumer once `Commit()` is called.
+  // A slot that goes out of scope without being committed is discarded, so an exception thrown while populating
+  // the message never ships a half-written one. Keep in mind that, until the slot is committed or discarded,
+  // the messages pushed after it are held back from the consumer.
+  //
+  // If the buffer was full and the overflow policy did not let the message in, the slot exposes a message
+  // that is not a part of the buffer: it is spilled on commit with `OverflowMode::Spill`,
+  // and dropped otherwise.
+  class ReservedSlot final {
+   public:
+    ReservedSlot(ReservedSlot&& rhs)
+        : queue_(rhs.queue_),
+          index_(rhs.index_),
+          allocation_(rhs.allocation_),
+          overflow_message_(std::move(rhs.overflow_message_)),
+          done_(rhs.done_) {
+      rhs.done_ = true;
+    }
+
+    ~ReservedSlot() {
+      if (!done_) {
+        Finish(false);
+      }
+    }
+
+    // The message to populate. For messages in the buffer, it still holds the previous contents of the slot,
+    // along with their allocated capacity.
+    T_MESSAGE& message() {
+      return allocation_ == Allocation::Allocated ? queue_->circular_buffer_[index_].message_body
+                                                  : overflow_message_;
+    }
+
+    // Replaces the message with the one constructed in place from `args`.
+    template <typename... ARGS>
+    void Construct(ARGS&&... args) {
+      T_MESSAGE& target = message();
+      target.~T_MESSAGE();
+      try {
+        new (&target) T_MESSAGE(std::forward<ARGS>(args)...);
+      } catch (...) {
+        new (&target) T_MESSAGE();
+        throw;
+      }
+    }
+
+    // Publishes the message. Returns true if it was added or spilled, false if it was dropped.
+    bool Commit() {
+      return !done_ && Finish(true);
+    }
+
+    // Gives up on the message, freeing up the slot. The message is not counted as dropped.
+    void Discard() {
+      if (!done_) {
+        Finish(false);
+      }
+    }
+
+   private:
+    friend class EfficientMQ;
+    ReservedSlot(EfficientMQ* queue) : queue_(queue), allocation_(queue->PushEventAllocate(index_)) {
+    }
+
+    bool Finish(bool commit) {
+      done_ = true;
+      if (allocation_ == Allocation::Allocated) {
+        queue_->PushEventCommit(index_, !commit);
+        return commit;
+      } else if (allocation_ == Allocation::Spill && commit) {
+        queue_->overflow_policy_.spill(overflow_message_);
+        return true;
+      } else {
+        return false;
+      }
+    }
+
+    ReservedSlot(const ReservedSlot&) = delete;
+    void operator=(const ReservedSlot&) = delete;
+    void operator=(ReservedSlot&&) = delete;
+
+    EfficientMQ* queue_;
+    size_t index_ = 0;
+    Allocation allocation_;
+    T_MESSAGE overflow_message_;
+    bool done_ = false;
+  };
+
+  // The number of times producers have woken up the consumer thread, and the number of times it woke up.
+  uint64_t NumberOfNotifications() const {
+    return wakeup_.NumberOfNotifications();
+  }
+  uint64_t NumberOfWakeups() const {
+    return wakeup_.NumberOfWakeups();
+  }
+
+  // Reserves the slot for the next message, see `ReservedSlot` above.
+  // THREAD SAFE. Blocks the calling thread for as short period of time as possible.
+  ReservedSlot ReserveMessage() {
+    return ReservedSlot(this);
+  }
+
+  // Adds the message constructed in place, in its slot of the buffer, from `args`.
+  // Returns true if the message was added or spilled, false if it was dropped due to the overflow policy.
+  // THREAD SAFE. Blocks the calling thread for as short period of time as possible.
+  template <typename... ARGS>
+  bool EmplaceMessage(ARGS&&... args) {
+    ReservedSlot slot = ReserveMessage();
+    slot.Construct(std::forward<ARGS>(args)...);
+    return slot.Commit();
   }
 
  private:
@@ -65,73 +268,122 @@ class EfficientMQ final {
     i = (i + 1) % circular_buffer_size_;
   }
 
+  // Whether allocating one more message would make `head_allocated_` catch up with `tail_`.
+  // MUTEX-LOCKED by the caller.
+  bool BufferIsFull() const {
+    return (head_allocated_ + 1) % circular_buffer_size_ == tail_;
+  }
+
   // The thread which extracts fully populated events from the tail of the buffer and exports them.
+  // All the events that are ready are extracted at once, under one lock, and exported as one batch.
   void ConsumerThread() {
+    // The messages are swapped out of the circular buffer into `batch`, which makes their slots available
+    // to producers right away. Swapping keeps the allocated capacity circulating between the two vectors.
+    std::vector<T_MESSAGE> batch(circular_buffer_size_);
     while (true) {
-      size_t index;
+      size_t batch_size = 0;
       size_t this_time_dropped_events;
       {
-        // First, get an message to export. Wait until it's finalized and ready to be exported.
+        // First, get the messages to export. Wait until at least one is finalized and ready to be exported.
         // MUTEX-LOCKED, except for the conditional variable part.
-        index = tail_;
         std::unique_lock<std::mutex> lock(mutex_);
         if (head_ready_ == tail_) {
           if (destructing_) {
             return;
           }
-          condition_variable_.wait(lock, [this] { return head_ready_ != tail_ || destructing_; });
-          if (destructing_) {
+          // Spin for a while without the mutex before parking, see `mq_wakeup.h`.
+          const uint64_t number_of_commits_seen = wakeup_.NumberOfCommits();
+          lock.unlock();
+          wakeup_.Spin(number_of_commits_seen);
+          lock.lock();
+          wakeup_.ParkLocked(
+              lock, condition_variable_, [this] { return head_ready_ != tail_ || destructing_; });
+          if (head_ready_ == tail_) {
             return;
           }
         }
+        using std::swap;
+        while (tail_ != head_ready_) {
+          if (!circular_buffer_[tail_].discarded) {
+            swap(batch[batch_size++], circular_buffer_[tail_].message_body);
+          }
+          Increment(tail_);
+        }
+        if (number_of_blocked_producers_) {
+          room_available_condition_variable_.notify_all();
+        }
+        if (!batch_size) {
+          // Only discarded messages this time.
+          continue;
+        }
         this_time_dropped_events = number_of_dropped_events_;
         number_of_dropped_events_ = 0;
       }
 
       {
-        // Then, export the message.
+        // Then, export the messages.
         // NO MUTEX REQUIRED.
-        consumer_.OnMessage(circular_buffer_[index].message_body, this_time_dropped_events);
-      }
-
-      {
-        // Finally, mark the message as successfully exported.
-        // MUTEX-LOCKED.
-        std::lock_guard<std::mutex> lock(mutex_);
-        Increment(tail_);
+        mq::DeliverMessages(consumer_, batch.cbegin(), batch.cbegin() + batch_size, this_time_dropped_events);
       }
     }
   }
 
-  size_t PushEventAllocate() {
+  Allocation PushEventAllocate(size_t& index) {
     // First, allocate room in the buffer for this message.
-    // Overwrite the oldest message if have to.
-    // MUTEX-LOCKED.
-    std::lock_guard<std::mutex> lock(mutex_);
-    const size_t index = head_allocated_;
-    Increment(head_allocated_);
-    if (head_allocated_ == tail_) {
-      // Buffer overflow, must drop the least recent element and keep the count of those.
-      ++number_of_dropped_events_;
-      if (tail_ == head_ready_) {
-        Increment(head_ready_);
+    // Respect the overflow policy if the buffer is full.
+    // MUTEX-LOCKED, except for the conditional variable part.
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (BufferIsFull()) {
+      switch (overflow_policy_.mode) {
+        case OverflowMode::DropOldest:
+          if (tail_ == head_ready_) {
+            // The oldest message is still being populated by its producer, and can not be dropped.
+            // Drop this one instead.
+            ++number_of_dropped_events_;
+            return Allocation::Dropped;
+          }
+          // Buffer overflow, must drop the least recent element and keep the count of those.
+          // Discarded messages are not counted, since they would not have made it to the consumer anyway.
+          if (!circular_buffer_[tail_].discarded) {
+            ++number_of_dropped_events_;
+          }
+          Increment(tail_);
+          break;
+        case OverflowMode::DropNewest:
+          ++number_of_dropped_events_;
+          return Allocation::Dropped;
+        case OverflowMode::BlockWithTimeout:
+          ++number_of_blocked_producers_;
+          room_available_condition_variable_.wait_for(
+              lock, overflow_policy_.block_timeout, [this] { return !BufferIsFull() || destructing_; });
+          --number_of_blocked_producers_;
+          if (BufferIsFull()) {
+            ++number_of_dropped_events_;
+            return Allocation::Dropped;
+          }
+          break;
+        case OverflowMode::Spill:
+          return Allocation::Spill;
       }
-      Increment(tail_);
     }
+    index = head_allocated_;
+    Increment(head_allocated_);
     // Mark this message as incomplete, not yet ready to be sent over to the consumer.
     circular_buffer_[index].finalized = false;
-    return index;
+    return Allocation::Allocated;
   }
 
-  void PushEventCommit(const size_t index) {
+  void PushEventCommit(const size_t index, bool discarded = false) {
     // After the message has been copied over, mark it as finalized and advance `head_ready_`.
+    // A discarded message is finalized as well, and is then skipped by the consumer thread.
     // MUTEX-LOCKED.
     std::lock_guard<std::mutex> lock(mutex_);
     circular_buffer_[index].finalized = true;
+    circular_buffer_[index].discarded = discarded;
     while (head_ready_ != head_allocated_ && circular_buffer_[head_ready_].finalized) {
       Increment(head_ready_);
     }
-    condition_variable_.notify_all();
+    wakeup_.NotifyLocked(condition_variable_);
   }
 
   // The instance of the consuming side of the FIFO buffer.
@@ -144,17 +396,26 @@ class EfficientMQ final {
   // The `Entry` struct keeps the entries along with the flag describing whether the message is done being
   // populated and thus is ready to be exported. The flag is neccesary, since the message at index `i+1` might
   // chronologically get finalized before the message at index `i` does.
+  // The `discarded` flag marks the reserved slots that were given up on instead of being committed.
   struct Entry {
     T_MESSAGE message_body;
     bool finalized;
+    bool discarded;
   };
 
   // The circular buffer, of size `circular_buffer_size_`.
   std::vector<Entry> circular_buffer_;
 
-  // The number of events that have been overwritten due to buffer overflow.
+  // The number of events that have been dropped due to buffer overflow.
   size_t number_of_dropped_events_ = 0;
 
+  // What to do when the buffer is full.
+  const OverflowPolicy overflow_policy_;
+
+  // The producers waiting for the room in the buffer to free up, with `OverflowMode::BlockWithTimeout`.
+  size_t number_of_blocked_producers_ = 0;
+  std::condition_variable room_available_condition_variable_;
+
   // The thread in which the consuming process is running.
   std::thread consumer_thread_;
 
@@ -165,7 +426,7 @@ class EfficientMQ final {
   // 3) `head_allocated_`: The index of the first unallocated element,
   //     into which the next message will be written.
   // The order of "pointers" is always tail_ <= head_ready_ <= head_allocated_.
-  // The range [tail_, head_ready_) is what is ready to be extracted and sent over.
+  // The range [tail_, head_ready_) is what is ready to be extracted and sent over, in one batch.
   // The range [head_ready_, head_allocated_) is the "grey area", where the entries are already
   // assigned indexes, but their population, done by respective client threads, is not done yet.
   // All three indexes are guarded by one mutex. (This can be improved, but meh. -- D.K.)
@@ -175,6 +436,9 @@ class EfficientMQ final {
   std::mutex mutex_;
   std::condition_variable condition_variable_;
 
+  // When to notify `condition_variable_`.
+  mq::ConsumerWakeup wakeup_;
+
   // For safe thread destruction.
   bool destructing_ = false;
 };
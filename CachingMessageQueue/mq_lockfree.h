@@ -0,0 +1,217 @@
+#ifndef SANDBOX_MQ_LOCKFREE_H
+#define SANDBOX_MQ_LOCKFREE_H
+
+// LockFreeMQ is the lock-free flavor of EfficientMQ: a bounded multi-producer, single-consumer ring buffer.
+// Intent:    Same as EfficientMQ, to buffer events before they get to be sent over the network or appended to
+//            a log file.
+// Objective: To not have the threads that emit messages contend on a mutex at all.
+//
+// Producers reserve slots by atomically incrementing a 64-bit ticket counter. Each slot carries a sequence
+// number that tells which ticket the slot currently belongs to and whether its message is fully populated.
+// The sequence numbers replace EfficientMQ's `finalized` flag and its mutex-guarded `head_ready_` index.
+//
+// The overflow semantics are the same as EfficientMQ's: when the buffer is full, the oldest message is dropped,
+// and the number of dropped messages is reported to the consumer along with the next message it receives.
+//
+// The mutex and the condition variable are only used to park the consumer thread when there is nothing
+// to consume, after it has spun for a while. Producers touch them only if the consumer has advertised that
+// it is parked, see `mq_wakeup.h`.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mq_wakeup.h"
+
+template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_BUFFER_SIZE = 1024>
+class LockFreeMQ final {
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+  // This method will be called from one thread, which is spawned and owned by an instance of LockFreeMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The only constructor requires the refence to the instance of the consumer of entries.
+  // The buffer holds at least two messages: with one, the slot of the message being exported would already
+  // look free to the producer of the next one.
+  explicit LockFreeMQ(T_CONSUMER& consumer, size_t buffer_size = DEFAULT_BUFFER_SIZE)
+      : consumer_(consumer),
+        circular_buffer_size_(std::max(buffer_size, static_cast<size_t>(2))),
+        circular_buffer_(circular_buffer_size_) {
+    // Slot `i` is initially free for the message with ticket `i`.
+    for (size_t i = 0; i < circular_buffer_size_; ++i) {
+      circular_buffer_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    // Start the consumer thread only after all the members above are initialized.
+    consumer_thread_ = std::thread(&LockFreeMQ::ConsumerThread, this);
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~LockFreeMQ() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds an message to the buffer.
+  // Supports both copy and move semantics.
+  // THREAD SAFE. Does not lock any mutex unless the consumer thread is parked waiting for messages.
+  void PushMessage(const T_MESSAGE& message) {
+    const uint64_t ticket = PushEventAllocate();
+    circular_buffer_[ticket % circular_buffer_size_].message_body = message;
+    PushEventCommit(ticket);
+  }
+  void PushMessage(T_MESSAGE&& message) {
+    const uint64_t ticket = PushEventAllocate();
+    circular_buffer_[ticket % circular_buffer_size_].message_body = std::move(message);
+    PushEventCommit(ticket);
+  }
+
+  // The number of times producers have woken up the parked consumer thread, and the number of times
+  // it has woken up.
+  uint64_t NumberOfNotifications() const {
+    return wakeup_.NumberOfNotifications();
+  }
+  uint64_t NumberOfWakeups() const {
+    return wakeup_.NumberOfWakeups();
+  }
+
+ private:
+  LockFreeMQ(const LockFreeMQ&) = delete;
+  LockFreeMQ(LockFreeMQ&&) = delete;
+  void operator=(const LockFreeMQ&) = delete;
+  void operator=(LockFreeMQ&&) = delete;
+
+  // Whether the message at the tail of the buffer is populated and ready to be exported.
+  bool TailIsReady() const {
+    const uint64_t tail = tail_.load();
+    return circular_buffer_[tail % circular_buffer_size_].sequence.load() == tail + 1;
+  }
+
+  // The thread which extracts fully populated events from the tail of the buffer and exports them.
+  void ConsumerThread() {
+    // The message is swapped out of the slot before it is exported, so that the slot can be released
+    // immediately, and producers never have to wait for a slow consumer.
+    // Swapping also keeps the allocated capacity circulating between the buffer and this thread.
+    T_MESSAGE message;
+    while (true) {
+      uint64_t tail = tail_.load();
+      Entry& entry = circular_buffer_[tail % circular_buffer_size_];
+      if (entry.sequence.load(std::memory_order_acquire) == tail + 1) {
+        // The message is ready. Claim it, unless a producer has just dropped it due to buffer overflow.
+        if (tail_.compare_exchange_strong(tail, tail + 1)) {
+          using std::swap;
+          swap(message, entry.message_body);
+          entry.sequence.store(tail + circular_buffer_size_, std::memory_order_release);
+          consumer_.OnMessage(message, number_of_dropped_events_.exchange(0));
+        }
+      } else {
+        // Nothing to export. Spin for a while, then park, see `mq_wakeup.h`.
+        const uint64_t number_of_commits_seen = wakeup_.NumberOfCommits();
+        if (!TailIsReady() && !wakeup_.Spin(number_of_commits_seen)) {
+          // MUTEX-LOCKED, except for the conditional variable part.
+          std::unique_lock<std::mutex> lock(mutex_);
+          wakeup_.ParkLocked(lock, condition_variable_, [this] { return destructing_ || TailIsReady(); });
+          if (destructing_ && !TailIsReady()) {
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  // Drops the oldest messages until the one with `ticket` fits into the buffer.
+  void DropOldestMessages(const uint64_t ticket) {
+    uint64_t tail = tail_.load();
+    while (tail + circular_buffer_size_ <= ticket) {
+      if (tail_.compare_exchange_weak(tail, tail + 1)) {
+        // This thread now owns the message with ticket `tail`, which it is going to drop.
+        // Its producer may still be populating it though, so wait for that to complete first.
+        ++number_of_dropped_events_;
+        Entry& entry = circular_buffer_[tail % circular_buffer_size_];
+        while (entry.sequence.load(std::memory_order_acquire) != tail + 1) {
+          std::this_thread::yield();
+        }
+        entry.sequence.store(tail + circular_buffer_size_, std::memory_order_release);
+        // The next message after the dropped one may already be waiting for the consumer.
+        wakeup_.Notify(mutex_, condition_variable_);
+        ++tail;
+      }
+    }
+  }
+
+  uint64_t PushEventAllocate() {
+    // First, allocate room in the buffer for this message by taking the next ticket.
+    // Then wait until the slot is free for this ticket, overwriting the oldest message if have to.
+    // LOCK-FREE, except for waiting on other threads that are in the middle of copying their messages.
+    const uint64_t ticket = head_.fetch_add(1);
+    const Entry& entry = circular_buffer_[ticket % circular_buffer_size_];
+    while (entry.sequence.load(std::memory_order_acquire) != ticket) {
+      DropOldestMessages(ticket);
+      if (entry.sequence.load(std::memory_order_acquire) != ticket) {
+        std::this_thread::yield();
+      }
+    }
+    return ticket;
+  }
+
+  void PushEventCommit(const uint64_t ticket) {
+    // After the message has been copied over, mark it as ready by advancing the slot's sequence number.
+    circular_buffer_[ticket % circular_buffer_size_].sequence.store(ticket + 1);
+    wakeup_.Notify(mutex_, condition_variable_);
+  }
+
+  // The instance of the consuming side of the FIFO buffer.
+  T_CONSUMER& consumer_;
+
+  // The capacity of the circular buffer for intermediate events.
+  // Events beyond it will be dropped.
+  const size_t circular_buffer_size_;
+
+  // The `Entry` struct keeps the message along with its sequence number. For the message with ticket `t`
+  // stored in slot `t % circular_buffer_size_`, the sequence number is:
+  // 1) `t` while the slot is free for the producer with ticket `t` or is being populated by it,
+  // 2) `t + 1` once the message is populated and ready to be exported, and
+  // 3) `t + circular_buffer_size_` once it is exported or dropped, making the slot free for the next ticket.
+  struct Entry {
+    T_MESSAGE message_body;
+    std::atomic<uint64_t> sequence;
+  };
+
+  // The circular buffer, of size `circular_buffer_size_`.
+  std::vector<Entry> circular_buffer_;
+
+  // The number of events that have been overwritten due to buffer overflow.
+  std::atomic<size_t> number_of_dropped_events_{0};
+
+  // Monotonically increasing tickets: `head_` is the ticket to be given to the next message,
+  // and `tail_` is the ticket of the next message to be exported or dropped.
+  // They are kept on separate cache lines, since producers mostly touch the former and the consumer the latter.
+  std::atomic<uint64_t> head_{0};
+  char cache_line_padding_[64];
+  std::atomic<uint64_t> tail_{0};
+
+  // Used only to park the consumer thread when there are no messages to export.
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  mq::ConsumerWakeup wakeup_;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_LOCKFREE_H
@@ -0,0 +1,152 @@
+#ifndef SANDBOX_MQ_PARTITIONED_H
+#define SANDBOX_MQ_PARTITIONED_H
+
+// PartitionedMQ is EfficientMQ with several consumer threads: one EfficientMQ, and thus one thread,
+// per partition.
+// Intent:    Same as EfficientMQ, for consumers that are too slow to keep up with the producers
+//            from one thread.
+// Objective: To process messages in parallel, while keeping the order of the messages with the same key.
+//
+// Each message is routed to a partition by its key, which is either passed along with the message,
+// or computed from the message by the user-provided partitioner. The partition is the key modulo the number
+// of partitions, so the messages with the same key are always exported in the order they were pushed.
+//
+// The consumer is shared by all the partitions, and thus has to be thread safe: its methods are called
+// from as many threads as there are partitions.
+//
+// Each partition has its own buffer and overflow policy, see `mq_efficient.h`, and drops messages
+// independently. The number of dropped messages is reported to the consumer from the thread of
+// the partition they were dropped from, and is also counted per partition.
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mq_consumer.h"
+#include "mq_efficient.h"
+
+template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_BUFFER_SIZE = 1024>
+class PartitionedMQ final {
+ private:
+  class PartitionConsumer;
+
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries, see `mq_efficient.h`. Must be thread safe.
+  typedef CONSUMER T_CONSUMER;
+
+  // The queue of one partition.
+  typedef EfficientMQ<PartitionConsumer, T_MESSAGE, DEFAULT_BUFFER_SIZE> T_PARTITION;
+  typedef typename T_PARTITION::OverflowPolicy OverflowPolicy;
+
+  // Returns the partition key of the message.
+  typedef std::function<size_t(const T_MESSAGE&)> T_PARTITIONER;
+
+  // The constructor requires the refence to the instance of the consumer of entries,
+  // and the number of partitions, of which there is at least one. Without the partitioner, only the messages
+  // pushed with the key can go to partitions other than the first one.
+  PartitionedMQ(T_CONSUMER& consumer,
+                size_t number_of_partitions,
+                T_PARTITIONER partitioner = T_PARTITIONER(),
+                size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                const OverflowPolicy& overflow_policy = OverflowPolicy::DropOldest())
+      : partitioner_(partitioner) {
+    number_of_partitions = std::max(number_of_partitions, static_cast<size_t>(1));
+    for (size_t i = 0; i < number_of_partitions; ++i) {
+      consumers_.emplace_back(new PartitionConsumer(consumer));
+    }
+    for (size_t i = 0; i < number_of_partitions; ++i) {
+      partitions_.emplace_back(new T_PARTITION(*consumers_[i], buffer_size, overflow_policy));
+    }
+  }
+
+  // Adds an message to the partition of its key.
+  // Supports both copy and move semantics.
+  // Returns true if the message was added or spilled, false if it was dropped due to the overflow policy.
+  // THREAD SAFE. Only contends with the producers pushing messages into the same partition.
+  bool PushMessage(size_t key, const T_MESSAGE& message) {
+    return partitions_[key % partitions_.size()]->PushMessage(message);
+  }
+  bool PushMessage(size_t key, T_MESSAGE&& message) {
+    return partitions_[key % partitions_.size()]->PushMessage(std::move(message));
+  }
+
+  // Adds an message to the partition of the key returned by the partitioner.
+  bool PushMessage(const T_MESSAGE& message) {
+    return PushMessage(Key(message), message);
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    const size_t key = Key(message);
+    return PushMessage(key, std::move(message));
+  }
+
+  size_t NumberOfPartitions() const {
+    return partitions_.size();
+  }
+
+  // The total number of times producers have woken up the consumer threads, and the number of times
+  // they woke up.
+  uint64_t NumberOfNotifications() const {
+    uint64_t result = 0;
+    for (const auto& partition : partitions_) {
+      result += partition->NumberOfNotifications();
+    }
+    return result;
+  }
+  uint64_t NumberOfWakeups() const {
+    uint64_t result = 0;
+    for (const auto& partition : partitions_) {
+      result += partition->NumberOfWakeups();
+    }
+    return result;
+  }
+
+  // The number of messages dropped from the partition and reported to the consumer so far.
+  size_t NumberOfDroppedEvents(size_t partition) const {
+    return consumers_[partition]->number_of_dropped_events;
+  }
+
+ private:
+  PartitionedMQ(const PartitionedMQ&) = delete;
+  PartitionedMQ(PartitionedMQ&&) = delete;
+  void operator=(const PartitionedMQ&) = delete;
+  void operator=(PartitionedMQ&&) = delete;
+
+  size_t Key(const T_MESSAGE& message) const {
+    return partitioner_ ? partitioner_(message) : 0;
+  }
+
+  // Passes the messages of one partition over to the consumer, counting the dropped ones.
+  class PartitionConsumer final {
+   public:
+    explicit PartitionConsumer(T_CONSUMER& consumer) : consumer(consumer) {
+    }
+
+    void OnMessage(const T_MESSAGE& message, size_t number_of_dropped_events_if_any) {
+      number_of_dropped_events += number_of_dropped_events_if_any;
+      consumer.OnMessage(message, number_of_dropped_events_if_any);
+    }
+
+    template <typename ITERATOR>
+    void OnMessages(ITERATOR begin, ITERATOR end, size_t number_of_dropped_events_if_any) {
+      number_of_dropped_events += number_of_dropped_events_if_any;
+      mq::DeliverMessages(consumer, begin, end, number_of_dropped_events_if_any);
+    }
+
+    T_CONSUMER& consumer;
+    std::atomic<size_t> number_of_dropped_events{0};
+  };
+
+  const T_PARTITIONER partitioner_;
+
+  // The consumers go before the partitions, to outlive the threads of the partitions that call them.
+  std::vector<std::unique_ptr<PartitionConsumer>> consumers_;
+  std::vector<std::unique_ptr<T_PARTITION>> partitions_;
+};
+
+#endif  // SANDBOX_MQ_PARTITIONED_H
@@ -0,0 +1,225 @@
+#ifndef SANDBOX_MQ_PAYLOAD_H
+#define SANDBOX_MQ_PAYLOAD_H
+
+// Payload is the byte buffer to use as the message type of the queues in place of `std::string`.
+// Intent:    To serialize messages into before pushing them, as one would with `std::string`.
+// Objective: To make no heap allocations on the push path once the queue has warmed up.
+//
+// Payloads of up to INLINE_CAPACITY bytes are stored inline, and thus right in the slots of the circular
+// buffer. Longer payloads are stored in chunks with power-of-two capacities, which are taken from and
+// returned to the pool of chunks, so that each chunk is allocated once and then reused.
+//
+// Assigning a payload to the slot of the buffer reuses the chunk the slot already holds, if it is large enough,
+// and the queues swap messages between their slots and the consumer thread, so the chunks keep circulating
+// between the two. The temporary payloads producers populate before pushing them get their chunks from
+// the pool, and return them to the pool when destroyed.
+//
+// The pool keeps a small cache of free chunks per thread, and shares the rest between the threads.
+// It never frees the chunks it holds, so its size is that of the largest number of chunks in use at once.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace mq {
+
+class PayloadChunkPool final {
+ public:
+  // Returns a chunk of (1 << size_class) bytes.
+  static char* Acquire(size_t size_class) {
+    std::vector<char*>& cached = ThreadCache().free_chunks[size_class];
+    if (!cached.empty()) {
+      char* chunk = cached.back();
+      cached.pop_back();
+      return chunk;
+    }
+    {
+      Shared& shared = SharedInstance();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      std::vector<char*>& free_chunks = shared.free_chunks[size_class];
+      if (!free_chunks.empty()) {
+        char* chunk = free_chunks.back();
+        free_chunks.pop_back();
+        return chunk;
+      }
+    }
+    return new char[static_cast<size_t>(1) << size_class];
+  }
+
+  // Takes back the chunk acquired with the same `size_class`.
+  static void Release(char* chunk, size_t size_class) {
+    std::vector<char*>& cached = ThreadCache().free_chunks[size_class];
+    if (cached.size() < kThreadCacheSize) {
+      cached.push_back(chunk);
+    } else {
+      Shared& shared = SharedInstance();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      shared.free_chunks[size_class].push_back(chunk);
+    }
+  }
+
+  // The smallest size class to hold `size` bytes.
+  static size_t SizeClass(size_t size) {
+    size_t size_class = 0;
+    while ((static_cast<size_t>(1) << size_class) < size) {
+      ++size_class;
+    }
+    return size_class;
+  }
+
+ private:
+  enum : size_t { kNumberOfSizeClasses = 64, kThreadCacheSize = 16 };
+
+  struct Shared {
+    std::mutex mutex;
+    std::vector<char*> free_chunks[kNumberOfSizeClasses];
+  };
+
+  // The free chunks of the thread, handed over to the shared pool when the thread terminates.
+  struct Cache {
+    std::vector<char*> free_chunks[kNumberOfSizeClasses];
+    ~Cache() {
+      Shared& shared = SharedInstance();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      for (size_t i = 0; i < kNumberOfSizeClasses; ++i) {
+        shared.free_chunks[i].insert(shared.free_chunks[i].end(), free_chunks[i].begin(), free_chunks[i].end());
+      }
+    }
+  };
+
+  static Shared& SharedInstance() {
+    // Never destructed, to outlive the caches of the threads that terminate after `main()` returns.
+    static Shared* shared = new Shared();
+    return *shared;
+  }
+
+  static Cache& ThreadCache() {
+    static thread_local Cache cache;
+    return cache;
+  }
+};
+
+template <size_t INLINE_CAPACITY = 64>
+class Payload final {
+ public:
+  Payload() {
+  }
+
+  Payload(const char* data, size_t size) {
+    assign(data, size);
+  }
+
+  Payload(const Payload& rhs) {
+    assign(rhs.data(), rhs.size());
+  }
+
+  Payload(Payload&& rhs) : size_(rhs.size_), chunk_(rhs.chunk_), size_class_(rhs.size_class_) {
+    if (!chunk_) {
+      std::memcpy(inline_, rhs.inline_, size_);
+    }
+    rhs.size_ = 0;
+    rhs.chunk_ = nullptr;
+  }
+
+  // Keeps the chunk of this payload, if it is large enough.
+  Payload& operator=(const Payload& rhs) {
+    if (this != &rhs) {
+      assign(rhs.data(), rhs.size());
+    }
+    return *this;
+  }
+
+  // Hands the chunk of this payload over to `rhs`, for it to be reused.
+  Payload& operator=(Payload&& rhs) {
+    swap(rhs);
+    return *this;
+  }
+
+  ~Payload() {
+    if (chunk_) {
+      PayloadChunkPool::Release(chunk_, size_class_);
+    }
+  }
+
+  void swap(Payload& rhs) {
+    using std::swap;
+    swap(size_, rhs.size_);
+    swap(chunk_, rhs.chunk_);
+    swap(size_class_, rhs.size_class_);
+    std::swap_ranges(inline_, inline_ + INLINE_CAPACITY, rhs.inline_);
+  }
+
+  const char* data() const {
+    return chunk_ ? chunk_ : inline_;
+  }
+  char* data() {
+    return chunk_ ? chunk_ : inline_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return !size_;
+  }
+
+  size_t capacity() const {
+    return chunk_ ? static_cast<size_t>(1) << size_class_ : INLINE_CAPACITY;
+  }
+
+  const char& operator[](size_t index) const {
+    return data()[index];
+  }
+  char& operator[](size_t index) {
+    return data()[index];
+  }
+
+  void assign(const char* data, size_t size) {
+    Reserve(size, false);
+    std::memcpy(this->data(), data, size);
+    size_ = size;
+  }
+
+  // Unlike `std::string::resize()`, leaves the bytes past the old size uninitialized.
+  void resize(size_t size) {
+    Reserve(size, true);
+    size_ = size;
+  }
+
+  void clear() {
+    size_ = 0;
+  }
+
+ private:
+  // Makes sure the payload can hold `size` bytes, keeping its first `size_` bytes if `keep_contents` is true.
+  void Reserve(size_t size, bool keep_contents) {
+    if (size > capacity()) {
+      const size_t size_class = PayloadChunkPool::SizeClass(size);
+      char* chunk = PayloadChunkPool::Acquire(size_class);
+      if (keep_contents) {
+        std::memcpy(chunk, data(), size_);
+      }
+      if (chunk_) {
+        PayloadChunkPool::Release(chunk_, size_class_);
+      }
+      chunk_ = chunk;
+      size_class_ = size_class;
+    }
+  }
+
+  size_t size_ = 0;
+  char* chunk_ = nullptr;
+  size_t size_class_ = 0;
+  char inline_[INLINE_CAPACITY];
+};
+
+template <size_t INLINE_CAPACITY>
+inline void swap(Payload<INLINE_CAPACITY>& lhs, Payload<INLINE_CAPACITY>& rhs) {
+  lhs.swap(rhs);
+}
+
+}  // namespace mq
+
+#endif  // SANDBOX_MQ_PAYLOAD_H
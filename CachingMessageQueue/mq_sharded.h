@@ -0,0 +1,367 @@
+#ifndef SANDBOX_MQ_SHARDED_H
+#define SANDBOX_MQ_SHARDED_H
+
+// ShardedMQ is the sharded flavor of EfficientMQ: one circular buffer per producer thread, one consumer thread.
+// Intent:    Same as EfficientMQ, to buffer events before they get to be sent over the network or appended to
+//            a log file.
+// Objective: To not have many producer threads contend on the same mutex and the same cache lines.
+//
+// Each producer thread is assigned to one of the shards the first time it pushes a message into this instance,
+// round-robin among the producers of this instance.
+// With at least as many shards as there are producer threads, each producer has its shard to itself,
+// and only contends with the consumer thread, which visits the shard briefly to grab its messages.
+//
+// The consumer thread grabs all the ready messages from all the shards, and merges them in one of two ways:
+// 1) RoundRobin:  The messages are exported shard by shard, in batches, as they are in each of the shards.
+// 2) ByTimestamp: The messages are exported ordered by the time they were pushed at, across shards.
+//                 The order is only guaranteed among the messages grabbed together: a message pushed late
+//                 into a shard may be exported after the messages pushed after it into other shards.
+// Within each shard, the order of messages is always preserved.
+//
+// Like in EfficientMQ, the producer only holds the mutex of the shard to allocate the slot for its message,
+// and to mark it finalized once it is populated. The message itself is copied or moved outside the lock,
+// so that neither the consumer thread nor the other producers of the shard wait for the copy.
+//
+// When a shard is full, its oldest message is dropped to make room for the new one. If the oldest message
+// is still being populated by its producer, the new one is dropped instead.
+// The number of dropped messages is kept per shard, and is reported to the consumer with the next batch
+// of messages from that shard. With ByTimestamp, the counts of the shards the messages are grabbed from
+// are reported together.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mq_consumer.h"
+#include "mq_wakeup.h"
+
+template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_SHARD_BUFFER_SIZE = 1024>
+class ShardedMQ final {
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+  // It may also expose the batch method, OnMessages(begin, end, number_of_dropped_events), see `mq_consumer.h`.
+  // These methods will be called from one thread, which is spawned and owned by an instance of ShardedMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // How the consumer thread merges the messages from the shards, see the top of this file.
+  enum class MergeOrder { RoundRobin, ByTimestamp };
+
+  // The constructor requires the refence to the instance of the consumer of entries.
+  // By default, there is one shard per hardware thread. Each shard holds at least one message.
+  explicit ShardedMQ(T_CONSUMER& consumer,
+                     size_t number_of_shards = 0,
+                     size_t shard_buffer_size = DEFAULT_SHARD_BUFFER_SIZE,
+                     MergeOrder merge_order = MergeOrder::RoundRobin)
+      : consumer_(consumer),
+        instance_id_(NextInstanceId()),
+        number_of_shards_(number_of_shards ? number_of_shards
+                                           : std::max(std::thread::hardware_concurrency(), 1u)),
+        shard_buffer_size_(std::max(shard_buffer_size, static_cast<size_t>(1))),
+        merge_order_(merge_order) {
+    for (size_t i = 0; i < number_of_shards_; ++i) {
+      shards_.emplace_back(new Shard(shard_buffer_size_));
+    }
+    // Start the consumer thread only after all the members, the shards included, are initialized.
+    consumer_thread_ = std::thread(&ShardedMQ::ConsumerThread, this);
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~ShardedMQ() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds an message to the shard of the calling thread.
+  // Supports both copy and move semantics.
+  // THREAD SAFE. Only locks the mutex of the shard, unless the consumer thread is parked waiting for messages,
+  // and not while the message is copied over.
+  void PushMessage(const T_MESSAGE& message) {
+    Shard& shard = *shards_[ThreadIndex() % number_of_shards_];
+    size_t index;
+    if (PushEventAllocate(shard, index)) {
+      shard.entries[index].message_body = message;
+      PushEventCommit(shard, index);
+    }
+  }
+  void PushMessage(T_MESSAGE&& message) {
+    Shard& shard = *shards_[ThreadIndex() % number_of_shards_];
+    size_t index;
+    if (PushEventAllocate(shard, index)) {
+      shard.entries[index].message_body = std::move(message);
+      PushEventCommit(shard, index);
+    }
+  }
+
+  // The number of times producers have woken up the parked consumer thread, and the number of times
+  // it has woken up.
+  uint64_t NumberOfNotifications() const {
+    return wakeup_.NumberOfNotifications();
+  }
+  uint64_t NumberOfWakeups() const {
+    return wakeup_.NumberOfWakeups();
+  }
+
+ private:
+  ShardedMQ(const ShardedMQ&) = delete;
+  ShardedMQ(ShardedMQ&&) = delete;
+  void operator=(const ShardedMQ&) = delete;
+  void operator=(ShardedMQ&&) = delete;
+
+  // The message, the time it was pushed at, and whether it is done being populated by its producer.
+  struct Entry {
+    T_MESSAGE message_body;
+    uint64_t timestamp;
+    bool finalized;
+  };
+
+  // One circular buffer, and the number of messages dropped from it.
+  // The messages allocated are in the slots [head, head + size), modulo the size of the buffer.
+  // The first `ready` of them are finalized, and can be grabbed by the consumer thread. The rest
+  // are the "grey area" of EfficientMQ: some of them may still be being populated by their producers.
+  struct Shard {
+    explicit Shard(size_t buffer_size) : entries(buffer_size) {
+    }
+    std::mutex mutex;
+    std::vector<Entry> entries;
+    size_t head = 0;
+    size_t size = 0;
+    size_t ready = 0;
+    size_t number_of_dropped_events = 0;
+
+    // Shards are allocated separately, and the padding keeps the hot fields of neighboring shards apart.
+    char cache_line_padding_[64];
+  };
+
+  // The messages grabbed from one shard by the consumer thread, to be exported outside the lock of the shard.
+  struct Batch {
+    explicit Batch(size_t buffer_size) : messages(buffer_size), timestamps(buffer_size) {
+    }
+    std::vector<T_MESSAGE> messages;
+    std::vector<uint64_t> timestamps;
+    size_t size = 0;
+    size_t number_of_dropped_events = 0;
+  };
+
+  // The ids of the instances, for the threads to tell them apart. Unlike the addresses, the ids are not reused.
+  static uint64_t NextInstanceId() {
+    static std::atomic<uint64_t> next_instance_id(0);
+    return next_instance_id++;
+  }
+
+  // The sequential index of the calling thread among the producers of this instance, assigned the first time
+  // this thread pushes a message into it. Each thread remembers its index in the instance it has last pushed
+  // into, so that only the threads alternating between instances look it up under the mutex.
+  // As the ids of the threads that have exited are reused, so are their indexes, along with their shards.
+  size_t ThreadIndex() {
+    struct LastInstance {
+      uint64_t instance_id = static_cast<uint64_t>(-1);
+      size_t thread_index = 0;
+    };
+    static thread_local LastInstance last_instance;
+    if (last_instance.instance_id != instance_id_) {
+      // MUTEX-LOCKED, the mutex of the thread indexes.
+      std::lock_guard<std::mutex> lock(thread_indexes_mutex_);
+      const auto inserted = thread_indexes_.emplace(std::this_thread::get_id(), thread_indexes_.size());
+      last_instance.instance_id = instance_id_;
+      last_instance.thread_index = inserted.first->second;
+    }
+    return last_instance.thread_index;
+  }
+
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Whether any of the producers has pushed a message since the consumer thread has last looked.
+  bool HasNewMessages(uint64_t number_of_pushes_seen) const {
+    return wakeup_.NumberOfCommits() != number_of_pushes_seen;
+  }
+
+  // The thread which extracts the messages from all the shards, merges them and exports them.
+  void ConsumerThread() {
+    // Like EfficientMQ, the messages are swapped out of the shards, so that their allocated capacity keeps
+    // circulating between the buffers and this thread.
+    std::vector<Batch> batches(number_of_shards_, Batch(shard_buffer_size_));
+    std::vector<T_MESSAGE> merged(
+        merge_order_ == MergeOrder::ByTimestamp ? number_of_shards_ * shard_buffer_size_ : 0);
+    while (true) {
+      const uint64_t number_of_pushes_seen = wakeup_.NumberOfCommits();
+      size_t total_size = 0;
+      for (size_t i = 0; i < number_of_shards_; ++i) {
+        // MUTEX-LOCKED, the mutex of the shard only.
+        Shard& shard = *shards_[i];
+        Batch& batch = batches[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        using std::swap;
+        for (size_t j = 0; j < shard.ready; ++j) {
+          Entry& entry = shard.entries[(shard.head + j) % shard_buffer_size_];
+          swap(batch.messages[j], entry.message_body);
+          batch.timestamps[j] = entry.timestamp;
+        }
+        batch.size = shard.ready;
+        batch.number_of_dropped_events = 0;
+        if (batch.size) {
+          // Like in EfficientMQ, the number of dropped messages stays in the shard until there is a message
+          // to report it with.
+          batch.number_of_dropped_events = shard.number_of_dropped_events;
+          shard.number_of_dropped_events = 0;
+        }
+        shard.head = (shard.head + shard.ready) % shard_buffer_size_;
+        shard.size -= shard.ready;
+        shard.ready = 0;
+        total_size += batch.size;
+      }
+
+      if (total_size) {
+        // NO MUTEX REQUIRED.
+        if (merge_order_ == MergeOrder::RoundRobin) {
+          for (Batch& batch : batches) {
+            if (batch.size) {
+              mq::DeliverMessages(consumer_,
+                                  batch.messages.cbegin(),
+                                  batch.messages.cbegin() + batch.size,
+                                  batch.number_of_dropped_events);
+            }
+          }
+        } else {
+          MergeByTimestamp(batches, merged);
+          size_t this_time_dropped_events = 0;
+          for (const Batch& batch : batches) {
+            this_time_dropped_events += batch.number_of_dropped_events;
+          }
+          mq::DeliverMessages(
+              consumer_, merged.cbegin(), merged.cbegin() + total_size, this_time_dropped_events);
+        }
+      } else if (!wakeup_.Spin(number_of_pushes_seen)) {
+        // Nothing to export, and nothing got pushed while spinning. Park, see `mq_wakeup.h`.
+        // MUTEX-LOCKED, except for the conditional variable part.
+        std::unique_lock<std::mutex> lock(mutex_);
+        wakeup_.ParkLocked(lock,
+                           condition_variable_,
+                           [this, number_of_pushes_seen] {
+                             return destructing_ || HasNewMessages(number_of_pushes_seen);
+                           });
+        if (destructing_ && !HasNewMessages(number_of_pushes_seen)) {
+          return;
+        }
+      }
+    }
+  }
+
+  // Merges the messages from all the batches into `merged`, ordered by their timestamps.
+  // Each batch is already ordered, and there are few of them, so the earliest message is found
+  // by a linear scan.
+  void MergeByTimestamp(std::vector<Batch>& batches, std::vector<T_MESSAGE>& merged) {
+    using std::swap;
+    std::vector<size_t> positions(batches.size(), 0);
+    size_t merged_size = 0;
+    while (true) {
+      size_t earliest = batches.size();
+      for (size_t i = 0; i < batches.size(); ++i) {
+        if (positions[i] < batches[i].size &&
+            (earliest == batches.size() ||
+             batches[i].timestamps[positions[i]] < batches[earliest].timestamps[positions[earliest]])) {
+          earliest = i;
+        }
+      }
+      if (earliest == batches.size()) {
+        return;
+      }
+      swap(merged[merged_size++], batches[earliest].messages[positions[earliest]++]);
+    }
+  }
+
+  // Allocates the slot in the shard for the new message, dropping the oldest message if the shard is full.
+  // Returns false if the new message is dropped instead, as the oldest one is still being populated.
+  bool PushEventAllocate(Shard& shard, size_t& index) {
+    // MUTEX-LOCKED, the mutex of the shard.
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.size == shard_buffer_size_) {
+      if (!shard.ready) {
+        // The oldest message is still being populated by its producer, and can not be dropped.
+        // Drop this one instead.
+        ++shard.number_of_dropped_events;
+        return false;
+      }
+      // Shard overflow, must drop the least recent element and keep the count of those.
+      shard.head = (shard.head + 1) % shard_buffer_size_;
+      --shard.size;
+      --shard.ready;
+      ++shard.number_of_dropped_events;
+    }
+    index = (shard.head + shard.size) % shard_buffer_size_;
+    ++shard.size;
+    Entry& entry = shard.entries[index];
+    // Mark this message as incomplete, not yet ready to be grabbed by the consumer.
+    entry.finalized = false;
+    if (merge_order_ == MergeOrder::ByTimestamp) {
+      entry.timestamp = Now();
+    }
+    return true;
+  }
+
+  void PushEventCommit(Shard& shard, const size_t index) {
+    {
+      // After the message has been copied over, mark it as finalized, and extend the ready messages
+      // over the finalized ones that follow.
+      // MUTEX-LOCKED, the mutex of the shard.
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.entries[index].finalized = true;
+      while (shard.ready != shard.size &&
+             shard.entries[(shard.head + shard.ready) % shard_buffer_size_].finalized) {
+        ++shard.ready;
+      }
+    }
+    // Let the consumer thread know, waking it up if it is parked.
+    wakeup_.Notify(mutex_, condition_variable_);
+  }
+
+  // The instance of the consuming side of the FIFO buffer.
+  T_CONSUMER& consumer_;
+
+  // The producer threads of this instance, with their indexes, assigned in the order of their first pushes.
+  const uint64_t instance_id_;
+  std::mutex thread_indexes_mutex_;
+  std::map<std::thread::id, size_t> thread_indexes_;
+
+  // The number of shards, and the capacity of the circular buffer of each of them.
+  // Events beyond it will be dropped.
+  const size_t number_of_shards_;
+  const size_t shard_buffer_size_;
+
+  const MergeOrder merge_order_;
+
+  // The shards, allocated separately to be on separate cache lines.
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // Used only to park the consumer thread when there are no messages to export.
+  // Also counts the messages pushed, for the consumer thread to tell whether it has anything to do.
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  mq::ConsumerWakeup wakeup_;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_SHARDED_H
@@ -4,12 +4,18 @@
 // SimpleMQ blocks message sending thread until the message is added to the queue.
 // Used by the benchmark as an example of the queue that blocks the thread for the entire data copy operation,
 // but does not drop any messages.
+//
+// Producers only wake up the consumer thread if it is parked, see `mq_wakeup.h`.
 
 #include <condition_variable>
 #include <deque>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
+
+#include "mq_consumer.h"
+#include "mq_wakeup.h"
 
 template <typename CONSUMER, typename MESSAGE = std::string>
 class SimpleMQ final {
@@ -17,8 +23,9 @@ class SimpleMQ final {
   typedef MESSAGE T_MESSAGE;
   typedef CONSUMER T_CONSUMER;
 
-  explicit SimpleMQ(T_CONSUMER& consumer)
-      : consumer_(consumer), consumer_thread_(&SimpleMQ::ConsumerThread, this) {
+  explicit SimpleMQ(T_CONSUMER& consumer) : consumer_(consumer) {
+    // Start the consumer thread only after all the members, the mutex included, are initialized.
+    consumer_thread_ = std::thread(&SimpleMQ::ConsumerThread, this);
   }
 
   ~SimpleMQ() {
@@ -33,30 +40,46 @@ class SimpleMQ final {
   void PushMessage(const T_MESSAGE& message) {
     std::lock_guard<std::mutex> lock(mutex_);
     deque_.push_back(message);
-    condition_variable_.notify_all();
+    wakeup_.NotifyLocked(condition_variable_);
   }
 
   void PushMessage(T_MESSAGE&& message) {
     std::lock_guard<std::mutex> lock(mutex_);
-    deque_.emplace_back(message);
-    condition_variable_.notify_all();
+    deque_.push_back(std::move(message));
+    wakeup_.NotifyLocked(condition_variable_);
+  }
+
+  uint64_t NumberOfNotifications() const {
+    return wakeup_.NumberOfNotifications();
+  }
+  uint64_t NumberOfWakeups() const {
+    return wakeup_.NumberOfWakeups();
   }
 
  private:
+  // Takes all the queued messages at once, under one lock, and exports them as one batch, without the lock.
   void ConsumerThread() {
-    std::unique_lock<std::mutex> lock(mutex_);
+    std::deque<T_MESSAGE> batch;
     while (true) {
-      if (deque_.empty()) {
-        if (destructing_) {
-          return;
-        }
-        condition_variable_.wait(lock, [this] { return !deque_.empty() || destructing_; });
-        if (destructing_) {
-          return;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (deque_.empty()) {
+          if (destructing_) {
+            return;
+          }
+          const uint64_t number_of_commits_seen = wakeup_.NumberOfCommits();
+          lock.unlock();
+          wakeup_.Spin(number_of_commits_seen);
+          lock.lock();
+          wakeup_.ParkLocked(lock, condition_variable_, [this] { return !deque_.empty() || destructing_; });
+          if (deque_.empty()) {
+            return;
+          }
         }
+        batch.swap(deque_);
       }
-      consumer_.OnMessage(deque_.front(), 0);
-      deque_.pop_front();
+      mq::DeliverMessages(consumer_, batch.cbegin(), batch.cend(), 0);
+      batch.clear();
     }
   }
 
@@ -66,6 +89,7 @@ class SimpleMQ final {
   bool destructing_ = false;
   std::mutex mutex_;
   std::condition_variable condition_variable_;
+  mq::ConsumerWakeup wakeup_;
 };
 
 #endif  // SANDBOX_MQ_SIMPLE_H
@@ -0,0 +1,133 @@
+#ifndef SANDBOX_MQ_WAKEUP_H
+#define SANDBOX_MQ_WAKEUP_H
+
+// Wakes up the consumer thread of the queue only when it is parked, instead of notifying it on every message.
+//
+// The protocol, for the queues that guard their state by one mutex:
+// 1) Once the consumer thread runs out of messages, it releases the mutex and spins for a while,
+//    watching the counter of committed messages, which producers bump without any extra locking.
+// 2) If nothing got committed while spinning, the consumer thread takes the mutex again, advertises itself
+//    as parked, and waits on the condition variable.
+// 3) Producers commit their messages with the mutex locked, as before, and only notify the condition variable
+//    if the consumer is parked. As long as the consumer keeps up with the producers, there are
+//    no notifications.
+//
+// The queues that commit messages without the mutex, LockFreeMQ and ShardedMQ, use `Notify()` instead,
+// which only takes the mutex if the consumer has advertised itself as parked. The consumer sets the flag
+// before checking for messages for the last time, and producers check it after committing their messages,
+// so either the producer sees the flag, or the consumer sees the message.
+//
+// The spin is adaptive: it gets longer each time it catches a message, and shorter each time it does not,
+// so that the consumer of a queue with sparse messages parks right away instead of burning the CPU.
+//
+// Counts the notifications and the wakeups, for the benchmark to report.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace mq {
+
+class ConsumerWakeup final {
+ public:
+  // Called by producers, with the mutex locked, once their message is ready to be exported.
+  void NotifyLocked(std::condition_variable& condition_variable) {
+    number_of_commits_.fetch_add(1, std::memory_order_release);
+    NotifyIfParkedLocked(condition_variable);
+  }
+
+  // Called by producers that commit their messages without locking the mutex. Only locks it to notify
+  // the condition variable if the consumer thread is parked.
+  void Notify(std::mutex& mutex, std::condition_variable& condition_variable) {
+    number_of_commits_.fetch_add(1);
+    if (consumer_parked_.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      NotifyIfParkedLocked(condition_variable);
+    }
+  }
+
+  // The number of messages committed so far. Taken by the consumer thread before releasing the mutex to spin.
+  uint64_t NumberOfCommits() const {
+    return number_of_commits_.load(std::memory_order_acquire);
+  }
+
+  // Called by the consumer thread, without the mutex. Spins until a message is committed after
+  // `number_of_commits_seen`, or until the spin budget runs out. Returns true in the former case.
+  bool Spin(uint64_t number_of_commits_seen) {
+    for (uint32_t i = 0; i < spin_iterations_; ++i) {
+      if (NumberOfCommits() != number_of_commits_seen) {
+        spin_iterations_ = std::min(spin_iterations_ * 2, static_cast<uint32_t>(kMaxSpinIterations));
+        return true;
+      }
+      if ((i + 1) % kIterationsPerYield) {
+        Pause();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    spin_iterations_ = std::max(spin_iterations_ / 2, static_cast<uint32_t>(kMinSpinIterations));
+    return false;
+  }
+
+  // Called by the consumer thread, with the mutex locked. Parks until the predicate holds.
+  template <typename PREDICATE>
+  void ParkLocked(std::unique_lock<std::mutex>& lock,
+                  std::condition_variable& condition_variable,
+                  PREDICATE predicate) {
+    while (true) {
+      consumer_parked_.store(true);
+      if (predicate()) {
+        break;
+      }
+      condition_variable.wait(lock);
+      ++number_of_wakeups_;
+    }
+    consumer_parked_.store(false);
+  }
+
+  // The number of times producers have notified the parked consumer thread.
+  uint64_t NumberOfNotifications() const {
+    return number_of_notifications_;
+  }
+
+  // The number of times the consumer thread has woken up while parked.
+  uint64_t NumberOfWakeups() const {
+    return number_of_wakeups_;
+  }
+
+ private:
+  enum : uint32_t { kMinSpinIterations = 16, kMaxSpinIterations = 16384, kIterationsPerYield = 64 };
+
+  void NotifyIfParkedLocked(std::condition_variable& condition_variable) {
+    if (consumer_parked_.load()) {
+      // Once notified, the consumer thread is no longer parked, so that other producers do not notify it again
+      // before it gets to run.
+      consumer_parked_.store(false);
+      ++number_of_notifications_;
+      condition_variable.notify_one();
+    }
+  }
+
+  static void Pause() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#endif
+  }
+
+  // Modified with the mutex of the queue locked. Read without it by `Notify()`.
+  std::atomic_bool consumer_parked_{false};
+
+  // Only touched by the consumer thread.
+  uint32_t spin_iterations_ = 1024;
+
+  std::atomic<uint64_t> number_of_commits_{0};
+  std::atomic<uint64_t> number_of_notifications_{0};
+  std::atomic<uint64_t> number_of_wakeups_{0};
+};
+
+}  // namespace mq
+
+#endif  // SANDBOX_MQ_WAKEUP_H
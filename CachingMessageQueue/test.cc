@@ -0,0 +1,887 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mq_efficient.h"
+#include "mq_lockfree.h"
+#include "mq_partitioned.h"
+#include "mq_payload.h"
+#include "mq_sharded.h"
+#include "mq_simple.h"
+
+#include "../Bricks/3party/gtest/gtest.h"
+#include "../Bricks/3party/gtest/gtest-main.h"
+
+// Collects the messages, "{producer} {index}", and the number of dropped ones.
+struct CollectingConsumer {
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    messages.push_back(message);
+    dropped += number_of_dropped_events;
+  }
+  std::vector<std::string> messages;
+  size_t dropped = 0;
+};
+
+// Holds the consumer thread in its first `OnMessage()` until opened, so that the buffer fills up meanwhile.
+struct GatedConsumer {
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    std::unique_lock<std::mutex> lock(mutex);
+    messages.push_back(message);
+    dropped_with_each_message.push_back(number_of_dropped_events);
+    dropped += number_of_dropped_events;
+    entered = true;
+    condition_variable.notify_all();
+    condition_variable.wait(lock, [this] { return open; });
+  }
+  void WaitUntilEntered() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition_variable.wait(lock, [this] { return entered; });
+  }
+  void Open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    open = true;
+    condition_variable.notify_all();
+  }
+  std::mutex mutex;
+  std::condition_variable condition_variable;
+  bool entered = false;
+  bool open = false;
+  std::vector<std::string> messages;
+  std::vector<size_t> dropped_with_each_message;
+  size_t dropped = 0;
+};
+
+// Same as GatedConsumer, but takes the messages in batches, with the batch method preferred over the other one.
+struct GatedBatchConsumer : GatedConsumer {
+  template <typename ITERATOR>
+  void OnMessages(ITERATOR begin, ITERATOR end, size_t number_of_dropped_events) {
+    std::unique_lock<std::mutex> lock(mutex);
+    batches.emplace_back(begin, end);
+    dropped_with_each_batch.push_back(number_of_dropped_events);
+    entered = true;
+    condition_variable.notify_all();
+    condition_variable.wait(lock, [this] { return open; });
+  }
+  std::vector<std::vector<std::string>> batches;
+  std::vector<size_t> dropped_with_each_batch;
+};
+
+// Counts the messages, for the test to wait until the consumer thread has exported them.
+struct CountingConsumer {
+  void OnMessage(const std::string&, size_t) {
+    ++count;
+  }
+  std::atomic<size_t> count{0};
+};
+
+// Pushes the messages one by one, each after the consumer thread has spun out and parked,
+// so that each of them has to wake it up.
+template <typename MQ>
+void PushSparseMessages() {
+  CountingConsumer consumer;
+  MQ mq(consumer);
+  for (size_t i = 0; i < 3; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    mq.PushMessage("message");
+    while (consumer.count != i + 1) {
+      std::this_thread::yield();
+    }
+  }
+  EXPECT_LE(1u, mq.NumberOfNotifications());
+  EXPECT_LE(1u, mq.NumberOfWakeups());
+}
+
+TEST(LockFreeMQTest, ParkedConsumerIsWokenUp) {
+  PushSparseMessages<LockFreeMQ<CountingConsumer>>();
+}
+
+TEST(ShardedMQTest, ParkedConsumerIsWokenUp) {
+  PushSparseMessages<ShardedMQ<CountingConsumer>>();
+}
+
+// The buffers of under two messages are grown to two, so that no message is overwritten before it is exported.
+TEST(LockFreeMQTest, TinyBuffersHoldTwoMessages) {
+  for (size_t buffer_size : {0u, 1u, 2u}) {
+    const size_t kProducers = 4;
+    const size_t kMessages = 10000;
+    CollectingConsumer consumer;
+    {
+      LockFreeMQ<CollectingConsumer> mq(consumer, buffer_size);
+      std::vector<std::thread> producers;
+      for (size_t p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&mq, p]() {
+          for (size_t i = 0; i < kMessages; ++i) {
+            mq.PushMessage(std::to_string(p) + ' ' + std::to_string(i));
+          }
+        });
+      }
+      for (auto& producer : producers) {
+        producer.join();
+      }
+    }
+    // Every message is either exported or dropped, and the exported ones of each producer are in order.
+    EXPECT_EQ(kProducers * kMessages, consumer.messages.size() + consumer.dropped) << buffer_size;
+    std::vector<int> last_index(kProducers, -1);
+    for (const std::string& message : consumer.messages) {
+      const size_t space = message.find(' ');
+      const size_t p = std::stoul(message.substr(0, space));
+      const int index = std::stoi(message.substr(space + 1));
+      ASSERT_LT(p, kProducers);
+      EXPECT_LT(last_index[p], index) << buffer_size;
+      last_index[p] = index;
+    }
+  }
+}
+
+typedef EfficientMQ<GatedConsumer> GatedEfficientMQ;
+
+// Has the consumer thread take "0" and hold on to it, then fills up the buffer of four, which takes three more.
+static void FillUpBuffer(GatedEfficientMQ& mq, GatedConsumer& consumer) {
+  EXPECT_TRUE(mq.PushMessage("0"));
+  consumer.WaitUntilEntered();
+  EXPECT_TRUE(mq.PushMessage("1"));
+  EXPECT_TRUE(mq.PushMessage("2"));
+  EXPECT_TRUE(mq.PushMessage("3"));
+}
+
+TEST(EfficientMQTest, DropOldest) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(consumer, 4, GatedEfficientMQ::OverflowPolicy::DropOldest());
+    FillUpBuffer(mq, consumer);
+    EXPECT_TRUE(mq.PushMessage("4"));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "2", "3", "4"}), consumer.messages);
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, DropNewest) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(consumer, 4, GatedEfficientMQ::OverflowPolicy::DropNewest());
+    FillUpBuffer(mq, consumer);
+    EXPECT_FALSE(mq.PushMessage("4"));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, BatchConsumerGetsAllTheReadyMessagesInOneCall) {
+  GatedBatchConsumer consumer;
+  {
+    typedef EfficientMQ<GatedBatchConsumer> GatedBatchEfficientMQ;
+    GatedBatchEfficientMQ mq(consumer, 4, GatedBatchEfficientMQ::OverflowPolicy::DropNewest());
+    EXPECT_TRUE(mq.PushMessage("0"));
+    consumer.WaitUntilEntered();
+    EXPECT_TRUE(mq.PushMessage("1"));
+    EXPECT_TRUE(mq.PushMessage("2"));
+    EXPECT_TRUE(mq.PushMessage("3"));
+    EXPECT_FALSE(mq.PushMessage("4"));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::vector<std::string>>({{"0"}, {"1", "2", "3"}}), consumer.batches);
+  EXPECT_EQ(std::vector<size_t>({0, 1}), consumer.dropped_with_each_batch);
+  EXPECT_TRUE(consumer.messages.empty());
+}
+
+TEST(EfficientMQTest, MessageConsumerGetsTheDroppedCountWithTheFirstMessageOfTheBatch) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(consumer, 4, GatedEfficientMQ::OverflowPolicy::DropNewest());
+    FillUpBuffer(mq, consumer);
+    EXPECT_FALSE(mq.PushMessage("4"));
+    EXPECT_FALSE(mq.PushMessage("5"));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  EXPECT_EQ(std::vector<size_t>({0, 2, 0, 0}), consumer.dropped_with_each_message);
+}
+
+// Has the consumer thread hold on to "0" while "1", "2" and "3" are queued, and the queue is destructed.
+template <typename MQ, typename CONSUMER>
+void DestructQueueWithMessagesQueued(CONSUMER& consumer) {
+  std::thread opener;
+  {
+    MQ mq(consumer);
+    mq.PushMessage("0");
+    consumer.WaitUntilEntered();
+    mq.PushMessage("1");
+    mq.PushMessage("2");
+    mq.PushMessage("3");
+    // Let the consumer thread go once the destructor has, most likely, started waiting for it.
+    opener = std::thread([&consumer]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      consumer.Open();
+    });
+  }
+  opener.join();
+}
+
+TEST(EfficientMQTest, DestructorExportsTheQueuedMessages) {
+  GatedConsumer consumer;
+  DestructQueueWithMessagesQueued<GatedEfficientMQ>(consumer);
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  GatedBatchConsumer batch_consumer;
+  DestructQueueWithMessagesQueued<EfficientMQ<GatedBatchConsumer>>(batch_consumer);
+  EXPECT_EQ(std::vector<std::vector<std::string>>({{"0"}, {"1", "2", "3"}}), batch_consumer.batches);
+}
+
+TEST(SimpleMQTest, DestructorExportsTheQueuedMessages) {
+  GatedConsumer consumer;
+  DestructQueueWithMessagesQueued<SimpleMQ<GatedConsumer>>(consumer);
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  GatedBatchConsumer batch_consumer;
+  DestructQueueWithMessagesQueued<SimpleMQ<GatedBatchConsumer>>(batch_consumer);
+  EXPECT_EQ(std::vector<std::vector<std::string>>({{"0"}, {"1", "2", "3"}}), batch_consumer.batches);
+}
+
+TEST(EfficientMQTest, BlockWithTimeoutDropsOnceTimedOut) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(
+        consumer, 4, GatedEfficientMQ::OverflowPolicy::BlockWithTimeout(std::chrono::milliseconds(10)));
+    FillUpBuffer(mq, consumer);
+    const auto begin = std::chrono::steady_clock::now();
+    EXPECT_FALSE(mq.PushMessage("4"));
+    EXPECT_GE(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(10));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, BlockWithTimeoutWaitsForRoom) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(
+        consumer, 4, GatedEfficientMQ::OverflowPolicy::BlockWithTimeout(std::chrono::minutes(1)));
+    FillUpBuffer(mq, consumer);
+    std::atomic_bool pushed(false);
+    std::thread producer([&mq, &pushed]() {
+      EXPECT_TRUE(mq.PushMessage("4"));
+      pushed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(pushed);
+    consumer.Open();
+    producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3", "4"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, Spill) {
+  GatedConsumer consumer;
+  std::vector<std::string> spilled;
+  {
+    GatedEfficientMQ mq(consumer,
+                        4,
+                        GatedEfficientMQ::OverflowPolicy::Spill(
+                            [&spilled](const std::string& message) { spilled.push_back(message); }));
+    FillUpBuffer(mq, consumer);
+    EXPECT_TRUE(mq.PushMessage("4"));
+    EXPECT_TRUE(mq.PushMessage(std::string("5")));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3"}), consumer.messages);
+  EXPECT_EQ(std::vector<std::string>({"4", "5"}), spilled);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, SpillWithNoFunctionIsRejected) {
+  GatedConsumer consumer;
+  consumer.Open();
+  EXPECT_THROW(GatedEfficientMQ(consumer, 4, GatedEfficientMQ::OverflowPolicy::Spill(nullptr)),
+               std::invalid_argument);
+}
+
+TEST(EfficientMQTest, ReservedSlotIsExportedOnceCommitted) {
+  CollectingConsumer consumer;
+  {
+    EfficientMQ<CollectingConsumer> mq(consumer);
+    auto slot = mq.ReserveMessage();
+    slot.message() = "reserved";
+    // The messages pushed after the reserved slot are held back until it is committed.
+    EXPECT_TRUE(mq.PushMessage("pushed"));
+    // The slot is move-only, and the moved-from one no longer owns it.
+    auto moved_slot = std::move(slot);
+    EXPECT_FALSE(slot.Commit());
+    EXPECT_TRUE(moved_slot.Commit());
+    EXPECT_FALSE(moved_slot.Commit());
+    EXPECT_TRUE(mq.EmplaceMessage(3u, 'x'));
+  }
+  EXPECT_EQ(std::vector<std::string>({"reserved", "pushed", "xxx"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, DiscardedSlotIsSkippedAndNotCountedAsDropped) {
+  CollectingConsumer consumer;
+  {
+    EfficientMQ<CollectingConsumer> mq(consumer);
+    EXPECT_TRUE(mq.PushMessage("before"));
+    {
+      auto slot = mq.ReserveMessage();
+      slot.message() = "discarded";
+      EXPECT_TRUE(mq.PushMessage("after"));
+      slot.Discard();
+    }
+    {
+      // Going out of scope uncommitted discards the slot as well.
+      auto slot = mq.ReserveMessage();
+      slot.message() = "abandoned";
+    }
+    EXPECT_TRUE(mq.PushMessage("last"));
+  }
+  EXPECT_EQ(std::vector<std::string>({"before", "after", "last"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, DiscardedSlotIsNotCountedAsDroppedOnOverflow) {
+  GatedConsumer consumer;
+  {
+    GatedEfficientMQ mq(consumer, 4, GatedEfficientMQ::OverflowPolicy::DropOldest());
+    EXPECT_TRUE(mq.PushMessage("0"));
+    consumer.WaitUntilEntered();
+    mq.ReserveMessage().Discard();
+    EXPECT_TRUE(mq.PushMessage("2"));
+    EXPECT_TRUE(mq.PushMessage("3"));
+    // The oldest slot, the discarded one, makes room for the new message.
+    EXPECT_TRUE(mq.PushMessage("4"));
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "2", "3", "4"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQTest, ThrowingConstructorDiscardsTheSlot) {
+  CollectingConsumer consumer;
+  {
+    EfficientMQ<CollectingConsumer> mq(consumer);
+    EXPECT_TRUE(mq.PushMessage("before"));
+    // `std::string(const std::string&, size_t)` throws for the position past the end of the string.
+    EXPECT_THROW(mq.EmplaceMessage(std::string("abc"), static_cast<size_t>(10)), std::out_of_range);
+    EXPECT_TRUE(mq.PushMessage("after"));
+  }
+  EXPECT_EQ(std::vector<std::string>({"before", "after"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+typedef ShardedMQ<GatedConsumer> GatedShardedMQ;
+
+// Pushes the messages "1", "2", ..., one by one, each from a thread of its own.
+// The threads are assigned to the shards round-robin, so, with two shards, the messages alternate between them.
+// The threads are kept alive until all of them have pushed, for none of them to reuse the id of another one.
+static void PushFromNewThreads(GatedShardedMQ& mq, size_t number_of_messages) {
+  std::promise<void> all_pushed;
+  const std::shared_future<void> all_pushed_future = all_pushed.get_future().share();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i <= number_of_messages; ++i) {
+    std::promise<void> pushed;
+    std::future<void> pushed_future = pushed.get_future();
+    threads.emplace_back(
+        [&mq, i, all_pushed_future](std::promise<void> pushed) {
+          mq.PushMessage(std::to_string(i));
+          pushed.set_value();
+          all_pushed_future.wait();
+        },
+        std::move(pushed));
+    pushed_future.wait();
+  }
+  all_pushed.set_value();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+TEST(ShardedMQTest, RoundRobinKeepsTheOrderWithinEachShard) {
+  GatedConsumer consumer;
+  {
+    GatedShardedMQ mq(consumer, 2, 16, GatedShardedMQ::MergeOrder::RoundRobin);
+    mq.PushMessage("0");
+    consumer.WaitUntilEntered();
+    PushFromNewThreads(mq, 4);
+    consumer.Open();
+  }
+  ASSERT_EQ(5u, consumer.messages.size());
+  const std::vector<std::string> exported(consumer.messages.begin() + 1, consumer.messages.end());
+  EXPECT_TRUE(exported == std::vector<std::string>({"1", "3", "2", "4"}) ||
+              exported == std::vector<std::string>({"2", "4", "1", "3"}));
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(ShardedMQTest, ProducersAreAssignedToShardsPerInstance) {
+  GatedConsumer consumer;
+  GatedConsumer other_consumer;
+  {
+    GatedShardedMQ mq(consumer, 2, 16, GatedShardedMQ::MergeOrder::RoundRobin);
+    GatedShardedMQ other_mq(other_consumer, 2, 16, GatedShardedMQ::MergeOrder::RoundRobin);
+    mq.PushMessage("0");
+    consumer.WaitUntilEntered();
+    // The producers of the other instance do not shift the producers of this one between the shards.
+    std::thread([&other_mq]() { other_mq.PushMessage("other"); }).join();
+    PushFromNewThreads(mq, 2);
+    consumer.Open();
+    other_consumer.Open();
+  }
+  // The first shard, of "0" and "2", is exported first.
+  EXPECT_EQ(std::vector<std::string>({"0", "2", "1"}), consumer.messages);
+  EXPECT_EQ(std::vector<std::string>({"other"}), other_consumer.messages);
+}
+
+TEST(ShardedMQTest, ByTimestampMergesAcrossShards) {
+  GatedConsumer consumer;
+  {
+    GatedShardedMQ mq(consumer, 2, 16, GatedShardedMQ::MergeOrder::ByTimestamp);
+    mq.PushMessage("0");
+    consumer.WaitUntilEntered();
+    PushFromNewThreads(mq, 4);
+    consumer.Open();
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3", "4"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(ShardedMQTest, FullShardDropsItsOldestMessage) {
+  for (size_t buffer_size : {0u, 1u, 2u}) {
+    // The shards of no messages are grown to one.
+    const size_t capacity = std::max(buffer_size, static_cast<size_t>(1));
+    GatedConsumer consumer;
+    {
+      GatedShardedMQ mq(consumer, 1, buffer_size);
+      mq.PushMessage("0");
+      consumer.WaitUntilEntered();
+      for (size_t i = 1; i <= 3; ++i) {
+        mq.PushMessage(std::to_string(i));
+      }
+      consumer.Open();
+    }
+    std::vector<std::string> expected({"0"});
+    for (size_t i = 4 - capacity; i <= 3; ++i) {
+      expected.push_back(std::to_string(i));
+    }
+    EXPECT_EQ(expected, consumer.messages) << buffer_size;
+    EXPECT_EQ(3 - capacity, consumer.dropped) << buffer_size;
+  }
+}
+
+// The message which, when assigned from with its gate set, holds the assigning thread until the gate is opened.
+struct GatedCopyMessage {
+  struct Gate {
+    void PassThrough() {
+      std::unique_lock<std::mutex> lock(mutex);
+      entered = true;
+      condition_variable.notify_all();
+      condition_variable.wait(lock, [this] { return open; });
+    }
+    void WaitUntilEntered() {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition_variable.wait(lock, [this] { return entered; });
+    }
+    void Open() {
+      std::lock_guard<std::mutex> lock(mutex);
+      open = true;
+      condition_variable.notify_all();
+    }
+    std::mutex mutex;
+    std::condition_variable condition_variable;
+    bool entered = false;
+    bool open = false;
+  };
+
+  GatedCopyMessage() = default;
+  GatedCopyMessage(const std::string& text, Gate* gate = nullptr) : text(text), gate(gate) {
+  }
+  GatedCopyMessage(const GatedCopyMessage&) = default;
+  GatedCopyMessage(GatedCopyMessage&&) = default;
+  GatedCopyMessage& operator=(GatedCopyMessage&&) = default;
+  GatedCopyMessage& operator=(const GatedCopyMessage& rhs) {
+    if (rhs.gate) {
+      rhs.gate->PassThrough();
+    }
+    text = rhs.text;
+    gate = nullptr;
+    return *this;
+  }
+
+  std::string text;
+  Gate* gate = nullptr;
+};
+
+// Collects the messages, along with the number of dropped ones reported with each of them.
+// Lets the test wait until the consumer thread has exported the given number of messages.
+struct GatedCopyMessageConsumer {
+  void OnMessage(const GatedCopyMessage& message, size_t number_of_dropped_events) {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.push_back(message.text);
+    dropped_with_each_message.push_back(number_of_dropped_events);
+    dropped += number_of_dropped_events;
+    condition_variable.notify_all();
+  }
+  void WaitUntilExported(size_t number_of_messages) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition_variable.wait(lock, [this, number_of_messages] { return messages.size() >= number_of_messages; });
+  }
+  std::mutex mutex;
+  std::condition_variable condition_variable;
+  std::vector<std::string> messages;
+  std::vector<size_t> dropped_with_each_message;
+  size_t dropped = 0;
+};
+
+TEST(ShardedMQTest, MessageIsCopiedOutsideTheShardLock) {
+  GatedCopyMessageConsumer consumer;
+  {
+    ShardedMQ<GatedCopyMessageConsumer, GatedCopyMessage> mq(consumer, 1, 16);
+    GatedCopyMessage::Gate gate;
+    const GatedCopyMessage slow("slow", &gate);
+    std::thread slow_producer([&mq, &slow]() { mq.PushMessage(slow); });
+    gate.WaitUntilEntered();
+    // Would wait forever if the slow message was being copied with the mutex of the shard locked.
+    mq.PushMessage(GatedCopyMessage("fast"));
+    gate.Open();
+    slow_producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({"slow", "fast"}), consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(ShardedMQTest, MessageBeingCopiedIsNotDropped) {
+  GatedCopyMessageConsumer consumer;
+  {
+    ShardedMQ<GatedCopyMessageConsumer, GatedCopyMessage> mq(consumer, 1, 2);
+    GatedCopyMessage::Gate gate;
+    const GatedCopyMessage slow("slow", &gate);
+    std::thread slow_producer([&mq, &slow]() { mq.PushMessage(slow); });
+    gate.WaitUntilEntered();
+    // The slow message is the oldest one, and can not be dropped, so, once the shard is full, the new ones are.
+    for (size_t i = 1; i <= 3; ++i) {
+      mq.PushMessage(GatedCopyMessage(std::to_string(i)));
+    }
+    gate.Open();
+    slow_producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({"slow", "1"}), consumer.messages);
+  EXPECT_EQ(2u, consumer.dropped);
+}
+
+TEST(ShardedMQTest, DroppedMessagesAreReportedOnceThereIsAMessageToReportThemWith) {
+  GatedCopyMessageConsumer consumer;
+  {
+    ShardedMQ<GatedCopyMessageConsumer, GatedCopyMessage> mq(consumer, 2, 2);
+    GatedCopyMessage::Gate gate;
+    const GatedCopyMessage slow("slow", &gate);
+    // The first producer, of the first shard, is held populating its message.
+    std::thread slow_producer([&mq, &slow]() { mq.PushMessage(slow); });
+    gate.WaitUntilEntered();
+    // The second producer, this thread, is of the second shard.
+    mq.PushMessage(GatedCopyMessage("a"));
+    // The third one is of the first shard again, and gets two of its three messages dropped.
+    std::thread([&mq]() {
+      for (size_t i = 1; i <= 3; ++i) {
+        mq.PushMessage(GatedCopyMessage(std::to_string(i)));
+      }
+    }).join();
+    // The consumer thread then grabs nothing from the first shard, twice: the second time, it has started
+    // after the messages were dropped. The dropped ones are not reported with the messages of the second shard.
+    mq.PushMessage(GatedCopyMessage("b"));
+    consumer.WaitUntilExported(2);
+    mq.PushMessage(GatedCopyMessage("c"));
+    consumer.WaitUntilExported(3);
+    gate.Open();
+    slow_producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({"a", "b", "c", "slow", "1"}), consumer.messages);
+  EXPECT_EQ(std::vector<size_t>({0, 0, 0, 2, 0}), consumer.dropped_with_each_message);
+}
+
+// Collects the messages, "{key} {index}", along with the threads they were exported from. Thread safe.
+struct ThreadRecordingConsumer {
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.emplace_back(std::this_thread::get_id(), message);
+    dropped += number_of_dropped_events;
+  }
+  std::mutex mutex;
+  std::vector<std::pair<std::thread::id, std::string>> messages;
+  size_t dropped = 0;
+};
+
+TEST(PartitionedMQTest, EachKeyIsExportedInOrderFromOnePartition) {
+  const size_t kKeys = 8;
+  const size_t kMessages = 1000;
+  ThreadRecordingConsumer consumer;
+  const auto key_of_message = [](const std::string& message) {
+    return std::stoul(message.substr(0, message.find(' ')));
+  };
+  {
+    PartitionedMQ<ThreadRecordingConsumer> mq(consumer, 4, key_of_message);
+    std::vector<std::thread> producers;
+    for (size_t key = 0; key < kKeys; ++key) {
+      producers.emplace_back([&mq, key]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          EXPECT_TRUE(mq.PushMessage(std::to_string(key) + ' ' + std::to_string(i)));
+        }
+      });
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+  }
+  // The keys equal modulo the number of partitions share the partition, and thus the thread.
+  std::map<size_t, std::thread::id> thread_of_partition;
+  std::vector<int> last_index(kKeys, -1);
+  size_t number_of_messages = 0;
+  for (const auto& entry : consumer.messages) {
+    const std::string& message = entry.second;
+    const size_t key = key_of_message(message);
+    const int index = std::stoi(message.substr(message.find(' ') + 1));
+    ASSERT_LT(key, kKeys);
+    if (!thread_of_partition.count(key % 4)) {
+      thread_of_partition[key % 4] = entry.first;
+    }
+    EXPECT_EQ(thread_of_partition[key % 4], entry.first) << message;
+    EXPECT_LT(last_index[key], index) << message;
+    last_index[key] = index;
+    ++number_of_messages;
+  }
+  EXPECT_EQ(kKeys * kMessages, number_of_messages + consumer.dropped);
+  ASSERT_EQ(4u, thread_of_partition.size());
+  for (size_t i = 0; i < 4; ++i) {
+    for (size_t j = i + 1; j < 4; ++j) {
+      EXPECT_NE(thread_of_partition[i], thread_of_partition[j]);
+    }
+  }
+}
+
+TEST(PartitionedMQTest, NoPartitionsAreGrownToOne) {
+  CollectingConsumer consumer;
+  {
+    PartitionedMQ<CollectingConsumer> mq(consumer, 0);
+    EXPECT_EQ(1u, mq.NumberOfPartitions());
+    EXPECT_TRUE(mq.PushMessage(5, "five"));
+    EXPECT_TRUE(mq.PushMessage("keyless"));
+  }
+  EXPECT_EQ(std::vector<std::string>({"five", "keyless"}), consumer.messages);
+}
+
+TEST(PartitionedMQTest, DropsAreReportedPerPartition) {
+  typedef PartitionedMQ<GatedConsumer> GatedPartitionedMQ;
+  GatedConsumer consumer;
+  {
+    GatedPartitionedMQ mq(
+        consumer, 2, GatedPartitionedMQ::T_PARTITIONER(), 4, GatedPartitionedMQ::OverflowPolicy::DropNewest());
+    // The consumer thread of partition zero takes "0" and holds on to it, while its buffer of four fills up.
+    EXPECT_TRUE(mq.PushMessage(0, "0"));
+    consumer.WaitUntilEntered();
+    EXPECT_TRUE(mq.PushMessage(0, "1"));
+    EXPECT_TRUE(mq.PushMessage(0, "2"));
+    EXPECT_TRUE(mq.PushMessage(0, "3"));
+    EXPECT_FALSE(mq.PushMessage(0, "4"));
+    // Partition one is not affected.
+    EXPECT_TRUE(mq.PushMessage(1, "a"));
+    consumer.Open();
+    while (mq.NumberOfDroppedEvents(0) != 1) {
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(0u, mq.NumberOfDroppedEvents(1));
+  }
+  EXPECT_EQ(5u, consumer.messages.size());
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+typedef mq::Payload<> Payload;
+
+static std::string PayloadContents(const Payload& payload) {
+  return std::string(payload.data(), payload.size());
+}
+
+// Whether the payload holds its bytes inline, in the payload object itself, rather than in a chunk.
+static bool IsInline(const Payload& payload) {
+  const char* begin = reinterpret_cast<const char*>(&payload);
+  return payload.data() >= begin && payload.data() < begin + sizeof(Payload);
+}
+
+TEST(PayloadTest, MovesIntoChunkPastInlineCapacity) {
+  Payload payload;
+  EXPECT_TRUE(payload.empty());
+  const std::string inline_contents(64, 'i');
+  payload.assign(inline_contents.data(), inline_contents.size());
+  EXPECT_TRUE(IsInline(payload));
+  EXPECT_EQ(64u, payload.capacity());
+  EXPECT_EQ(inline_contents, PayloadContents(payload));
+
+  // One byte past the inline capacity takes the chunk of the next power of two, keeping the contents.
+  payload.resize(65);
+  EXPECT_FALSE(IsInline(payload));
+  EXPECT_EQ(128u, payload.capacity());
+  EXPECT_EQ(inline_contents, PayloadContents(payload).substr(0, 64));
+
+  // Once taken, the chunk is kept for the shorter contents too.
+  payload.assign("short", 5);
+  EXPECT_FALSE(IsInline(payload));
+  EXPECT_EQ(128u, payload.capacity());
+  EXPECT_EQ("short", PayloadContents(payload));
+}
+
+TEST(PayloadTest, CopyAssignmentReusesTheChunk) {
+  const std::string long_contents(200, 'l');
+  const std::string shorter_contents(100, 's');
+  Payload payload(long_contents.data(), long_contents.size());
+  const char* chunk = payload.data();
+  EXPECT_EQ(256u, payload.capacity());
+
+  const Payload shorter(shorter_contents.data(), shorter_contents.size());
+  payload = shorter;
+  EXPECT_EQ(chunk, payload.data());
+  EXPECT_EQ(shorter_contents, PayloadContents(payload));
+  EXPECT_EQ(shorter_contents, PayloadContents(shorter));
+
+  const Payload inline_payload("inline", 6);
+  payload = inline_payload;
+  EXPECT_EQ(chunk, payload.data());
+  EXPECT_EQ("inline", PayloadContents(payload));
+}
+
+TEST(PayloadTest, MoveAndSwapExchangeTheChunks) {
+  const std::string a_contents(100, 'a');
+  const std::string b_contents(300, 'b');
+  Payload a(a_contents.data(), a_contents.size());
+  Payload b(b_contents.data(), b_contents.size());
+  const char* a_chunk = a.data();
+  const char* b_chunk = b.data();
+
+  // Move assignment hands the chunk of the target over to the source.
+  a = std::move(b);
+  EXPECT_EQ(b_chunk, a.data());
+  EXPECT_EQ(b_contents, PayloadContents(a));
+  EXPECT_EQ(a_chunk, b.data());
+  EXPECT_EQ(a_contents, PayloadContents(b));
+
+  using std::swap;
+  swap(a, b);
+  EXPECT_EQ(a_chunk, a.data());
+  EXPECT_EQ(a_contents, PayloadContents(a));
+  EXPECT_EQ(b_chunk, b.data());
+  EXPECT_EQ(b_contents, PayloadContents(b));
+
+  // Swapping with an inline payload moves the inline bytes over.
+  Payload c("inline", 6);
+  swap(a, c);
+  EXPECT_TRUE(IsInline(a));
+  EXPECT_EQ("inline", PayloadContents(a));
+  EXPECT_EQ(a_chunk, c.data());
+  EXPECT_EQ(a_contents, PayloadContents(c));
+
+  // Move construction leaves the source empty, and ready to be reused.
+  Payload d(std::move(b));
+  EXPECT_EQ(b_chunk, d.data());
+  EXPECT_EQ(b_contents, PayloadContents(d));
+  EXPECT_TRUE(b.empty());
+  EXPECT_TRUE(IsInline(b));
+  b.assign("reused", 6);
+  EXPECT_EQ("reused", PayloadContents(b));
+}
+
+TEST(PayloadTest, ChunksAreReusedViaTheThreadCache) {
+  // The size class not used by the other tests, for the cache of this thread to hold no chunks of it.
+  const size_t size_class = mq::PayloadChunkPool::SizeClass(5000);
+  EXPECT_EQ(13u, size_class);
+  char* chunk = mq::PayloadChunkPool::Acquire(size_class);
+  mq::PayloadChunkPool::Release(chunk, size_class);
+  EXPECT_EQ(chunk, mq::PayloadChunkPool::Acquire(size_class));
+  mq::PayloadChunkPool::Release(chunk, size_class);
+
+  // The payloads release their chunks into the pool, for the next payloads to take them.
+  const char* payload_chunk;
+  {
+    Payload payload;
+    payload.resize(5000);
+    payload_chunk = payload.data();
+  }
+  Payload payload;
+  payload.resize(5000);
+  EXPECT_EQ(payload_chunk, payload.data());
+}
+
+TEST(PayloadTest, ChunksAreSharedBetweenThreads) {
+  // The size class not used by the other tests, for the cache of this thread to hold no chunks of it.
+  const size_t size_class = mq::PayloadChunkPool::SizeClass(3000);
+  EXPECT_EQ(12u, size_class);
+
+  // The chunks released past the capacity of the cache of the thread go to the shared pool right away.
+  std::vector<char*> chunks;
+  char* chunk = nullptr;
+  std::promise<void> released;
+  std::promise<void> acquired;
+  std::thread thread([&chunks, &chunk, &released, &acquired, size_class]() {
+    for (size_t i = 0; i < 17; ++i) {
+      chunks.push_back(mq::PayloadChunkPool::Acquire(size_class));
+    }
+    for (char* acquired_chunk : chunks) {
+      mq::PayloadChunkPool::Release(acquired_chunk, size_class);
+    }
+    released.set_value();
+    acquired.get_future().wait();
+    // The cache of this thread is full, so the chunk the test thread has taken goes back to the shared pool.
+    mq::PayloadChunkPool::Release(chunk, size_class);
+  });
+  released.get_future().wait();
+  chunk = mq::PayloadChunkPool::Acquire(size_class);
+  EXPECT_EQ(chunks.back(), chunk);
+  acquired.set_value();
+  thread.join();
+
+  // The chunks cached by the thread go to the shared pool once it terminates.
+  chunk = nullptr;
+  std::thread([&chunk, size_class]() {
+    chunk = mq::PayloadChunkPool::Acquire(size_class);
+    mq::PayloadChunkPool::Release(chunk, size_class);
+  }).join();
+  std::thread([chunk, size_class]() {
+    EXPECT_EQ(chunk, mq::PayloadChunkPool::Acquire(size_class));
+    mq::PayloadChunkPool::Release(chunk, size_class);
+  }).join();
+}
+
+// Collects the payloads as strings, along with the number of dropped ones.
+struct PayloadCollectingConsumer {
+  void OnMessage(const Payload& message, size_t number_of_dropped_events) {
+    messages.push_back(PayloadContents(message));
+    dropped += number_of_dropped_events;
+  }
+  std::vector<std::string> messages;
+  size_t dropped = 0;
+};
+
+TEST(PayloadTest, EfficientMQOfPayloads) {
+  std::vector<std::string> expected;
+  PayloadCollectingConsumer consumer;
+  {
+    // Blocks on overflow, for no payload to be dropped.
+    typedef EfficientMQ<PayloadCollectingConsumer, Payload> PayloadEfficientMQ;
+    PayloadEfficientMQ mq(
+        consumer, 4, PayloadEfficientMQ::OverflowPolicy::BlockWithTimeout(std::chrono::minutes(1)));
+    for (size_t i = 0; i < 20; ++i) {
+      // Both the inline and the chunked payloads, the former copied and the latter moved over.
+      const std::string contents(i * 13, static_cast<char>('a' + i));
+      Payload payload(contents.data(), contents.size());
+      if (i % 2) {
+        EXPECT_TRUE(mq.PushMessage(payload));
+      } else {
+        EXPECT_TRUE(mq.PushMessage(std::move(payload)));
+      }
+      expected.push_back(contents);
+    }
+  }
+  EXPECT_EQ(expected, consumer.messages);
+  EXPECT_EQ(0u, consumer.dropped);
+}
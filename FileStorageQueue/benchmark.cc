@@ -0,0 +1,155 @@
+// A benchmark for the append path of FSQ.
+//
+// Pushes --messages messages of --message_length bytes each from --push_threads threads,
+// and measures the throughput, in messages per second, and the latency of `PushMessage()`, as percentiles.
+//
+// Runs with each of the append strategies and durability policies below, or only with the --policy one:
+//
+//   1) PerMessageFlush: `AppendToFileWithSeparator`, one `write()` per message.
+//   2) FlushEvery64KB:  `BufferedAppendToFile`, writing the buffer out once it holds 64KB.
+//   3) FlushEvery100ms: `BufferedAppendToFile`, writing the buffer out once 100ms have passed since last time.
+//   4) FlushOnFinalize: `BufferedAppendToFile`, writing the buffer out only when the file is finalized.
+//   5) FsyncOnFinalize: Same as the above, followed by an `fsync()` of the file.
+//   6) GroupCommit:     `BufferedAppendToFile` with `GroupCommitConcurrentPushes()`, sharing writes between
+//                       concurrent pushes.
+//   7) WriterThread:    `BufferedAppendToFile` with `PushMessagesViaWriterThread()`, staging messages in memory
+//                       for the writer thread to append.
+//
+// Except for GroupCommit and WriterThread, FSQ must not be pushed into concurrently, and the pushing threads
+// take turns by locking a mutex, as an application would have to.
+//
+// Files are finalized once they reach --file_size_kb kilobytes, and the processor just deletes them.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fsq.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+
+DEFINE_string(policy, "", "The policy to run the benchmark for, or empty to run all of them.");
+DEFINE_int32(push_threads, 4, "The number of threads that push in messages.");
+DEFINE_int32(messages, 100000, "The total number of messages to push.");
+DEFINE_int32(message_length, 100, "The length of each message, in bytes.");
+DEFINE_int32(file_size_kb, 1024, "The size to finalize files at, in kilobytes.");
+DEFINE_string(dir, "build/benchmark_data", "The directory for FSQ to work in. Created if does not exist.");
+
+struct DeletingProcessor {
+  template <typename T_TIMESTAMP>
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<T_TIMESTAMP>&, T_TIMESTAMP) {
+    return fsq::FileProcessingResult::Success;
+  }
+};
+
+// Finalizes files by size only. The size is a runtime flag, thus this is not `SimpleFinalizationStrategy`.
+struct FinalizeBySizeFromFlags {
+  template <typename T_TIMESTAMP>
+  bool ShouldFinalize(const fsq::QueueStatus<T_TIMESTAMP>& status, const T_TIMESTAMP) const {
+    return status.appended_file_size >= static_cast<uint64_t>(FLAGS_file_size_kb) * 1024;
+  }
+};
+
+template <typename APPEND_STRATEGY, bool GROUP_COMMIT = false, bool WRITER_THREAD = false>
+struct BenchmarkConfig : fsq::Config<DeletingProcessor> {
+  typedef APPEND_STRATEGY T_FILE_APPEND_STRATEGY;
+  typedef FinalizeBySizeFromFlags T_FINALIZE_STRATEGY;
+  // Never purge unprocessed files, they are deleted as soon as they are finalized anyway.
+  typedef fsq::strategy::SimplePurgeStrategy<static_cast<uint64_t>(1) << 40, 1000000> T_PURGE_STRATEGY;
+  inline static bool GroupCommitConcurrentPushes() {
+    return GROUP_COMMIT;
+  }
+  inline static bool PushMessagesViaWriterThread() {
+    return WRITER_THREAD;
+  }
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE& instance) {
+    instance.SetSeparator("\n");
+  }
+};
+
+template <typename CONFIG>
+void RunBenchmark(const std::string& policy) {
+  if (!FLAGS_policy.empty() && FLAGS_policy != policy) {
+    return;
+  }
+
+  DeletingProcessor processor;
+  typedef fsq::FSQ<CONFIG> FSQ;
+  FSQ(processor, FLAGS_dir).ShutdownAndRemoveAllFSQFiles();
+
+  const std::string message(FLAGS_message_length, '.');
+  const size_t number_of_threads = static_cast<size_t>(std::max(FLAGS_push_threads, 1));
+  const size_t messages_per_thread = static_cast<size_t>(FLAGS_messages) / number_of_threads;
+  std::vector<std::vector<uint64_t>> latencies_ns(number_of_threads);
+
+  double seconds;
+  {
+    FSQ fsq(processor, FLAGS_dir);
+    fsq.GetQueueStatus();  // Wait for the initial scan of the directory to complete.
+
+    std::mutex pushers_mutex;
+    const auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < number_of_threads; ++t) {
+      threads.emplace_back([&, t]() {
+        std::vector<uint64_t>& latencies = latencies_ns[t];
+        latencies.reserve(messages_per_thread);
+        for (size_t i = 0; i < messages_per_thread; ++i) {
+          const auto push_begin = std::chrono::steady_clock::now();
+          if (CONFIG::GroupCommitConcurrentPushes() || CONFIG::PushMessagesViaWriterThread()) {
+            fsq.PushMessage(message);
+          } else {
+            std::lock_guard<std::mutex> lock(pushers_mutex);
+            fsq.PushMessage(message);
+          }
+          latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::steady_clock::now() - push_begin).count());
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    fsq.ShutdownAndRemoveAllFSQFiles();
+  }
+
+  std::vector<uint64_t> all_latencies_ns;
+  for (const auto& latencies : latencies_ns) {
+    all_latencies_ns.insert(all_latencies_ns.end(), latencies.begin(), latencies.end());
+  }
+  std::sort(all_latencies_ns.begin(), all_latencies_ns.end());
+  const auto percentile_us = [&all_latencies_ns](double p) {
+    return all_latencies_ns.empty()
+               ? 0.0
+               : 1e-3 * all_latencies_ns[std::min(static_cast<size_t>(all_latencies_ns.size() * p / 100),
+                                                  all_latencies_ns.size() - 1)];
+  };
+  std::printf("%-16s %12.0f msgs/s    push latency, us: p50 %9.2f    p99 %9.2f    max %9.2f\n",
+              policy.c_str(),
+              all_latencies_ns.size() / seconds,
+              percentile_us(50),
+              percentile_us(99),
+              percentile_us(100));
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  bricks::FileSystem::CreateDirectory(FLAGS_dir);
+
+  using fsq::strategy::AppendToFileWithSeparator;
+  using fsq::strategy::BufferedAppendToFile;
+  RunBenchmark<BenchmarkConfig<AppendToFileWithSeparator>>("PerMessageFlush");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<64 * 1024, 0, false>>>("FlushEvery64KB");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<0, 100, false>>>("FlushEvery100ms");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<0, 0, false>>>("FlushOnFinalize");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<0, 0, true>>>("FsyncOnFinalize");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<0, 0, false>, true>>("GroupCommit");
+  RunBenchmark<BenchmarkConfig<BufferedAppendToFile<0, 0, false>, false, true>>("WriterThread");
+}
@@ -0,0 +1,188 @@
+// The compression of finalized FSQ files, see `CompressFinalizedFiles()` in `config.h`.
+//
+// A small LZ77 codec, in the spirit of LZ4: the input is split into sequences of literals followed by a match,
+// a copy of at least four bytes from up to 64KB back. Each sequence starts with a token byte, the number
+// of literals in its high nibble and the length of the match, less four, in its low nibble, extended by
+// the bytes that follow while they are 255. Then go the literals and the 2-byte little-endian match offset.
+// The last sequence has no match. Fast, and good enough for text-like logs, which compress several times.
+//
+// The compressed file starts with the eight magic bytes and the 8-byte little-endian size of the original,
+// so that the compressed files are told apart from the uncompressed ones, as both can be in the queue.
+
+#ifndef FSQ_COMPRESSION_H
+#define FSQ_COMPRESSION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../Bricks/file/file.h"
+
+namespace fsq {
+namespace compression {
+
+enum : size_t { kMagicSize = 8, kHeaderSize = 16, kMinMatch = 4, kMaxOffset = 65535, kHashBits = 14 };
+
+inline const char* Magic() {
+  return "\x89" "FSQLZ\r\n";
+}
+
+inline bool IsCompressed(const char* data, size_t size) {
+  return size >= kHeaderSize && !std::memcmp(data, Magic(), kMagicSize);
+}
+
+namespace impl {
+
+inline uint32_t Read32(const char* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t Hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+// Appends the length beyond what fits the nibble of the token, as a run of 255-s and the remainder.
+inline void AppendExtraLength(std::string& output, size_t length) {
+  for (; length >= 255; length -= 255) {
+    output += static_cast<char>(255);
+  }
+  output += static_cast<char>(length);
+}
+
+inline void AppendSequence(
+    std::string& output, const char* literals, size_t number_of_literals, size_t offset, size_t match_length) {
+  const size_t match_nibble = match_length ? match_length - kMinMatch : 0;
+  output += static_cast<char>(((number_of_literals < 15 ? number_of_literals : 15) << 4) |
+                              (match_nibble < 15 ? match_nibble : 15));
+  if (number_of_literals >= 15) {
+    AppendExtraLength(output, number_of_literals - 15);
+  }
+  output.append(literals, number_of_literals);
+  if (match_length) {
+    output += static_cast<char>(offset & 0xff);
+    output += static_cast<char>(offset >> 8);
+    if (match_nibble >= 15) {
+      AppendExtraLength(output, match_nibble - 15);
+    }
+  }
+}
+
+// Reads the length beyond what fits the nibble of the token. Returns false if the input ends prematurely.
+inline bool ReadExtraLength(const uint8_t*& p, const uint8_t* end, size_t& length) {
+  uint8_t byte;
+  do {
+    if (p == end) {
+      return false;
+    }
+    byte = *p++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+}  // namespace impl
+
+// Compresses `[data, data + size)`. Returns the compressed contents, header included.
+inline std::string Compress(const char* data, size_t size) {
+  std::string output(Magic(), kMagicSize);
+  for (int i = 0; i < 8; ++i) {
+    output += static_cast<char>((static_cast<uint64_t>(size) >> (8 * i)) & 0xff);
+  }
+  output.reserve(kHeaderSize + size / 2);
+  // The positions of the most recent four-byte sequences, by their hash, off by one for zero to mean none.
+  std::vector<uint32_t> positions(static_cast<size_t>(1) << kHashBits, 0);
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + kMinMatch <= size) {
+    const uint32_t value = impl::Read32(data + i);
+    uint32_t& position = positions[impl::Hash(value)];
+    const size_t candidate = position;
+    position = static_cast<uint32_t>(i + 1);
+    if (candidate && i + 1 - candidate <= kMaxOffset && impl::Read32(data + candidate - 1) == value) {
+      const size_t match = candidate - 1;
+      size_t length = kMinMatch;
+      while (i + length < size && data[match + length] == data[i + length]) {
+        ++length;
+      }
+      impl::AppendSequence(output, data + anchor, i - anchor, i - match, length);
+      i += length;
+      anchor = i;
+    } else {
+      ++i;
+    }
+  }
+  impl::AppendSequence(output, data + anchor, size - anchor, 0, 0);
+  return output;
+}
+
+// Decompresses the output of `Compress()` into `output`. Returns false if the input is not valid.
+inline bool Decompress(const char* data, size_t size, std::string& output) {
+  if (!IsCompressed(data, size)) {
+    return false;
+  }
+  uint64_t original_size = 0;
+  for (int i = 0; i < 8; ++i) {
+    original_size |= static_cast<uint64_t>(static_cast<uint8_t>(data[kMagicSize + i])) << (8 * i);
+  }
+  output.clear();
+  // The size from the header is not validated yet: the input may merely start with the magic bytes.
+  // So only reserve as much as the input can expand to. Each byte of it produces at most 255 bytes of output.
+  output.reserve(static_cast<size_t>(std::min(original_size, static_cast<uint64_t>(size - kHeaderSize) * 255)));
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data) + kHeaderSize;
+  const uint8_t* const end = reinterpret_cast<const uint8_t*>(data) + size;
+  while (p != end) {
+    const uint8_t token = *p++;
+    size_t number_of_literals = token >> 4;
+    if (number_of_literals == 15 && !impl::ReadExtraLength(p, end, number_of_literals)) {
+      return false;
+    }
+    if (static_cast<size_t>(end - p) < number_of_literals ||
+        output.length() + number_of_literals > original_size) {
+      return false;
+    }
+    output.append(reinterpret_cast<const char*>(p), number_of_literals);
+    p += number_of_literals;
+    if (p == end) {
+      break;
+    }
+    if (end - p < 2) {
+      return false;
+    }
+    const size_t offset = p[0] | (static_cast<size_t>(p[1]) << 8);
+    p += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !impl::ReadExtraLength(p, end, match_length)) {
+      return false;
+    }
+    match_length += kMinMatch;
+    if (!offset || offset > output.length() || output.length() + match_length > original_size) {
+      return false;
+    }
+    // The match may overlap the bytes it produces, thus copied byte by byte.
+    const size_t from = output.length() - offset;
+    for (size_t i = 0; i < match_length; ++i) {
+      output += output[from + i];
+    }
+  }
+  return output.length() == original_size;
+}
+
+// The contents of the file, decompressed if it is compressed. For the processors that read files on their own.
+inline std::string ReadFileDecompressed(const std::string& file_name) {
+  const std::string contents = bricks::ReadFileAsString(file_name);
+  std::string decompressed;
+  if (Decompress(contents.data(), contents.length(), decompressed)) {
+    return decompressed;
+  } else {
+    return contents;
+  }
+}
+
+}  // namespace compression
+}  // namespace fsq
+
+#endif  // FSQ_COMPRESSION_H
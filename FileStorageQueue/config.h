@@ -2,6 +2,7 @@
 #define FSQ_CONFIG_H
 
 #include <string>
+#include <vector>
 
 #include "../Bricks/time/chrono.h"
 
@@ -48,6 +49,110 @@ struct Config {
     return false;
   }
 
+  // Set to true to have PushMessage() accept messages from many threads and write them in groups:
+  // concurrent pushes are appended together, followed by one `FlushToFile()` of the append strategy,
+  // and each PushMessage() returns once its message has been flushed.
+  inline static bool GroupCommitConcurrentPushes() {
+    return false;
+  }
+
+  // Set to true to have PushMessage() stage messages in memory, from any number of threads,
+  // for a dedicated writer thread to append them to the current file, and to finalize and purge files.
+  // Takes precedence over `GroupCommitConcurrentPushes()`: the writer thread flushes once per batch anyway.
+  inline static bool PushMessagesViaWriterThread() {
+    return false;
+  }
+
+  // With the writer thread, the number of staged messages beyond which PushMessage() blocks,
+  // until the writer thread catches up.
+  inline static size_t WriterThreadMaxStagedMessages() {
+    return 64 * 1024;
+  }
+
+  // Set to true to have a dedicated finalizer thread finalize and purge files, and pre-open the next file,
+  // so that PushMessage() only switches files when the current one is to be finalized, see `fsq.h`.
+  // `FinalizeCurrentFile()` and `ForceProcessing()` still return once the files are finalized.
+  inline static bool FinalizeFilesInBackground() {
+    return false;
+  }
+
+  // Set to a number of milliseconds to have the worker thread check the finalize strategy that often,
+  // so that the current file is finalized once it is old enough even if no messages are pushed.
+  // Zero to only check the strategy as messages are pushed. With `ProcessingConcurrency()` of zero, there is
+  // no worker thread to do it, and `FinalizeCurrentFileIfDue()` is to be called instead, as `FSQManager` does.
+  inline static uint64_t FinalizationCheckIntervalMilliseconds() {
+    return 0;
+  }
+
+  // Set to true to have the messages pushed with `MessagePriority::High` go to the files of their own,
+  // which are processed before, and purged after, all the other files, see `fsq.h`.
+  // Otherwise, the priority is ignored.
+  inline static bool HighPriorityLane() {
+    return false;
+  }
+
+  // Set to true to have FSQ count the messages and the files, and measure the latencies, see `metrics.h`.
+  inline static bool CollectMetrics() {
+    return false;
+  }
+
+  // The number of finalized files to process at once, each by its own thread, the worker thread included.
+  // With more than one, `T_PROCESSOR::OnFileReady()` is called concurrently, and must be thread safe.
+  // Zero to have no thread of FSQ process the files, but the callers of `ProcessNextFile()`,
+  // see `fsq_manager.h`.
+  inline static size_t ProcessingConcurrency() {
+    return 1;
+  }
+
+  // With concurrent processing, files may complete out of order. By default, the processed files are removed
+  // from the queue, and from disk, in the order they were finalized: each once the files before it are done.
+  // Set to false to remove each file as soon as it is processed.
+  inline static bool RemoveProcessedFilesInOrder() {
+    return true;
+  }
+
+  // Set to true to have FSQ compress the files as it finalizes them, see `compression.h`. The sizes
+  // of the finalized files in the status, and thus what the purge strategy goes by, are the compressed ones.
+  inline static bool CompressFinalizedFiles() {
+    return false;
+  }
+
+  // The processors that accept the view of the file, see `file_view.h`, get the compressed files decompressed.
+  // Set to false to have them get the compressed bytes instead, for instance, to upload them as they are.
+  // The processors that read the files on their own can use `compression::ReadFileDecompressed()`.
+  inline static bool DecompressFilesForProcessor() {
+    return true;
+  }
+
+  // Set to a size in bytes, header included, to have FSQ append messages to preallocated segment files of this
+  // size, and reuse the processed and the purged ones instead of removing them, see `segments.h`. The finalize
+  // strategy should keep the files under this size, as the segment has to grow otherwise, and is not reused.
+  // The sizes in the status, and thus what the purge strategy goes by, are the sizes of the data. The finalized
+  // segments are truncated to their data, so that the disk budget holds. Only the files to append to take up
+  // the whole segment. Zero to create, grow and remove files as they come and go.
+  inline static uint64_t SegmentSize() {
+    return 0;
+  }
+
+  // With the segments, the number of processed segments to keep for reuse. The rest are removed.
+  inline static size_t MaxRecycledSegments() {
+    return 4;
+  }
+
+  // Set to the names of the consumers to have each read the finalized files at its own pace, along with
+  // T_PROCESSOR, via a named cursor, persisted in the working directory, see `NextFileForCursor()` in `fsq.h`.
+  // The processed files are then removed once all the cursors have passed them, unless purged before.
+  // The processor should not move the files away, as the cursors are yet to read them.
+  inline static std::vector<std::string> ConsumerCursors() {
+    return {};
+  }
+
+  // Set to a file name to have FSQ journal its files into that file, in the working directory,
+  // and read it on startup instead of scanning the directory, see `fsq.h`. Empty to always scan the directory.
+  inline static std::string ManifestFileName() {
+    return "";
+  }
+
   template <typename T_FSQ_INSTANCE>
   inline static void Initialize(T_FSQ_INSTANCE&) {
     // `T_CONFIG::Initialize(*this)` is invoked from FSQ's constructor
@@ -0,0 +1,213 @@
+// A read-only view of a finalized file, for the processors to read it without copying it into memory.
+//
+// The file is memory-mapped, so that `Data()` and `Size()` expose its contents as one range of bytes,
+// backed by the page cache. For the files that do not fit the address space comfortably, or to keep the
+// resident memory bounded, `ForEachChunk()` walks the file chunk by chunk, releasing the pages of each chunk
+// once it has been passed on. If the file could not be mapped, `ForEachChunk()` reads it with `pread()`
+// into a buffer of one chunk instead, so that the processors relying on it work either way.
+//
+// The processors that define `OnFileReady(const FileInfo&, const FileView&, T_TIMESTAMP now)` are passed
+// the view of each file by FSQ. The ones that only define `OnFileReady(const FileInfo&, T_TIMESTAMP now)`
+// are called as before. The view is only valid for the duration of the call.
+//
+// With `CompressFinalizedFiles()` in the config, the view decompresses the compressed files transparently,
+// into memory, unless `DecompressFilesForProcessor()` is turned off, see `compression.h`. The files that
+// could not be mapped are read with `pread()` to be decompressed.
+//
+// For the segments, see `segments.h`, the view exposes the data alone, without the header and the stale bytes.
+
+#ifndef FSQ_FILE_VIEW_H
+#define FSQ_FILE_VIEW_H
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "segments.h"
+#include "status.h"
+
+namespace fsq {
+
+class FileView final {
+ public:
+  enum : size_t { kDefaultChunkSize = 1024 * 1024 };
+
+  explicit FileView(const std::string& file_name, bool decompress = false)
+      : fd_(::open(file_name.c_str(), O_RDONLY)) {
+    struct stat info;
+    if (fd_ >= 0 && !::fstat(fd_, &info)) {
+      file_size_ = static_cast<size_t>(info.st_size);
+      size_ = file_size_;
+      if (file_size_) {
+        void* data = ::mmap(nullptr, file_size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (data != MAP_FAILED) {
+          data_ = static_cast<const char*>(data);
+          ::madvise(data, file_size_, MADV_SEQUENTIAL);
+        }
+      }
+      char header[segments::kHeaderSize];
+      uint64_t data_size;
+      if (file_size_ >= segments::kHeaderSize &&
+          ::pread(fd_, header, segments::kHeaderSize, 0) == segments::kHeaderSize &&
+          segments::ParseHeader(header, file_size_, data_size)) {
+        begin_ = segments::kHeaderSize;
+        size_ = static_cast<size_t>(data_size);
+      }
+    }
+    if (decompress) {
+      if (data_) {
+        if (compression::IsCompressed(data_ + begin_, size_)) {
+          decompressed_ = compression::Decompress(data_ + begin_, size_, decompressed_contents_);
+        }
+      } else if (fd_ >= 0) {
+        // The file could not be mapped. Check its header, and, if it is compressed, read it in full
+        // via `pread()`, to decompress it from memory.
+        char header[compression::kHeaderSize];
+        std::string contents;
+        if (size_ >= compression::kHeaderSize &&
+            ::pread(fd_, header, compression::kHeaderSize, begin_) == compression::kHeaderSize &&
+            compression::IsCompressed(header, compression::kHeaderSize) && ReadContents(contents)) {
+          decompressed_ = compression::Decompress(contents.data(), contents.length(), decompressed_contents_);
+        }
+      }
+    }
+  }
+
+  ~FileView() {
+    if (data_) {
+      ::munmap(const_cast<char*>(data_), file_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  // False if the file could not be opened, in which case it should be treated as empty.
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  // False if the file is open but could not be mapped, or is empty. Then `Data()` is null,
+  // and the file can only be read via `ForEachChunk()`.
+  bool IsMapped() const {
+    return data_ != nullptr;
+  }
+
+  // True if the file was compressed, and is exposed decompressed, from memory.
+  bool IsDecompressed() const {
+    return decompressed_;
+  }
+
+  // True if the file is a segment, of which only the data is exposed.
+  bool IsSegment() const {
+    return begin_ != 0;
+  }
+
+  const char* Data() const {
+    return decompressed_ ? decompressed_contents_.data() : (data_ ? data_ + begin_ : nullptr);
+  }
+
+  size_t Size() const {
+    return decompressed_ ? decompressed_contents_.length() : size_;
+  }
+
+  // Calls `f(const char* data, size_t size)` for the consecutive chunks of `chunk_size` bytes of the file,
+  // except possibly the last one. The chunk is only valid for the duration of the call.
+  // Stops once `f` returns false. Returns true if the whole file has been passed to `f`.
+  template <typename F>
+  bool ForEachChunk(F&& f, size_t chunk_size = kDefaultChunkSize) const {
+    chunk_size = std::max(chunk_size, static_cast<size_t>(1));
+    if (decompressed_) {
+      const std::string& contents = decompressed_contents_;
+      for (size_t offset = 0; offset < contents.length(); offset += chunk_size) {
+        if (!f(contents.data() + offset, std::min(chunk_size, contents.length() - offset))) {
+          return false;
+        }
+      }
+      return true;
+    } else if (data_) {
+      const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      size_t released = 0;
+      for (size_t offset = 0; offset < size_; offset += chunk_size) {
+        if (!f(data_ + begin_ + offset, std::min(chunk_size, size_ - offset))) {
+          return false;
+        }
+        // Release the pages that have been passed on in full, to keep the resident memory bounded.
+        const size_t end = (begin_ + std::min(offset + chunk_size, size_)) / page_size * page_size;
+        if (end > released) {
+          ::madvise(const_cast<char*>(data_) + released, end - released, MADV_DONTNEED);
+          released = end;
+        }
+      }
+      return true;
+    } else if (fd_ >= 0) {
+      std::vector<char> buffer(std::min(chunk_size, std::max(size_, static_cast<size_t>(1))));
+      for (size_t offset = 0; offset < size_;) {
+        const ssize_t read =
+            ::pread(fd_, &buffer[0], std::min(buffer.size(), size_ - offset), begin_ + offset);
+        if (read <= 0) {
+          return false;
+        }
+        if (!f(&buffer[0], static_cast<size_t>(read))) {
+          return false;
+        }
+        offset += static_cast<size_t>(read);
+      }
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // Reads the data into `contents` via `ForEachChunk()`, for the callers that need it as one range of bytes
+  // even if the file could not be mapped. Returns false if the file could not be read in full.
+  bool ReadContents(std::string& contents) const {
+    contents.clear();
+    contents.reserve(Size());
+    return ForEachChunk([&contents](const char* data, size_t size) {
+      contents.append(data, size);
+      return true;
+    });
+  }
+
+ private:
+  const int fd_;
+  // The size of the file, and the offset and the size of the data in it, which differ for the segments.
+  size_t file_size_ = 0;
+  size_t begin_ = 0;
+  size_t size_ = 0;
+  const char* data_ = nullptr;
+  std::string decompressed_contents_;
+  bool decompressed_ = false;
+
+  FileView(const FileView&) = delete;
+  FileView(FileView&&) = delete;
+  void operator=(const FileView&) = delete;
+  void operator=(FileView&&) = delete;
+};
+
+// Whether `PROCESSOR::OnFileReady()` accepts the view of the file, see above.
+template <typename PROCESSOR, typename T_TIMESTAMP>
+struct ProcessorAcceptsFileView {
+  template <typename P>
+  static auto Check(P* processor)
+      -> decltype(processor->OnFileReady(std::declval<const FileInfo<T_TIMESTAMP>&>(),
+                                         std::declval<const FileView&>(),
+                                         std::declval<T_TIMESTAMP>()),
+                  std::true_type());
+  template <typename>
+  static std::false_type Check(...);
+  enum { value = decltype(Check<PROCESSOR>(nullptr))::value };
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_FILE_VIEW_H
@@ -0,0 +1,158 @@
+// The record-framed format of FSQ files, see `strategy::AppendFramedRecords`.
+//
+// Each message is written as one record: the 4-byte length of the message, the 4-byte CRC32 of the length
+// and the message combined, both little-endian, followed by the message itself. Thus, the messages can contain
+// any bytes, and a record torn by a crash, or otherwise damaged, is told apart from the valid ones.
+//
+// `FramedRecords` iterates over the records of a range of bytes, such as the `FileView` of a file,
+// without copying them. The iteration stops at the first record that is incomplete or fails the checksum.
+
+#ifndef FSQ_FRAMED_RECORDS_H
+#define FSQ_FRAMED_RECORDS_H
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+
+namespace fsq {
+
+namespace framed_records {
+
+enum : size_t { kHeaderSize = 8 };
+
+// CRC32, as in zlib, with the table built on first use. `crc` continues the checksum of the preceding bytes.
+inline uint32_t CRC32(const char* data, size_t size, uint32_t crc = 0) {
+  struct Table {
+    uint32_t entries[256];
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+          c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+        }
+        entries[i] = c;
+      }
+    }
+  };
+  static const Table table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table.entries[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+inline void PutUInt32(char* p, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+inline uint32_t GetUInt32(const char* p) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  }
+  return value;
+}
+
+// Fills in the header of the record of the message.
+inline void MakeHeader(const char* data, size_t size, char (&header)[kHeaderSize]) {
+  PutUInt32(header, static_cast<uint32_t>(size));
+  PutUInt32(header + 4, CRC32(data, size, CRC32(header, 4)));
+}
+
+// The size of the valid record at `[begin, end)`, header included, or zero if it is incomplete or damaged.
+inline size_t ValidRecordSize(const char* begin, const char* end) {
+  if (static_cast<size_t>(end - begin) < kHeaderSize) {
+    return 0;
+  }
+  const size_t size = GetUInt32(begin);
+  if (static_cast<size_t>(end - begin) - kHeaderSize < size ||
+      CRC32(begin + kHeaderSize, size, CRC32(begin, 4)) != GetUInt32(begin + 4)) {
+    return 0;
+  }
+  return kHeaderSize + size;
+}
+
+}  // namespace framed_records
+
+// One message of the record-framed file, pointing into the range it was read from.
+struct FramedRecord {
+  const char* data;
+  size_t size;
+  std::string ToString() const {
+    return std::string(data, size);
+  }
+};
+
+// The records of the range of bytes, to iterate over with a range-based for loop.
+class FramedRecords {
+ public:
+  FramedRecords(const char* data, size_t size) : begin_(data), end_(data + size) {
+  }
+
+  class Iterator : public std::iterator<std::input_iterator_tag, FramedRecord> {
+   public:
+    Iterator(const char* position, const char* end) : position_(position), end_(end) {
+      Validate();
+    }
+    const FramedRecord& operator*() const {
+      return record_;
+    }
+    const FramedRecord* operator->() const {
+      return &record_;
+    }
+    Iterator& operator++() {
+      position_ += framed_records::kHeaderSize + record_.size;
+      Validate();
+      return *this;
+    }
+    bool operator==(const Iterator& rhs) const {
+      return position_ == rhs.position_;
+    }
+    bool operator!=(const Iterator& rhs) const {
+      return position_ != rhs.position_;
+    }
+
+   private:
+    // Turns into the end iterator at the first invalid record.
+    void Validate() {
+      if (position_ && !framed_records::ValidRecordSize(position_, end_)) {
+        position_ = nullptr;
+      } else if (position_) {
+        record_.data = position_ + framed_records::kHeaderSize;
+        record_.size = framed_records::GetUInt32(position_);
+      }
+    }
+
+    const char* position_;
+    const char* end_;
+    FramedRecord record_ = FramedRecord{nullptr, 0};
+  };
+
+  Iterator begin() const {
+    return Iterator(begin_, end_);
+  }
+  Iterator end() const {
+    return Iterator(nullptr, end_);
+  }
+
+  // The size of the longest prefix of the range made of valid records. Equals the size of the range,
+  // unless the range ends with a torn record, or has a damaged one.
+  size_t ValidPrefixSize() const {
+    const char* position = begin_;
+    while (const size_t record_size = framed_records::ValidRecordSize(position, end_)) {
+      position += record_size;
+    }
+    return static_cast<size_t>(position - begin_);
+  }
+
+ private:
+  const char* const begin_;
+  const char* const end_;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_FRAMED_RECORDS_H
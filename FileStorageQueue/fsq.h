@@ -7,11 +7,62 @@
 // The processor runs in a dedicated thread. Thus, it is guaranteed to process at most one file at a time.
 // It can take as long as it needs to process the file. Files are guaranteed to be passed in the FIFO order.
 //
+// With `ProcessingConcurrency()` above one in the config, up to that many files are processed at once,
+// each by its own thread, and the processor has to be thread safe. The files are still passed in the FIFO
+// order, but may complete out of order. By default, the processed files are removed in the FIFO order, see
+// `RemoveProcessedFilesInOrder()`. The retry strategy is applied and updated per file, under a mutex.
+//
+// With `ProcessingConcurrency()` of zero, FSQ has no thread of its own to process files. They are processed
+// by the threads calling `ProcessNextFile()`, one file per call, for instance, by the threads `FSQManager`
+// shares across many queues, see `fsq_manager.h`.
+//
 // Once a file is ready, which translates to "on startup" if there are pending files,
-// the user handler in PROCESSOR::OnFileReady(file_name) is invoked.
+// the user handler in PROCESSOR::OnFileReady(file_name) is invoked. If the processor accepts the view
+// of the file as well, see `file_view.h`, the file is memory-mapped for the processor to read it with no copy.
 // When a retry strategy is active, further logic depends on the return value of this method,
 // see the description of the `FileProcessingResult` enum below for more details.
 //
+// Messages are appended by the calling thread. By default, PushMessage() is not thread safe.
+// With `GroupCommitConcurrentPushes()` in the config, it is, and the messages pushed concurrently
+// share one flush of the current file, see `GroupCommitMessage()` below.
+// With `PushMessagesViaWriterThread()` in the config, it is as well, and the messages are only staged
+// in memory by the calling thread. A dedicated writer thread owns the current file: it appends the messages,
+// and finalizes and purges files, so that no disk I/O happens on the threads that push messages.
+//
+// With `FinalizationCheckIntervalMilliseconds()` in the config, the worker thread checks the finalize strategy
+// on a timer as well, so that the current file does not stay open past its age when no messages are pushed.
+// The append strategy then writes out the messages it has buffered once they are due, see `FlushToFileIfDue()`.
+// The current file is then guarded by a mutex, as it is with `GroupCommitConcurrentPushes()`,
+// unless it is owned by the writer thread.
+//
+// With `ManifestFileName()` in the config, FSQ journals the changes to its set of files into the manifest file,
+// and reads it on startup instead of scanning the directory, see `LoadManifest()` below.
+//
+// With `FinalizeFilesInBackground()` in the config, the thread appending messages does not finalize files:
+// it hands the current file over to a dedicated finalizer thread, and switches to the file the finalizer thread
+// has pre-opened, so that the `rename()`-s and the `unlink()`-s of purging do not hit the latency of pushes.
+//
+// With `CompressFinalizedFiles()` in the config, the files are compressed as they are finalized,
+// and their compressed sizes are what the status reports and the purge strategy goes by, see `compression.h`.
+//
+// With `HighPriorityLane()` in the config, the messages pushed with `MessagePriority::High` are appended
+// to the current file of their own, by the calling thread in any mode, and finalized into the files
+// of their own, named as the rest with the "high-" prefix. These files are processed ahead of the rest
+// of the queue, and purged only once the rest of the queue is gone. See `AppendHighPriorityMessage()` below.
+//
+// With `SegmentSize()` in the config, messages are appended to preallocated segment files, which are reused
+// via `rename()` once processed instead of being removed, see `segments.h`.
+//
+// With `ConsumerCursors()` in the config, the same finalized files are read by more consumers than T_PROCESSOR,
+// each at its own pace, via its named cursor: `NextFileForCursor()` returns the oldest file the cursor has not
+// passed, and `AdvanceCursor()` moves the cursor past it once read, and persists it. The files processed by
+// T_PROCESSOR are only removed once all the cursors have passed them. The purge strategy still removes the
+// oldest files regardless, and the files processed, but not yet removed, before a restart are processed again.
+//
+// With `CollectMetrics()` in the config, FSQ counts the messages pushed and the files finalized, processed and
+// purged, and measures the latencies of these, for `GetMetrics()` to report without taking any locks.
+// Independently, `SetTraceHook()` has a hook called with the span of each of these events, see `metrics.h`.
+//
 // On top of the above FSQ keeps an eye on the size it occupies on disk and purges the oldest data files
 // if the specified purge strategy dictates so.
 
@@ -19,16 +70,29 @@
 #define FSQ_H
 
 #include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "status.h"
 #include "exception.h"
+#include "compression.h"
 #include "config.h"
+#include "file_view.h"
+#include "metrics.h"
+#include "segments.h"
 #include "strategies.h"
 
 #include "../Bricks/file/file.h"
@@ -52,6 +116,10 @@ namespace fsq {
 // with respect to the retry strategy specified as the template parameter to FSQ.
 enum class FileProcessingResult { Success, SuccessAndMoved, Unavailable, FailureNeedRetry };
 
+// With `HighPriorityLane()` in the config, the messages pushed with `High` priority are processed ahead
+// of the rest, and purged last. For instance, crash reports or billing events, as opposed to verbose telemetry.
+enum class MessagePriority { Normal, High };
+
 template <class CONFIG>
 class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
                   public CONFIG::T_FINALIZE_STRATEGY,
@@ -90,10 +158,27 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
       : T_RETRY_STRATEGY_INSTANCE(retry_strategy),
         processor_(processor),
         working_directory_(working_directory),
+        manifest_file_name_(T_CONFIG::ManifestFileName().empty()
+                                ? ""
+                                : T_FILE_SYSTEM::JoinPath(working_directory, T_CONFIG::ManifestFileName())),
         time_manager_(time_manager),
         file_system_(file_system) {
     T_CONFIG::Initialize(*this);
+    RemoveTemporaryFiles();
+    LoadCursors();
+    if (T_CONFIG::HighPriorityLane()) {
+      high_priority_append_strategy_.reset(
+          new T_FILE_APPEND_STRATEGY(static_cast<const T_FILE_APPEND_STRATEGY&>(*this)));
+      high_priority_finalize_strategy_.reset(
+          new T_FINALIZE_STRATEGY(static_cast<const T_FINALIZE_STRATEGY&>(*this)));
+    }
     worker_thread_ = std::thread(&FSQ::WorkerThread, this);
+    if (T_CONFIG::PushMessagesViaWriterThread()) {
+      writer_thread_ = std::thread(&FSQ::WriterThread, this);
+    }
+    if (T_CONFIG::FinalizeFilesInBackground()) {
+      finalizer_thread_ = std::thread(&FSQ::FinalizerThread, this);
+    }
   }
   FSQ(T_PROCESSOR& processor,
       const std::string& working_directory,
@@ -104,14 +189,21 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
 
   // Destructor gracefully terminates worker thread and optionally joins it.
   ~FSQ() {
+    // Have the worker thread no longer finalize the current file by the timer, if it does.
+    StopFinalizationTimer();
+    // Have the writer thread, if any, append all the staged messages first.
+    StopWriterThread();
+    // Have the finalizer thread, if any, finalize the files handed over to it.
+    StopFinalizerThread();
     // Notify the worker thread that it's time to wrap up.
     {
       std::unique_lock<std::mutex> lock(status_mutex_);
       force_worker_thread_shutdown_ = true;
       queue_status_condition_variable_.notify_all();
     }
-    // Close the current file. `current_file_.reset(nullptr);` is always safe especially in destructor.
-    current_file_.reset(nullptr);
+    // Flush and close the current file, and the one of high priority, if any.
+    CloseCurrentFile();
+    CloseHighPriorityFile();
     // Either wait for the processor thread to terminate or detach it, unless it's already done.
     if (worker_thread_.joinable()) {
       if (T_CONFIG::DetachProcessingThreadOnTermination()) {
@@ -138,47 +230,66 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
       }
     }
     // Returning `status_` by const reference is not thread-safe, return a copy from a locked section.
+    // The threads processing files keep modifying the queue, more so with concurrent processing.
+    std::unique_lock<std::mutex> lock(status_mutex_);
     return status_;
   }
 
-  // `PushMessage()` appends data to the queue.
-  void PushMessage(const T_MESSAGE& message) {
-    if (!status_ready_) {
-      // Need to wait for the status to be ready, otherwise current file resume might not happen.
-      std::unique_lock<std::mutex> lock(status_mutex_);
-      while (!status_ready_) {
-        queue_status_condition_variable_.wait(lock);
-      }
+  // The totals of the queue, without copying it. Does not wait for the initial scan of the directory.
+  QueueSummary<T_TIMESTAMP> GetQueueSummary() const {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    QueueSummary<T_TIMESTAMP> summary;
+    summary.total_size = status_.finalized.total_size + status_.appended_file_size;
+    summary.number_of_finalized_files = status_.finalized.queue.size();
+    if (!status_.finalized.queue.empty()) {
+      summary.oldest_finalized_file_timestamp = status_.finalized.queue.front().timestamp;
     }
-    if (force_worker_thread_shutdown_) {
-      if (T_CONFIG::NoThrowOnPushMessageWhileShuttingDown()) {
-        // Silently ignoring incoming messages while in shutdown mode is the default strategy.
-        return;
-      } else {
-        T_ERROR_HANDLING_STRATEGY::HandleError();
-      }
-    } else {
-      const T_TIMESTAMP now = time_manager_.Now();
-      const uint64_t message_size_in_bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(message);
-      {
-        // Take current message size into consideration when making file finalization decision.
-        status_.appended_file_size += message_size_in_bytes;
-        const bool should_finalize = T_FINALIZE_STRATEGY::ShouldFinalize(status_, now);
-        status_.appended_file_size -= message_size_in_bytes;
-        if (should_finalize) {
-          FinalizeCurrentFile();
-        }
-      }
-      EnsureCurrentFileIsOpen(now);
-      if (!current_file_ || current_file_->bad()) {
-        T_ERROR_HANDLING_STRATEGY::HandleError();
-      }
-      T_FILE_APPEND_STRATEGY::AppendToFile(*current_file_.get(), message);
-      status_.appended_file_size += message_size_in_bytes;
-      if (T_FINALIZE_STRATEGY::ShouldFinalize(status_, now)) {
-        FinalizeCurrentFile();
-      }
+    return summary;
+  }
+
+  // Has `callback` invoked whenever the queue changes in a way that may let a file be processed:
+  // a file is finalized or processed, or processing is resumed or forced. Invoked with the status mutex held,
+  // thus it should only signal another thread, and never call back into FSQ.
+  void SetStatusChangedCallback(std::function<void()> callback) {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    status_changed_callback_ = callback;
+  }
+
+  // The counters of the queue, without taking any locks, see `metrics.h`. Only the backlog is kept
+  // unless `CollectMetrics()` is set in the config. Does not wait for the initial scan of the directory.
+  metrics::Snapshot GetMetrics() const {
+    metrics::Snapshot snapshot = metrics_.TakeSnapshot();
+    if (snapshot.backlog_files) {
+      const uint64_t now = static_cast<uint64_t>(time_manager_.Now());
+      const uint64_t oldest = metrics_.oldest_finalized_file_timestamp.load(std::memory_order_relaxed);
+      snapshot.backlog_age = now > oldest ? now - oldest : 0;
     }
+    return snapshot;
+  }
+
+  // Has `hook` called with the span of every push, finalize, process and purge, see `metrics.h`.
+  // An empty hook to stop. Regardless of `CollectMetrics()` in the config.
+  void SetTraceHook(metrics::TraceHook hook) {
+    std::atomic_store(&trace_hook_,
+                      hook ? std::make_shared<const metrics::TraceHook>(hook)
+                           : std::shared_ptr<const metrics::TraceHook>());
+    has_trace_hook_ = static_cast<bool>(hook);
+  }
+
+  // `PushMessage()` appends data to the queue.
+  // THREAD SAFE only with `GroupCommitConcurrentPushes()` or `PushMessagesViaWriterThread()` in the config.
+  void PushMessage(const T_MESSAGE& message) {
+    const uint64_t begin_us = BeginEvent();
+    PushMessageNow(message, MessagePriority::Normal);
+    EndPushEvent(message, begin_us);
+  }
+
+  // Appends the message with the priority, see `HighPriorityLane()` in the config.
+  // The messages of high priority are appended by the calling thread, and are THREAD SAFE in any mode.
+  void PushMessage(const T_MESSAGE& message, MessagePriority priority) {
+    const uint64_t begin_us = BeginEvent();
+    PushMessageNow(message, priority);
+    EndPushEvent(message, begin_us);
   }
 
   // `ResumeProcessing() is used when a temporary reason of unavailability is now gone.
@@ -190,8 +301,9 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   // for a while,
   // `ResumeProcessing()` would not override that wait. Use `ForceProcessing()` for those forced overrides.
   void ResumeProcessing() {
+    std::unique_lock<std::mutex> lock(status_mutex_);
     processing_suspended_ = false;
-    queue_status_condition_variable_.notify_all();
+    NotifyQueueStatusChanged();
   }
 
   // `ForceProcessing()` initiates processing of finalized files, if any.
@@ -204,266 +316,1858 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   // Example: App just got updated, or a large external download has just been successfully completed.
   //
   // Use `ResumeProcessing()` in other cases.
+  //
+  // With the writer thread, returns once the writer thread has gone through the messages pushed before.
   void ForceProcessing(bool force_finalize_current_file = false) {
-    std::unique_lock<std::mutex> lock(status_mutex_);
-    if (force_finalize_current_file || status_.finalized.queue.empty()) {
-      if (current_file_) {
-        FinalizeCurrentFile(lock);
-      }
+    if (T_CONFIG::PushMessagesViaWriterThread()) {
+      StageForWriterThread(force_finalize_current_file ? StagedEntry::ForceProcessingAndFinalizeCurrentFile
+                                                       : StagedEntry::ForceProcessing);
+    } else {
+      const auto current_file_lock = LockCurrentFile();
+      ForceProcessingNow(force_finalize_current_file);
     }
-    processing_suspended_ = false;
-    force_processing_ = true;
-    queue_status_condition_variable_.notify_all();
   }
 
   // `FinalizeCurrentFile()` forces the finalization of the currently appended file.
+  // With the writer thread, returns once the writer thread has appended the messages pushed before,
+  // and has finalized the file. With the high priority lane, finalizes its current file as well.
   void FinalizeCurrentFile() {
-    if (current_file_) {
+    if (T_CONFIG::PushMessagesViaWriterThread()) {
+      StageForWriterThread(StagedEntry::FinalizeCurrentFile);
+    } else {
+      const auto current_file_lock = LockCurrentFile();
+      FinalizeCurrentFileNow();
+    }
+    FinalizeHighPriorityFile();
+  }
+
+  // `FinalizeCurrentFileIfDue()` finalizes the current file if the finalize strategy dictates so.
+  // With `FinalizationCheckIntervalMilliseconds()` in the config, it is called by the worker thread
+  // on the timer, or, with `ProcessingConcurrency()` of zero, by the owner of FSQ, such as `FSQManager`.
+  // Only thread safe then.
+  // Staged for the writer thread, if there is one, as it owns the current file, with no wait for it.
+  void FinalizeCurrentFileIfDue() {
+    if (T_CONFIG::PushMessagesViaWriterThread()) {
+      StageForWriterThread(StagedEntry::FinalizeCurrentFileIfDue);
+    } else {
+      const auto current_file_lock = LockCurrentFile();
+      if (!finalization_timer_stopped_) {
+        RollOverCurrentFileIfDue(time_manager_.Now());
+      }
+    }
+  }
+
+  // `ProcessNextFile()` passes the next finalized file to T_PROCESSOR, with `ProcessingConcurrency()` of zero.
+  // Returns false if there is no file to process, or if processing is suspended, or if it is to wait for
+  // the retry delay, which is then returned via `retry_wait_ms`, if set. Called concurrently, processes
+  // as many files at once, thus the callers keep it to one call at a time, unless the processor is thread safe.
+  bool ProcessNextFile(bricks::time::MILLISECONDS_INTERVAL* retry_wait_ms = nullptr) {
+    std::unique_ptr<FileInfo<T_TIMESTAMP>> file;
+    uint64_t number_of_failures_before;
+    {
       std::unique_lock<std::mutex> lock(status_mutex_);
-      FinalizeCurrentFile(lock);
+      if (!status_ready_ || force_worker_thread_shutdown_) {
+        return false;
+      }
+      if (!force_processing_) {
+        bricks::time::MILLISECONDS_INTERVAL wait_ms;
+        if (processing_suspended_) {
+          return false;
+        } else if (T_RETRY_STRATEGY_INSTANCE::ShouldWait(&wait_ms)) {
+          if (retry_wait_ms) {
+            *retry_wait_ms = wait_ms;
+          }
+          return false;
+        }
+      }
+      const FileInfo<T_TIMESTAMP>* next_file = NextFileToProcess();
+      if (!next_file) {
+        force_processing_ = false;
+        return false;
+      }
+      file = TakeFileForProcessing(*next_file, number_of_failures_before);
+    }
+    ProcessTakenFile(*file, number_of_failures_before);
+    return true;
+  }
+
+  // The oldest finalized file the cursor has not passed yet, for its consumer to read, see `ConsumerCursors()`
+  // in the config. Returns false if there is none. The file may still be purged while being read.
+  // Waits for the initial scan of the directory. THREAD SAFE.
+  bool NextFileForCursor(const std::string& cursor_name, FileInfo<T_TIMESTAMP>& file) const {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    while (!status_ready_) {
+      queue_status_condition_variable_.wait(lock);
+      if (force_worker_thread_shutdown_) {
+        return false;
+      }
+    }
+    const auto cursor = cursors_.find(cursor_name);
+    if (cursor == cursors_.end()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();  // No such cursor in the config.
+      return false;
+    }
+    for (const auto& f : status_.finalized.queue) {
+      if (!cursor->second.HasPassed(f)) {
+        file = f;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Moves the cursor past the file its consumer is done with, along with the files before it, and persists
+  // the cursor. Then removes the files T_PROCESSOR and all the cursors are done with. THREAD SAFE.
+  void AdvanceCursor(const std::string& cursor_name, const FileInfo<T_TIMESTAMP>& file) {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    const auto cursor = cursors_.find(cursor_name);
+    if (cursor == cursors_.end()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();  // No such cursor in the config.
+      return;
+    }
+    if (!cursor->second.HasPassed(file)) {
+      cursor->second.passed_any_file = true;
+      cursor->second.timestamp = file.timestamp;
+      SaveCursor(cursor_name, file.timestamp);
+      RemoveProcessedFiles();
+      CompactManifestIfNecessary();
+      NotifyQueueStatusChanged();
+    }
+  }
+
+  // `PurgeOldestFile()` purges the oldest finalized file, regardless of the purge strategy,
+  // as `FSQManager` does to keep many queues under a shared quota. Returns false if there are no finalized
+  // files.
+  bool PurgeOldestFile() {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    if (status_.finalized.queue.empty()) {
+      return false;
     }
+    PurgeOldestFinalizedFile();
+    RemoveProcessedFiles();
+    CompactManifestIfNecessary();
+    NotifyQueueStatusChanged();
+    return true;
   }
 
   // Removes all finalized and current files from disk.
   // Has to shut down as well, since removing files does not play well with the worker thread processing them.
   // USE CAREFULLY!
   void ShutdownAndRemoveAllFSQFiles() {
-    // First, force the worker thread to terminate.
+    // First, force the writer, the finalizer and the worker threads to terminate.
+    StopFinalizationTimer();
+    StopWriterThread();
+    StopFinalizerThread();
     {
       std::unique_lock<std::mutex> lock(status_mutex_);
       force_worker_thread_shutdown_ = true;
       queue_status_condition_variable_.notify_all();
     }
     current_file_.reset(nullptr);
+    current_segment_.reset(nullptr);
+    {
+      std::unique_lock<std::mutex> lock(high_priority_mutex_);
+      high_priority_file_.reset(nullptr);
+    }
     worker_thread_.join();
-    // Scan the directory and remove the files.
+    // Scan the directory and remove the files, the recycled segments, the files of high priority,
+    // the cursors and the temporary files included.
     for (const auto& file : ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+           uint64_t index;
            return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(s, t) ||
-                  T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t);
+                  T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t) ||
+                  recycled_segment_naming_.ParseFileName(s, &index) ||
+                  ParseHighPriorityFileName(T_FILE_NAMING_STRATEGY::finalized, s, t) ||
+                  ParseHighPriorityFileName(T_FILE_NAMING_STRATEGY::current, s, t) ||
+                  ParseCursorFileName(s, t) || ParseTemporaryFileName(s, t);
          })) {
       T_FILE_SYSTEM::RemoveFile(file.full_path_name);
     }
+    if (!manifest_file_name_.empty()) {
+      manifest_.reset(nullptr);
+      T_FILE_SYSTEM::RemoveFile(manifest_file_name_, bricks::RemoveFileParameters::Silent);
+    }
   }
 
  private:
-  // If the current file exists, declare it finalized, rename it under a permanent name
-  // and notify the worker thread that a new file is available.
-  void FinalizeCurrentFile(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
-    if (current_file_) {
-      current_file_.reset(nullptr);
-      const std::string finalized_file_name =
-          T_FILE_NAMING_STRATEGY::finalized.GenerateFileName(status_.appended_file_timestamp);
-      FileInfo<T_TIMESTAMP> finalized_file_info(
-          finalized_file_name,
-          T_FILE_SYSTEM::JoinPath(working_directory_, finalized_file_name),
-          status_.appended_file_timestamp,
-          status_.appended_file_size);
-      T_FILE_SYSTEM::RenameFile(current_file_name_, finalized_file_info.full_path_name);
-      status_.finalized.queue.push_back(finalized_file_info);
-      status_.finalized.total_size += status_.appended_file_size;
-      status_.appended_file_size = 0;
-      status_.appended_file_timestamp = T_TIMESTAMP(0);
-      current_file_name_.clear();
-      PurgeFilesAsNecessary(already_acquired_status_mutex_lock);
-      queue_status_condition_variable_.notify_all();
+  // What the writer thread is to do, in the order of the calls that have staged them.
+  struct StagedEntry {
+    enum Kind {
+      Message,
+      FinalizeCurrentFile,
+      FinalizeCurrentFileIfDue,
+      ForceProcessing,
+      ForceProcessingAndFinalizeCurrentFile
+    };
+    Kind kind;
+    T_TIMESTAMP timestamp;
+    T_MESSAGE message;
+  };
+
+  void PushMessageNow(const T_MESSAGE& message, MessagePriority priority) {
+    if (!status_ready_) {
+      // Need to wait for the status to be ready, otherwise current file resume might not happen.
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      while (!status_ready_) {
+        queue_status_condition_variable_.wait(lock);
+      }
+    }
+    if (force_worker_thread_shutdown_) {
+      if (T_CONFIG::NoThrowOnPushMessageWhileShuttingDown()) {
+        // Silently ignoring incoming messages while in shutdown mode is the default strategy.
+        return;
+      } else {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+      }
+    } else if (priority == MessagePriority::High && T_CONFIG::HighPriorityLane()) {
+      AppendHighPriorityMessage(message, time_manager_.Now());
+    } else if (T_CONFIG::PushMessagesViaWriterThread()) {
+      StageForWriterThread(StagedEntry::Message, message);
+    } else if (T_CONFIG::GroupCommitConcurrentPushes()) {
+      GroupCommitMessage(message);
+    } else {
+      const auto current_file_lock = LockCurrentFile();
+      AppendMessage(message, time_manager_.Now());
+      RecordCurrentSegmentDataSize();
     }
   }
 
-  // Scans the directory for the files that match certain predicate.
-  // Gets their sized and and extracts timestamps from their names along the way.
-  template <typename F>
-  std::vector<FileInfo<T_TIMESTAMP>> ScanDir(F f) const {
-    std::vector<FileInfo<T_TIMESTAMP>> matched_files_list;
-    const auto& dir = working_directory_;
-    T_FILE_SYSTEM::ScanDir(working_directory_,
-                           [this, &matched_files_list, &f, dir](const std::string& file_name) {
-      // if (T_FILE_NAMING_STRATEGY::template IsFinalizedFileName<T_TIMESTAMP>(file_name)) {
-      T_TIMESTAMP timestamp;
-      if (f(file_name, &timestamp)) {
-        matched_files_list.emplace_back(file_name,
-                                        T_FILE_SYSTEM::JoinPath(working_directory_, file_name),
-                                        timestamp,
-                                        T_FILE_SYSTEM::GetFileSize(T_FILE_SYSTEM::JoinPath(dir, file_name)));
-      }
-    });
-    std::sort(matched_files_list.begin(), matched_files_list.end());
-    return matched_files_list;
+  // The time the event begins at, in microseconds, or zero if neither the metrics nor the trace are collected.
+  uint64_t BeginEvent() const {
+    return (T_CONFIG::CollectMetrics() || has_trace_hook_) ? metrics::NowMicroseconds() : 0;
   }
 
-  // EnsureCurrentFileIsOpen() expires the current file and/or creates the new one as necessary.
-  void EnsureCurrentFileIsOpen(const T_TIMESTAMP now) {
-    if (!current_file_) {
-      current_file_name_ =
-          T_FILE_SYSTEM::JoinPath(working_directory_, T_FILE_NAMING_STRATEGY::current.GenerateFileName(now));
-      // TODO(dkorolev): This relies on OutputFile being std::ofstream. Fine for now anyway.
-      current_file_.reset(new typename T_FILE_SYSTEM::OutputFile(current_file_name_,
-                                                                 std::ofstream::trunc | std::ofstream::binary));
-      status_.appended_file_timestamp = now;
+  // Records the latency of the event into the histogram, if any, and emits the span of the event, if traced.
+  void EndEvent(metrics::Event event,
+                uint64_t begin_us,
+                metrics::Histogram* histogram,
+                const std::string& file_name,
+                uint64_t bytes) {
+    if (!begin_us) {
+      return;
+    }
+    const uint64_t end_us = metrics::NowMicroseconds();
+    if (T_CONFIG::CollectMetrics() && histogram) {
+      histogram->Record(end_us - begin_us);
+    }
+    if (has_trace_hook_) {
+      const std::shared_ptr<const metrics::TraceHook> hook = std::atomic_load(&trace_hook_);
+      if (hook) {
+        (*hook)(metrics::Span{event, begin_us, end_us, file_name, bytes});
+      }
     }
   }
 
-  // Purges the old files as necessary.
-  void PurgeFilesAsNecessary(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
-    static_cast<void>(already_acquired_status_mutex_lock);
-    while (!status_.finalized.queue.empty() && T_PURGE_STRATEGY::ShouldPurge(status_)) {
-      const std::string filename = status_.finalized.queue.front().full_path_name;
-      status_.finalized.total_size -= status_.finalized.queue.front().size;
-      status_.finalized.queue.pop_front();
-      T_FILE_SYSTEM::RemoveFile(filename);
+  void EndPushEvent(const T_MESSAGE& message, uint64_t begin_us) {
+    if (begin_us) {
+      const uint64_t bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(message);
+      if (T_CONFIG::CollectMetrics()) {
+        metrics::Counters::Increment(metrics_.messages_pushed);
+        metrics::Counters::Increment(metrics_.bytes_pushed, bytes);
+      }
+      EndEvent(metrics::Event::Push, begin_us, &metrics_.push_latency, std::string(), bytes);
     }
   }
 
-  // The worker thread first scans the directory for present finalized and current files.
-  // Present finalized files are queued up.
-  // If more than one present current files is available, all but one are finalized on the spot.
-  // The one remaining current file can be appended to or finalized depending on the strategy.
-  void WorkerThread() {
-    // Step 1/4: Get the list of finalized files.
-    typedef std::vector<FileInfo<T_TIMESTAMP>> FileInfoVector;
-    const FileInfoVector& finalized_files_on_disk = ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
-      return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(s, t);
-    });
-    status_.finalized.queue.assign(finalized_files_on_disk.begin(), finalized_files_on_disk.end());
-    status_.finalized.total_size = 0;
-    for (const auto& file : finalized_files_on_disk) {
-      status_.finalized.total_size += file.size;
+  void ForceProcessingNow(bool force_finalize_current_file) {
+    bool finalize_current_file;
+    {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      finalize_current_file = force_finalize_current_file || status_.finalized.queue.empty();
+    }
+    if (finalize_current_file) {
+      FinalizeCurrentFileNow();
+      FinalizeHighPriorityFile();
     }
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    processing_suspended_ = false;
+    force_processing_ = true;
+    NotifyQueueStatusChanged();
+  }
 
-    // Step 2/4: Get the list of current files.
-    const FileInfoVector& current_files_on_disk = ScanDir([this](
-        const std::string& s, T_TIMESTAMP* t) { return T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t); });
-    if (!current_files_on_disk.empty()) {
-      const bool resume = T_FILE_RESUME_STRATEGY::ShouldResume();
-      const size_t number_of_files_to_finalize = current_files_on_disk.size() - (resume ? 1u : 0u);
-      for (size_t i = 0; i < number_of_files_to_finalize; ++i) {
-        const FileInfo<T_TIMESTAMP>& f = current_files_on_disk[i];
-        const std::string finalized_file_name = T_FILE_NAMING_STRATEGY::finalized.GenerateFileName(f.timestamp);
-        FileInfo<T_TIMESTAMP> finalized_file_info(
-            finalized_file_name,
-            T_FILE_SYSTEM::JoinPath(working_directory_, finalized_file_name),
-            f.timestamp,
-            f.size);
-        T_FILE_SYSTEM::RenameFile(f.full_path_name, finalized_file_info.full_path_name);
-        status_.finalized.queue.push_back(finalized_file_info);
-        status_.finalized.total_size += f.size;
-      }
-      if (resume) {
-        const FileInfo<T_TIMESTAMP>& c = current_files_on_disk.back();
-        status_.appended_file_timestamp = c.timestamp;
-        status_.appended_file_size = c.size;
-        current_file_name_ = c.full_path_name;
-        // TODO(dkorolev): This relies on OutputFile being std::ofstream. Fine for now anyway.
-        current_file_.reset(new typename T_FILE_SYSTEM::OutputFile(current_file_name_,
-                                                                   std::ofstream::app | std::ofstream::binary));
-      }
+  // With the background finalization, returns once the finalizer thread has finalized the file.
+  void FinalizeCurrentFileNow() {
+    if (T_CONFIG::FinalizeFilesInBackground()) {
+      HandOverCurrentFile();
+      WaitForFinalizerThread();
+    } else if (current_file_) {
+      CloseCurrentFile();
+      const std::string compressed = PrepareFileToFinalize(current_file_name_);
       std::unique_lock<std::mutex> lock(status_mutex_);
-      PurgeFilesAsNecessary(lock);
+      FinalizeCurrentFile(compressed, lock);
     }
+  }
 
-    // Step 3/4: Signal that FSQ's status has been successfully parsed from disk and FSQ is ready to go.
-    {
-      std::unique_lock<std::mutex> lock(status_mutex_);
-      status_ready_ = true;
-      queue_status_condition_variable_.notify_all();
+  // Finalizes the current file once the strategy dictates so, handing it over to the finalizer thread
+  // with the background finalization.
+  void RollOverCurrentFile() {
+    if (T_CONFIG::FinalizeFilesInBackground()) {
+      HandOverCurrentFile();
+    } else {
+      FinalizeCurrentFileNow();
     }
+  }
 
-    // Step 4/4: Start processing finalized files via T_PROCESSOR, respecting retry strategy.
-    while (true) {
-      // Wait for a newly arrived file or another event to happen.
-      std::unique_ptr<FileInfo<T_TIMESTAMP>> next_file;
+  // With `FinalizationCheckIntervalMilliseconds()`, the worker thread may finalize the current file while
+  // a message is being appended to it. With `GroupCommitConcurrentPushes()`, so may any thread calling
+  // `FinalizeCurrentFile()` or `ForceProcessing()`, as pushing is thread safe. Thus the current file is guarded
+  // in either case, unless the writer thread owns it.
+  std::unique_lock<std::mutex> LockCurrentFile() {
+    std::unique_lock<std::mutex> lock(current_file_mutex_, std::defer_lock);
+    if ((T_CONFIG::FinalizationCheckIntervalMilliseconds() || T_CONFIG::GroupCommitConcurrentPushes()) &&
+        !T_CONFIG::PushMessagesViaWriterThread()) {
+      lock.lock();
+    }
+    return lock;
+  }
+
+  // Finalizes the current file, if any, if the strategy dictates so, or otherwise has the append strategy
+  // write out what is due. Finalizes the file of the high priority lane if due as well.
+  void RollOverCurrentFileIfDue(const T_TIMESTAMP now) {
+    if (current_file_) {
+      bool should_finalize;
       {
         std::unique_lock<std::mutex> lock(status_mutex_);
-        const bricks::time::EPOCH_MILLISECONDS begin_ms = bricks::time::Now();
-        bricks::time::MILLISECONDS_INTERVAL wait_ms;
-        const bool should_wait = T_RETRY_STRATEGY_INSTANCE::ShouldWait(&wait_ms);
-        const auto predicate = [this, should_wait, begin_ms, wait_ms]() {
-          if (force_worker_thread_shutdown_) {
-            return true;
-          } else if (force_processing_) {
-            return true;
-          } else if (processing_suspended_) {
-            return false;
-          } else if (should_wait && bricks::time::Now() - begin_ms < wait_ms) {
-            return false;
-          } else if (!status_.finalized.queue.empty()) {
-            return true;
-          } else {
-            return false;
-          }
-        };
-        if (!predicate()) {
-          if (should_wait) {
-            // Add one millisecond to avoid multiple runs of this loop when `wait_ms` is close to zero.
-            queue_status_condition_variable_.wait_for(
-                lock, std::chrono::milliseconds(static_cast<uint64_t>(wait_ms) + 1), predicate);
-          } else {
-            queue_status_condition_variable_.wait(lock, predicate);
-          }
-        }
-        if (!status_.finalized.queue.empty()) {
-          next_file.reset(new FileInfo<T_TIMESTAMP>(status_.finalized.queue.front()));
-        }
-        if (force_worker_thread_shutdown_) {
-          // By default, terminate immediately.
-          // However, allow the user to override this setting and have the queue
-          // processed in full before returning from FSQ's destructor.
-          if (!T_CONFIG::ProcessQueueToTheEndOnShutdown() || !next_file) {
-            return;
-          }
-        }
+        should_finalize = T_FINALIZE_STRATEGY::ShouldFinalize(status_, now);
+      }
+      if (should_finalize) {
+        RollOverCurrentFile();
+      }
+    }
+    if (current_file_) {
+      // The append strategy may hold the messages pushed a while ago, and no more may be coming.
+      T_FILE_APPEND_STRATEGY::FlushToFileIfDue(*current_file_.get());
+      RecordCurrentSegmentDataSize();
+    }
+    if (T_CONFIG::HighPriorityLane()) {
+      std::unique_lock<std::mutex> lock(high_priority_mutex_);
+      if (high_priority_file_ && high_priority_finalize_strategy_->ShouldFinalize(high_priority_status_, now)) {
+        FinalizeHighPriorityFile(lock);
       }
+    }
+  }
 
-      // Process the file, if available.
-      if (next_file) {
-        const FileProcessingResult result = processor_.OnFileReady(*next_file.get(), time_manager_.Now());
-        // Important to clear force_processing_, in a locked way.
-        {
-          std::unique_lock<std::mutex> lock(status_mutex_);
-          force_processing_ = false;
-        }
-        if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
-          std::unique_lock<std::mutex> lock(status_mutex_);
-          processing_suspended_ = false;
-          if (*next_file.get() == status_.finalized.queue.front()) {
-            status_.finalized.total_size -= status_.finalized.queue.front().size;
-            status_.finalized.queue.pop_front();
-          } else {
-            // The `front()` part of the queue should only be altered by this worker thread.
-            T_ERROR_HANDLING_STRATEGY::HandleError();
-          }
-          if (result == FileProcessingResult::Success) {
-            T_FILE_SYSTEM::RemoveFile(next_file->full_path_name);
-          }
-          T_RETRY_STRATEGY_INSTANCE::OnSuccess();
-        } else if (result == FileProcessingResult::Unavailable) {
-          std::unique_lock<std::mutex> lock(status_mutex_);
-          processing_suspended_ = true;
-        } else if (result == FileProcessingResult::FailureNeedRetry) {
-          T_RETRY_STRATEGY_INSTANCE::OnFailure();
-        } else {
-          T_ERROR_HANDLING_STRATEGY::HandleError();
-        }
+  // The high priority lane has a current file of its own, see `HighPriorityLane()` in the config. It is
+  // appended to by the calling thread, under a mutex of its own, as the messages of high priority are expected
+  // to be few.
+  // Its copies of the append and the finalize strategies, made once `T_CONFIG::Initialize()` has set them up,
+  // keep their state, if any, apart from those of the rest of the messages. Its current file is finalized as
+  // if there was no backlog, as the files of high priority are processed ahead of the backlog anyway.
+  // The current file of high priority is neither journaled into the manifest nor resumed: the ones left
+  // by the previous run are found by scanning the directory on startup, and are finalized right away.
+  void AppendHighPriorityMessage(const T_MESSAGE& message, const T_TIMESTAMP now) {
+    std::unique_lock<std::mutex> lock(high_priority_mutex_);
+    const uint64_t message_size_in_bytes = high_priority_append_strategy_->MessageSizeInBytes(message);
+    if (high_priority_file_) {
+      high_priority_status_.appended_file_size += message_size_in_bytes;
+      const bool should_finalize = high_priority_finalize_strategy_->ShouldFinalize(high_priority_status_, now);
+      high_priority_status_.appended_file_size -= message_size_in_bytes;
+      if (should_finalize) {
+        FinalizeHighPriorityFile(lock);
       }
     }
+    if (!high_priority_file_) {
+      high_priority_file_name_ = T_FILE_SYSTEM::JoinPath(
+          working_directory_, HighPriorityFileName(T_FILE_NAMING_STRATEGY::current.GenerateFileName(now)));
+      high_priority_file_ =
+          OpenOutputFile(high_priority_file_name_, std::ofstream::trunc | std::ofstream::binary);
+      high_priority_status_.appended_file_timestamp = now;
+    }
+    if (high_priority_file_->bad()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();
+    }
+    high_priority_append_strategy_->AppendToFile(*high_priority_file_.get(), message);
+    high_priority_append_strategy_->FlushToFile(*high_priority_file_.get());
+    high_priority_status_.appended_file_size += message_size_in_bytes;
+    if (high_priority_finalize_strategy_->ShouldFinalize(high_priority_status_, now)) {
+      FinalizeHighPriorityFile(lock);
+    }
+  }
+
+  // Has the append strategy write out what it may have buffered, and closes the current file of high priority.
+  void CloseHighPriorityFile() {
+    std::unique_lock<std::mutex> lock(high_priority_mutex_);
+    CloseHighPriorityFile(lock);
+  }
+
+  void CloseHighPriorityFile(std::unique_lock<std::mutex>& already_acquired_high_priority_mutex_lock) {
+    static_cast<void>(already_acquired_high_priority_mutex_lock);
+    if (high_priority_file_) {
+      typename T_FILE_SYSTEM::OutputFile& file = *high_priority_file_.get();
+      high_priority_append_strategy_->FlushBeforeClosingFile(file, high_priority_file_name_);
+      high_priority_file_.reset(nullptr);
+    }
+  }
+
+  // Finalizes the current file of the high priority lane, if any.
+  void FinalizeHighPriorityFile() {
+    if (T_CONFIG::HighPriorityLane()) {
+      std::unique_lock<std::mutex> lock(high_priority_mutex_);
+      FinalizeHighPriorityFile(lock);
+    }
+  }
+
+  void FinalizeHighPriorityFile(std::unique_lock<std::mutex>& already_acquired_high_priority_mutex_lock) {
+    if (high_priority_file_) {
+      CloseHighPriorityFile(already_acquired_high_priority_mutex_lock);
+      const std::string compressed = PrepareFileToFinalize(high_priority_file_name_);
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      const auto finalized_file_info = MoveToFinalized(high_priority_file_name_,
+                                                       high_priority_status_.appended_file_timestamp,
+                                                       high_priority_status_.appended_file_size,
+                                                       compressed,
+                                                       MessagePriority::High);
+      status_.finalized.queue.push_back(finalized_file_info);
+      status_.finalized.total_size += finalized_file_info.size;
+      high_priority_status_.appended_file_size = 0;
+      high_priority_status_.appended_file_timestamp = T_TIMESTAMP(0);
+      high_priority_file_name_.clear();
+      PurgeFilesAsNecessary(lock);
+      CompactManifestIfNecessary();
+      NotifyQueueStatusChanged();
+    }
+  }
+
+  // The files of high priority are named as the rest, with the prefix.
+  static const std::string& HighPriorityFilePrefix() {
+    static const std::string prefix = "high-";
+    return prefix;
+  }
+
+  static std::string HighPriorityFileName(const std::string& name) {
+    return HighPriorityFilePrefix() + name;
+  }
+
+  // Without the high priority lane, the files of high priority left by the runs with it are taken for the rest.
+  static bool IsHighPriorityFileName(const std::string& name) {
+    return T_CONFIG::HighPriorityLane() && HasHighPriorityFilePrefix(name);
+  }
+
+  static bool HasHighPriorityFilePrefix(const std::string& name) {
+    const std::string& prefix = HighPriorityFilePrefix();
+    return !name.compare(0, prefix.length(), prefix);
+  }
+
+  // Parses the name of the file of high priority with the naming schema of the rest of the files.
+  template <typename T_SCHEMA>
+  static bool ParseHighPriorityFileName(const T_SCHEMA& schema, const std::string& name, T_TIMESTAMP* t) {
+    const std::string& prefix = HighPriorityFilePrefix();
+    return HasHighPriorityFilePrefix(name) && schema.ParseFileName(name.substr(prefix.length()), t);
+  }
+
+  // Has the worker thread no longer finalize the current file on the timer, before the threads it may hand
+  // the current file over to terminate.
+  void StopFinalizationTimer() {
+    const auto current_file_lock = LockCurrentFile();
+    finalization_timer_stopped_ = true;
+  }
+
+  // Appends the message to the current file, finalizing it before and/or after as the strategy dictates.
+  // Not thread safe: called from PushMessage() directly, by the leader of the group commit,
+  // or by the writer thread.
+  void AppendMessage(const T_MESSAGE& message, const T_TIMESTAMP now) {
+    const uint64_t message_size_in_bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(message);
+    // Take current message size into consideration when making file finalization decision.
+    // With no file open, its timestamp is not set yet, and there is nothing to finalize anyway.
+    if (current_file_) {
+      status_.appended_file_size += message_size_in_bytes;
+      const bool should_finalize = T_FINALIZE_STRATEGY::ShouldFinalize(status_, now);
+      status_.appended_file_size -= message_size_in_bytes;
+      if (should_finalize) {
+        RollOverCurrentFile();
+      }
+    }
+    EnsureCurrentFileIsOpen(now);
+    if (!current_file_ || current_file_->bad()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();
+    }
+    T_FILE_APPEND_STRATEGY::AppendToFile(*current_file_.get(), message);
+    status_.appended_file_size += message_size_in_bytes;
+    if (T_FINALIZE_STRATEGY::ShouldFinalize(status_, now)) {
+      RollOverCurrentFile();
+    }
+  }
+
+  // Stages the message, and returns once it has been appended and flushed.
+  // The first pusher to find no write in progress becomes the leader: it takes all the staged messages,
+  // appends them and flushes the file once, outside the lock, while the messages pushed in the meantime
+  // are staged for the next group. Thus, under contention, many messages share one write.
+  // If writing the group throws, the error is rethrown to each pusher of the group, the leader included,
+  // as none of their messages is known to be flushed.
+  void GroupCommitMessage(const T_MESSAGE& message) {
+    std::unique_lock<std::mutex> lock(group_commit_mutex_);
+    group_commit_staged_.push_back(message);
+    const uint64_t ticket = ++group_commit_number_of_staged_messages_;
+    while (group_commit_number_of_written_messages_ < ticket) {
+      if (group_commit_write_in_progress_) {
+        group_commit_condition_variable_.wait(lock);
+      } else {
+        group_commit_write_in_progress_ = true;
+        // Swap the vectors, so that their allocated capacity keeps being reused.
+        group_commit_group_.swap(group_commit_staged_);
+        const uint64_t first_ticket_in_group = group_commit_number_of_written_messages_ + 1;
+        const uint64_t last_ticket_in_group = group_commit_number_of_staged_messages_;
+        lock.unlock();
+        const std::exception_ptr error = WriteGroupCommit();
+        group_commit_group_.clear();
+        lock.lock();
+        if (error) {
+          const uint64_t group_size = last_ticket_in_group - first_ticket_in_group + 1;
+          group_commit_errors_.push_back(
+              GroupCommitError{first_ticket_in_group, last_ticket_in_group, group_size, error});
+        }
+        group_commit_number_of_written_messages_ = last_ticket_in_group;
+        group_commit_write_in_progress_ = false;
+        group_commit_condition_variable_.notify_all();
+      }
+    }
+    RethrowGroupCommitError(ticket);
+  }
+
+  // Appends the group of messages and flushes the file. Returns the error it has run into, if any.
+  // Called by the leader of the group commit, with `group_commit_mutex_` unlocked.
+  std::exception_ptr WriteGroupCommit() {
+    try {
+      const auto current_file_lock = LockCurrentFile();
+      for (const T_MESSAGE& staged_message : group_commit_group_) {
+        AppendMessage(staged_message, time_manager_.Now());
+      }
+      if (current_file_) {
+        T_FILE_APPEND_STRATEGY::FlushToFile(*current_file_.get());
+        RecordCurrentSegmentDataSize();
+      }
+    } catch (...) {
+      return std::current_exception();
+    }
+    return std::exception_ptr();
+  }
+
+  // Rethrows the error of the group the message of the ticket was written with, if it failed.
+  // The error is forgotten once rethrown to all the pushers of the group.
+  // MUTEX-LOCKED, `group_commit_mutex_`.
+  void RethrowGroupCommitError(uint64_t ticket) {
+    for (auto it = group_commit_errors_.begin(); it != group_commit_errors_.end(); ++it) {
+      if (it->first_ticket <= ticket && ticket <= it->last_ticket) {
+        const std::exception_ptr error = it->error;
+        if (!--it->number_of_pushers_to_rethrow_to) {
+          group_commit_errors_.erase(it);
+        }
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+  // Stages the message or the command for the writer thread. Blocks while too many entries are staged.
+  // Commands other than `Message` block until the writer thread has executed them.
+  // Except for the timer-driven `FinalizeCurrentFileIfDue`, which never blocks, so that the worker thread
+  // keeps processing files. It is not staged if there is no room, as the writer thread then has the messages
+  // staged to append, and checks the finalize strategy as it appends them.
+  void StageForWriterThread(typename StagedEntry::Kind kind, const T_MESSAGE& message = T_MESSAGE()) {
+    const T_TIMESTAMP now = time_manager_.Now();
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    if (kind == StagedEntry::FinalizeCurrentFileIfDue) {
+      if (!writer_shutdown_ && writer_staged_.size() < T_CONFIG::WriterThreadMaxStagedMessages()) {
+        StageEntry(kind, now, message);
+      }
+      return;
+    }
+    pushers_condition_variable_.wait(lock, [this]() {
+      return writer_staged_.size() < T_CONFIG::WriterThreadMaxStagedMessages() || writer_shutdown_;
+    });
+    if (writer_shutdown_) {
+      return;
+    }
+    RethrowWriterError();
+    const uint64_t ticket = StageEntry(kind, now, message);
+    if (kind != StagedEntry::Message) {
+      pushers_condition_variable_.wait(lock,
+                                       [this, ticket]() { return writer_number_of_done_entries_ >= ticket; });
+      RethrowWriterError();
+    }
+  }
+
+  // Stages the entry, and returns its ticket. MUTEX-LOCKED, `writer_mutex_`.
+  uint64_t StageEntry(typename StagedEntry::Kind kind, const T_TIMESTAMP now, const T_MESSAGE& message) {
+    writer_staged_.push_back(StagedEntry{kind, now, message});
+    if (writer_staged_.size() == 1u) {
+      // The writer thread only waits when there is nothing staged.
+      writer_condition_variable_.notify_one();
+    }
+    return ++writer_number_of_staged_entries_;
+  }
+
+  // Rethrows the error the writer thread has run into, if any, to the calling thread, and clears it.
+  // Never to the timer-driven `FinalizeCurrentFileIfDue`, as the worker thread, or the owner of FSQ such as
+  // `FSQManager`, has no one to pass the error on to. The next push gets it instead.
+  // MUTEX-LOCKED, `writer_mutex_`.
+  void RethrowWriterError() {
+    if (writer_error_) {
+      std::exception_ptr error;
+      std::swap(error, writer_error_);
+      std::rethrow_exception(error);
+    }
+  }
+
+  // The writer thread takes all the staged entries at once, executes them, and flushes the current file once.
+  // On shutdown, it goes through all the staged entries before terminating.
+  // If executing the entries throws, the rest of them are skipped, and the error is rethrown to the next caller
+  // of `StageForWriterThread()`. The writer thread carries on, and the callers waiting for it are released.
+  void WriterThread() {
+    {
+      // The current file may only be appended to once the worker thread has resumed it, if it is to be resumed.
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      queue_status_condition_variable_.wait(lock, [this]() {
+        return status_ready_ || force_worker_thread_shutdown_;
+      });
+    }
+    std::vector<StagedEntry> entries;
+    while (true) {
+      uint64_t number_of_done_entries;
+      {
+        std::unique_lock<std::mutex> lock(writer_mutex_);
+        writer_condition_variable_.wait(lock, [this]() { return !writer_staged_.empty() || writer_shutdown_; });
+        if (writer_staged_.empty()) {
+          return;
+        }
+        // Swap the vectors, so that their allocated capacity keeps being reused.
+        entries.swap(writer_staged_);
+        number_of_done_entries = writer_number_of_staged_entries_;
+        pushers_condition_variable_.notify_all();
+      }
+      std::exception_ptr error;
+      try {
+        for (const StagedEntry& entry : entries) {
+          if (entry.kind == StagedEntry::Message) {
+            AppendMessage(entry.message, entry.timestamp);
+          } else if (entry.kind == StagedEntry::FinalizeCurrentFile) {
+            FinalizeCurrentFileNow();
+          } else if (entry.kind == StagedEntry::FinalizeCurrentFileIfDue) {
+            RollOverCurrentFileIfDue(entry.timestamp);
+          } else {
+            ForceProcessingNow(entry.kind == StagedEntry::ForceProcessingAndFinalizeCurrentFile);
+          }
+        }
+        if (current_file_) {
+          T_FILE_APPEND_STRATEGY::FlushToFile(*current_file_.get());
+          RecordCurrentSegmentDataSize();
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      entries.clear();
+      {
+        std::unique_lock<std::mutex> lock(writer_mutex_);
+        if (error && !writer_error_) {
+          writer_error_ = error;
+        }
+        writer_number_of_done_entries_ = number_of_done_entries;
+        pushers_condition_variable_.notify_all();
+      }
+    }
+  }
+
+  // Has the writer thread, if running, go through all the staged entries, and waits for it to terminate.
+  void StopWriterThread() {
+    if (writer_thread_.joinable()) {
+      {
+        std::unique_lock<std::mutex> lock(writer_mutex_);
+        writer_shutdown_ = true;
+        writer_condition_variable_.notify_one();
+      }
+      writer_thread_.join();
+    }
+  }
+
+  // Has the finalizer thread, if running, finalize all the files handed over to it, and waits for it
+  // to terminate. Removes the pre-opened file, as nothing has been appended to it, or recycles it.
+  void StopFinalizerThread() {
+    if (finalizer_thread_.joinable()) {
+      {
+        std::unique_lock<std::mutex> lock(finalizer_mutex_);
+        finalizer_shutdown_ = true;
+        finalizer_condition_variable_.notify_all();
+      }
+      finalizer_thread_.join();
+      if (spare_file_) {
+        spare_file_.reset(nullptr);
+        spare_segment_.reset(nullptr);
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        RecycleOrRemoveFile(spare_file_name_);
+      }
+    }
+  }
+
+  // Hands the current file over to the finalizer thread, to have the next message go to the pre-opened file.
+  // Only writes out what the append strategy may have buffered, as the strategy keeps its buffer for the next
+  // file: closing, `fsync()`-ing, renaming, compressing and purging files is up to the finalizer thread.
+  void HandOverCurrentFile() {
+    if (current_file_) {
+      T_FILE_APPEND_STRATEGY::FlushToFile(*current_file_.get());
+      RecordCurrentSegmentDataSize();
+      current_segment_.reset(nullptr);
+      {
+        std::unique_lock<std::mutex> lock(finalizer_mutex_);
+        files_to_finalize_.push_back(FileToFinalize{std::move(current_file_),
+                                                    current_file_name_,
+                                                    status_.appended_file_timestamp,
+                                                    status_.appended_file_size});
+        ++finalizer_number_of_handed_over_files_;
+        finalizer_condition_variable_.notify_all();
+      }
+      status_.appended_file_size = 0;
+      status_.appended_file_timestamp = T_TIMESTAMP(0);
+      current_file_name_.clear();
+    }
+  }
+
+  // Switches to the file the finalizer thread has pre-opened, waiting for it if the finalizer thread is behind.
+  void TakeSpareFile() {
+    std::unique_lock<std::mutex> lock(finalizer_mutex_);
+    finalizer_condition_variable_.wait(lock, [this]() { return spare_file_ || finalizer_shutdown_; });
+    if (spare_file_) {
+      current_file_ = std::move(spare_file_);
+      current_segment_ = std::move(spare_segment_);
+      current_file_name_ = spare_file_name_;
+      // Have the finalizer thread pre-open the next one.
+      finalizer_condition_variable_.notify_all();
+    }
+  }
+
+  // Waits until the finalizer thread has finalized all the files handed over to it so far.
+  void WaitForFinalizerThread() {
+    std::unique_lock<std::mutex> lock(finalizer_mutex_);
+    const uint64_t ticket = finalizer_number_of_handed_over_files_;
+    finalizer_condition_variable_.wait(lock, [this, ticket]() {
+      return finalizer_number_of_finalized_files_ >= ticket;
+    });
+  }
+
+  // The finalizer thread finalizes the files handed over to it, in order, and purges the old ones, so that the
+  // thread appending messages never waits for the `rename()`-s and the `unlink()`-s under `status_mutex_`.
+  // It also keeps one file pre-opened, for the appending thread to switch to once it hands the current one.
+  // On shutdown, it finalizes all the files handed over before terminating.
+  void FinalizerThread() {
+    {
+      // The names of the current files are only known once the worker thread has scanned the directory.
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      queue_status_condition_variable_.wait(lock, [this]() {
+        return status_ready_ || force_worker_thread_shutdown_;
+      });
+    }
+    std::vector<FileToFinalize> files;
+    while (true) {
+      uint64_t number_of_handed_over_files;
+      bool open_spare_file;
+      {
+        std::unique_lock<std::mutex> lock(finalizer_mutex_);
+        finalizer_condition_variable_.wait(lock, [this]() {
+          return !files_to_finalize_.empty() || !spare_file_ || finalizer_shutdown_;
+        });
+        if (files_to_finalize_.empty() && finalizer_shutdown_) {
+          return;
+        }
+        // Swap the vectors, so that their allocated capacity keeps being reused.
+        files.swap(files_to_finalize_);
+        number_of_handed_over_files = finalizer_number_of_handed_over_files_;
+        open_spare_file = !spare_file_ && !finalizer_shutdown_;
+      }
+      // Pre-open the next file first, as the appending thread may be waiting for it.
+      if (open_spare_file) {
+        OpenSpareFile();
+      }
+      for (FileToFinalize& file : files) {
+        file.file.reset(nullptr);
+        T_FILE_APPEND_STRATEGY::SyncFile(file.file_name);
+        const std::string compressed = PrepareFileToFinalize(file.file_name);
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const auto finalized_file_info = MoveToFinalized(file.file_name, file.timestamp, file.size, compressed);
+        status_.finalized.queue.push_back(finalized_file_info);
+        status_.finalized.total_size += finalized_file_info.size;
+        PurgeFilesAsNecessary(lock);
+        CompactManifestIfNecessary();
+        NotifyQueueStatusChanged();
+      }
+      files.clear();
+      {
+        std::unique_lock<std::mutex> lock(finalizer_mutex_);
+        finalizer_number_of_finalized_files_ = number_of_handed_over_files;
+        finalizer_condition_variable_.notify_all();
+      }
+    }
+  }
+
+  // Creates the file for the appending thread to switch to. Named after the time it is created at,
+  // as opposed to the time of its first message, and always after the previous current file.
+  void OpenSpareFile() {
+    T_TIMESTAMP timestamp = time_manager_.Now();
+    if (!(last_current_file_timestamp_ < timestamp)) {
+      timestamp = static_cast<T_TIMESTAMP>(static_cast<uint64_t>(last_current_file_timestamp_) + 1);
+    }
+    last_current_file_timestamp_ = timestamp;
+    std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> file;
+    std::unique_ptr<segments::SegmentHeader> segment;
+    const std::string full_path_name = CreateCurrentFile(timestamp, file, segment);
+    std::unique_lock<std::mutex> lock(finalizer_mutex_);
+    spare_file_ = std::move(file);
+    spare_segment_ = std::move(segment);
+    spare_file_name_ = full_path_name;
+    finalizer_condition_variable_.notify_all();
+  }
+
+  // Has the append strategy write out what it may have buffered, and closes the current file.
+  // With the segments, the size of the data is recorded before the strategy may `fsync()` the file.
+  void CloseCurrentFile() {
+    if (current_file_) {
+      if (current_segment_) {
+        T_FILE_APPEND_STRATEGY::FlushToFile(*current_file_.get());
+        RecordCurrentSegmentDataSize();
+      }
+      T_FILE_APPEND_STRATEGY::FlushBeforeClosingFile(*current_file_.get(), current_file_name_);
+      current_file_.reset(nullptr);
+      current_segment_.reset(nullptr);
+    }
+  }
+
+  // With the segments, records the size of the data written to the current file so far into its header.
+  // Skipped if the size has not changed since it was last recorded.
+  void RecordCurrentSegmentDataSize() {
+    if (current_segment_) {
+      const std::streamoff position = current_file_->tellp();
+      if (position >= static_cast<std::streamoff>(segments::kHeaderSize)) {
+        current_segment_->SetDataSize(static_cast<uint64_t>(position) - segments::kHeaderSize);
+      }
+    }
+  }
+
+  // Opens the file for writing in the mode given.
+  // TODO(dkorolev): This relies on OutputFile being std::ofstream. Fine for now anyway.
+  static std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> OpenOutputFile(const std::string& file_name,
+                                                                            std::ios_base::openmode mode) {
+    return std::unique_ptr<typename T_FILE_SYSTEM::OutputFile>(
+        new typename T_FILE_SYSTEM::OutputFile(file_name, mode));
+  }
+
+  // Journals and creates the current file for the timestamp. Returns its full name. With the segments,
+  // renames a recycled segment into it, or preallocates a new one, and opens its header, see `segments.h`.
+  std::string CreateCurrentFile(T_TIMESTAMP timestamp,
+                                std::unique_ptr<typename T_FILE_SYSTEM::OutputFile>& file,
+                                std::unique_ptr<segments::SegmentHeader>& segment) {
+    const std::string name = T_FILE_NAMING_STRATEGY::current.GenerateFileName(timestamp);
+    const std::string full_path_name = T_FILE_SYSTEM::JoinPath(working_directory_, name);
+    std::string recycled_segment_name;
+    if (!manifest_file_name_.empty() || T_CONFIG::SegmentSize()) {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      if (!manifest_file_name_.empty()) {
+        JournalCurrentFile(name, timestamp);
+      }
+      if (!recycled_segments_.empty()) {
+        recycled_segment_name = recycled_segments_.front();
+        recycled_segments_.pop_front();
+      }
+    }
+    if (!T_CONFIG::SegmentSize()) {
+      file = OpenOutputFile(full_path_name, std::ofstream::trunc | std::ofstream::binary);
+    } else {
+      if (recycled_segment_name.empty()) {
+        segments::CreateSegment(full_path_name, T_CONFIG::SegmentSize());
+        segment.reset(new segments::SegmentHeader(full_path_name));
+      } else {
+        // The stale data is discarded before the segment becomes the current file, should FSQ crash in between.
+        segment.reset(new segments::SegmentHeader(recycled_segment_name));
+        segment->SetDataSize(0);
+        segments::PreallocateSegment(recycled_segment_name, T_CONFIG::SegmentSize());
+        T_FILE_SYSTEM::RenameFile(recycled_segment_name, full_path_name);
+      }
+      file = OpenOutputFile(full_path_name, std::ofstream::in | std::ofstream::out | std::ofstream::binary);
+      file->seekp(segments::kHeaderSize);
+    }
+    return full_path_name;
+  }
+
+  // Declare the closed current file finalized, rename it under a permanent name
+  // and notify the worker thread that a new file is available.
+  void FinalizeCurrentFile(const std::string& compressed,
+                           std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
+    const FileInfo<T_TIMESTAMP> finalized_file_info = MoveToFinalized(
+        current_file_name_, status_.appended_file_timestamp, status_.appended_file_size, compressed);
+    status_.finalized.queue.push_back(finalized_file_info);
+    status_.finalized.total_size += finalized_file_info.size;
+    status_.appended_file_size = 0;
+    status_.appended_file_timestamp = T_TIMESTAMP(0);
+    current_file_name_.clear();
+    PurgeFilesAsNecessary(already_acquired_status_mutex_lock);
+    CompactManifestIfNecessary();
+    NotifyQueueStatusChanged();
+  }
+
+  // Truncates the segment to finalize to its data, see `segments.h`, and returns its compressed contents,
+  // if any, see `CompressFileIfWorthIt()`. Called before `status_mutex_` is taken.
+  static std::string PrepareFileToFinalize(const std::string& file_name) {
+    if (T_CONFIG::SegmentSize()) {
+      segments::TruncateSegmentToData(file_name);
+    }
+    return CompressFileIfWorthIt(file_name);
+  }
+
+  // With `CompressFinalizedFiles()` in the config, returns the compressed contents of the file to finalize,
+  // or an empty string if compressing it is not worth it. Called before `status_mutex_` is taken, so that
+  // neither the pushes nor the processing wait for the compression. The file that could not be mapped is read
+  // into memory, and kept as is if it could not be read either.
+  static std::string CompressFileIfWorthIt(const std::string& file_name) {
+    std::string compressed;
+    if (T_CONFIG::CompressFinalizedFiles()) {
+      const FileView view(file_name);
+      std::string contents;
+      if (!view.IsMapped() && !view.ReadContents(contents)) {
+        return compressed;
+      }
+      const char* data = view.IsMapped() ? view.Data() : contents.data();
+      const size_t size = view.IsMapped() ? view.Size() : contents.length();
+      compressed = compression::Compress(data, size);
+      if (compressed.length() >= size) {
+        // Not worth it, keep the file as is. Compressed files are told apart by their header anyway.
+        compressed.clear();
+      }
+    }
+    return compressed;
+  }
+
+  // Moves the file under the finalized name for its timestamp, or the next one after the newest finalized file,
+  // replacing it with its compressed contents, if any, see `CompressFileIfWorthIt()`, and journals it before
+  // it appears. Returns the finalized file. MUTEX-LOCKED.
+  FileInfo<T_TIMESTAMP> MoveToFinalized(const std::string& file_name,
+                                        T_TIMESTAMP timestamp,
+                                        uint64_t size,
+                                        const std::string& compressed,
+                                        MessagePriority priority = MessagePriority::Normal) {
+    const uint64_t begin_us = BeginEvent();
+    // The files rolled over within the same millisecond would otherwise get the same name.
+    // With the high priority lane, this also keeps the queue in the order of the timestamps across the lanes.
+    if (!status_.finalized.queue.empty() && !(status_.finalized.queue.back().timestamp < timestamp)) {
+      timestamp = static_cast<T_TIMESTAMP>(static_cast<uint64_t>(status_.finalized.queue.back().timestamp) + 1);
+    }
+    std::string finalized_file_name = T_FILE_NAMING_STRATEGY::finalized.GenerateFileName(timestamp);
+    if (priority == MessagePriority::High) {
+      finalized_file_name = HighPriorityFileName(finalized_file_name);
+    }
+    FileInfo<T_TIMESTAMP> finalized_file_info(
+        finalized_file_name, T_FILE_SYSTEM::JoinPath(working_directory_, finalized_file_name), timestamp, size);
+    if (!compressed.empty()) {
+      // Written under a temporary name first, so that a crash never leaves a partially written finalized file.
+      const std::string temporary_file_name = finalized_file_info.full_path_name + TemporaryFileSuffix();
+      T_FILE_SYSTEM::WriteStringToFile(temporary_file_name, compressed);
+      finalized_file_info.size = compressed.length();
+      JournalFinalizedFile(finalized_file_info);
+      T_FILE_SYSTEM::RenameFile(temporary_file_name, finalized_file_info.full_path_name);
+      RecycleOrRemoveFile(file_name);
+    } else {
+      JournalFinalizedFile(finalized_file_info);
+      T_FILE_SYSTEM::RenameFile(file_name, finalized_file_info.full_path_name);
+    }
+    if (T_CONFIG::CollectMetrics()) {
+      metrics::Counters::Increment(metrics_.files_finalized);
+    }
+    EndEvent(metrics::Event::Finalize,
+             begin_us,
+             &metrics_.finalize_latency,
+             finalized_file_info.name,
+             finalized_file_info.size);
+    return finalized_file_info;
+  }
+
+  // The manifest is the journal of the changes to the set of files FSQ keeps, one line per change:
+  // * "F {timestamp} {size} {name}": The current file is being finalized under this name.
+  // * "C {timestamp} {name}":        A new current file is being created.
+  // * "R {name}":                    The finalized file was removed from the queue.
+  // The lines for the new files are journaled before the files are renamed or created, and the lines for
+  // the removed ones after the files are removed. Thus, after a crash, the manifest may only list the files
+  // that are no longer there, which is checked for on startup and before processing each file.
+  // Once the journal grows long enough, it is rewritten from scratch, via a temporary file and a rename.
+
+  // Reads the manifest, and checks it cheaply: the oldest and the newest finalized files should be on disk,
+  // of the sizes the manifest says. Returns false, to have the directory scanned, if anything is off.
+  bool LoadManifest(std::vector<FileInfo<T_TIMESTAMP>>& finalized_files,
+                    std::vector<FileInfo<T_TIMESTAMP>>& current_files) {
+    if (!T_FILE_SYSTEM::GetFileSize(manifest_file_name_)) {
+      return false;
+    }
+    const std::string contents = T_FILE_SYSTEM::ReadFileAsString(manifest_file_name_);
+    // The files in the order they were journaled, and the indexes of the ones not removed since, by name.
+    std::vector<FileInfo<T_TIMESTAMP>> files;
+    std::unordered_map<std::string, size_t> index;
+    // The current files, in the order they were created. Finalized in the same order.
+    std::deque<FileInfo<T_TIMESTAMP>> current;
+    size_t number_of_lines = 0;
+    size_t begin = 0;
+    // The line without the trailing newline, if any, got torn by a crash. Ignore it.
+    for (size_t end = contents.find('\n'); end != std::string::npos; end = contents.find('\n', begin)) {
+      const char kind = end - begin > 2 && contents[begin + 1] == ' ' ? contents[begin] : '\0';
+      size_t field = begin + 2;
+      begin = end + 1;
+      ++number_of_lines;
+      // Splits off the next space-separated field of the line, the rest of the line for the name.
+      const auto next_field = [&contents, &field, end](bool last) {
+        const size_t space = last ? end : std::min(contents.find(' ', field), end);
+        const std::string result = contents.substr(field, space - field);
+        field = std::min(space + 1, end);
+        return result;
+      };
+      T_TIMESTAMP timestamp = T_TIMESTAMP(0);
+      uint64_t size = 0;
+      if (kind == 'F' || kind == 'C') {
+        bricks::strings::UnpackFromString(next_field(false), timestamp);
+      }
+      if (kind == 'F') {
+        const std::string size_as_string = next_field(false);
+        char* size_end = nullptr;
+        size = std::strtoull(size_as_string.c_str(), &size_end, 10);
+        if (size_as_string.empty() || *size_end) {
+          return false;
+        }
+      }
+      const std::string name = next_field(true);
+      if (!kind || name.empty() || name.find(' ') != std::string::npos) {
+        return false;
+      }
+      if (kind == 'F') {
+        index[name] = files.size();
+        files.emplace_back(name, T_FILE_SYSTEM::JoinPath(working_directory_, name), timestamp, size);
+        if (!current.empty() && !IsHighPriorityFileName(name)) {
+          current.pop_front();
+        }
+      } else if (kind == 'C') {
+        current.emplace_back(name, T_FILE_SYSTEM::JoinPath(working_directory_, name), timestamp, 0);
+      } else if (kind == 'R') {
+        index.erase(name);
+      } else {
+        return false;
+      }
+    }
+    finalized_files.clear();
+    finalized_files.reserve(index.size());
+    for (const auto& file : index) {
+      finalized_files.push_back(std::move(files[file.second]));
+    }
+    std::sort(finalized_files.begin(),
+              finalized_files.end(),
+              [](const FileInfo<T_TIMESTAMP>& lhs, const FileInfo<T_TIMESTAMP>& rhs) {
+      return lhs.timestamp != rhs.timestamp ? lhs.timestamp < rhs.timestamp : lhs.name < rhs.name;
+    });
+    if (!finalized_files.empty() &&
+        (FileDataSize(finalized_files.front().full_path_name) != finalized_files.front().size ||
+         FileDataSize(finalized_files.back().full_path_name) != finalized_files.back().size)) {
+      return false;
+    }
+    current_files.clear();
+    for (auto& file : current) {
+      // The current file may have never been created, if FSQ has crashed right after journaling it,
+      // or never appended to, if it was pre-opened for the background finalization and removed on shutdown.
+      // In the latter case, the next run may journal a file under the same name again.
+      // The segments with no data are kept, not to leak the space preallocated for them.
+      file.size = FileDataSize(file.full_path_name);
+      const bool exists =
+          file.size || (T_CONFIG::SegmentSize() && T_FILE_SYSTEM::GetFileSize(file.full_path_name));
+      if (exists && std::none_of(current_files.begin(),
+                                 current_files.end(),
+                                 [&file](const FileInfo<T_TIMESTAMP>& f) { return f.name == file.name; })) {
+        current_files.push_back(file);
+      }
+    }
+    manifest_number_of_lines_ = number_of_lines;
+    return true;
+  }
+
+  // MUTEX-LOCKED, for this and the functions below.
+  // The current files of high priority are not journaled, see `AppendHighPriorityMessage()`.
+  void JournalFinalizedFile(const FileInfo<T_TIMESTAMP>& file) {
+    if (!manifest_current_file_lines_.empty() && !IsHighPriorityFileName(file.name)) {
+      manifest_current_file_lines_.pop_front();
+    }
+    JournalLine(FinalizedFileManifestLine(file));
+  }
+
+  void JournalCurrentFile(const std::string& name, T_TIMESTAMP timestamp) {
+    manifest_current_file_lines_.push_back(CurrentFileManifestLine(name, timestamp));
+    JournalLine(manifest_current_file_lines_.back());
+  }
+
+  void JournalRemovedFile(const std::string& name) {
+    JournalLine("R " + name);
+  }
+
+  static std::string FinalizedFileManifestLine(const FileInfo<T_TIMESTAMP>& file) {
+    return "F " + bricks::strings::PackToString(file.timestamp) + ' ' + std::to_string(file.size) + ' ' +
+           file.name;
+  }
+
+  static std::string CurrentFileManifestLine(const std::string& name, T_TIMESTAMP timestamp) {
+    return "C " + bricks::strings::PackToString(timestamp) + ' ' + name;
+  }
+
+  void JournalLine(const std::string& line) {
+    if (!manifest_file_name_.empty()) {
+      if (!manifest_) {
+        manifest_ = OpenOutputFile(manifest_file_name_, std::ofstream::app | std::ofstream::binary);
+      }
+      *manifest_ << line << '\n' << std::flush;
+      ++manifest_number_of_lines_;
+    }
+  }
+
+  // Rewrites the manifest once most of its lines are about the files that are long gone.
+  void CompactManifestIfNecessary() {
+    if (!manifest_file_name_.empty() &&
+        manifest_number_of_lines_ > 2 * status_.finalized.queue.size() + kMinManifestLinesToCompact) {
+      RewriteManifest();
+    }
+  }
+
+  // Writes the manifest anew, listing the finalized files still on disk and the current files, if any.
+  void RewriteManifest() {
+    std::string contents;
+    for (const auto& file : status_.finalized.queue) {
+      contents += FinalizedFileManifestLine(file) + '\n';
+    }
+    // The files purged while being processed stay listed until they are removed, see `ProcessTakenFile()`.
+    for (const auto& file : purged_in_flight_files_) {
+      contents += FinalizedFileManifestLine(file.second) + '\n';
+    }
+    for (const auto& line : manifest_current_file_lines_) {
+      contents += line + '\n';
+    }
+    const size_t number_of_lines = status_.finalized.queue.size() + purged_in_flight_files_.size() +
+                                   manifest_current_file_lines_.size();
+    const std::string temporary_file_name = manifest_file_name_ + TemporaryFileSuffix();
+    T_FILE_SYSTEM::WriteStringToFile(temporary_file_name, contents);
+    manifest_.reset(nullptr);
+    T_FILE_SYSTEM::RenameFile(temporary_file_name, manifest_file_name_);
+    manifest_number_of_lines_ = number_of_lines;
+  }
+
+  // Scans the directory for the files that match certain predicate.
+  // Gets their sized and and extracts timestamps from their names along the way.
+  // The sizes are those of the data, which differ for the segments.
+  template <typename F>
+  std::vector<FileInfo<T_TIMESTAMP>> ScanDir(F f) const {
+    std::vector<FileInfo<T_TIMESTAMP>> matched_files_list;
+    const auto& dir = working_directory_;
+    T_FILE_SYSTEM::ScanDir(working_directory_,
+                           [this, &matched_files_list, &f, dir](const std::string& file_name) {
+      // if (T_FILE_NAMING_STRATEGY::template IsFinalizedFileName<T_TIMESTAMP>(file_name)) {
+      T_TIMESTAMP timestamp;
+      if (f(file_name, &timestamp)) {
+        matched_files_list.emplace_back(file_name,
+                                        T_FILE_SYSTEM::JoinPath(working_directory_, file_name),
+                                        timestamp,
+                                        FileDataSize(T_FILE_SYSTEM::JoinPath(dir, file_name)));
+      }
+    });
+    std::sort(matched_files_list.begin(), matched_files_list.end());
+    return matched_files_list;
+  }
+
+  // The size of the data in the file: as recorded in the header for the segments, the file size otherwise.
+  uint64_t FileDataSize(const std::string& full_path_name) const {
+    uint64_t data_size;
+    if (T_CONFIG::SegmentSize() && segments::ReadDataSize(full_path_name, data_size)) {
+      return data_size;
+    }
+    return T_FILE_SYSTEM::GetFileSize(full_path_name);
+  }
+
+  // EnsureCurrentFileIsOpen() expires the current file and/or creates the new one as necessary.
+  void EnsureCurrentFileIsOpen(const T_TIMESTAMP now) {
+    if (!current_file_) {
+      if (T_CONFIG::FinalizeFilesInBackground()) {
+        TakeSpareFile();
+      } else {
+        current_file_name_ = CreateCurrentFile(now, current_file_, current_segment_);
+      }
+      status_.appended_file_timestamp = now;
+    }
+  }
+
+  // Purges the old files as necessary.
+  // The files being processed are not removed from disk right away, but once their processing is complete.
+  void PurgeFilesAsNecessary(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
+    static_cast<void>(already_acquired_status_mutex_lock);
+    while (!status_.finalized.queue.empty() && T_PURGE_STRATEGY::ShouldPurge(status_)) {
+      PurgeOldestFinalizedFile();
+    }
+    RemoveProcessedFiles();
+  }
+
+  // Removes the oldest finalized file from the queue, and from disk unless it is being processed.
+  // The file being processed is removed, and its removal journaled, once processing it is over, so that
+  // the manifest keeps listing it as long as it is on disk, see `ProcessTakenFile()`.
+  // With the high priority lane, the oldest file of normal priority, unless there are none left. MUTEX-LOCKED.
+  void PurgeOldestFinalizedFile() {
+    const uint64_t begin_us = BeginEvent();
+    auto file = status_.finalized.queue.begin();
+    if (T_CONFIG::HighPriorityLane()) {
+      file = std::find_if(status_.finalized.queue.begin(),
+                          status_.finalized.queue.end(),
+                          [](const FileInfo<T_TIMESTAMP>& f) { return !IsHighPriorityFileName(f.name); });
+      if (file == status_.finalized.queue.end()) {
+        file = status_.finalized.queue.begin();
+      }
+    }
+    const std::string name = file->name;
+    const std::string filename = file->full_path_name;
+    const uint64_t size = file->size;
+    const bool in_flight = in_flight_files_.count(filename) > 0;
+    if (in_flight) {
+      purged_in_flight_files_.emplace(filename, *file);
+    }
+    status_.finalized.total_size -= file->size;
+    status_.finalized.queue.erase(file);
+    processed_files_.erase(filename);
+    if (!in_flight) {
+      RecycleOrRemoveFile(filename);
+      JournalRemovedFile(name);
+    }
+    if (T_CONFIG::CollectMetrics()) {
+      metrics::Counters::Increment(metrics_.files_purged);
+      metrics::Counters::Increment(metrics_.bytes_purged, size);
+    }
+    EndEvent(metrics::Event::Purge, begin_us, nullptr, name, size);
+  }
+
+  // Wakes up the threads waiting for the queue to change, and lets the owner of FSQ know, if it has asked to.
+  // MUTEX-LOCKED.
+  // Also keeps the backlog for `GetMetrics()`.
+  void NotifyQueueStatusChanged() {
+    const auto& queue = status_.finalized.queue;
+    metrics_.backlog_files.store(queue.size(), std::memory_order_relaxed);
+    metrics_.backlog_bytes.store(status_.finalized.total_size, std::memory_order_relaxed);
+    metrics_.oldest_finalized_file_timestamp.store(
+        queue.empty() ? 0 : static_cast<uint64_t>(queue.front().timestamp), std::memory_order_relaxed);
+    queue_status_condition_variable_.notify_all();
+    if (status_changed_callback_) {
+      status_changed_callback_();
+    }
+  }
+
+  // The worker thread first scans the directory for present finalized and current files.
+  // Present finalized files are queued up.
+  // If more than one present current files is available, all but one are finalized on the spot.
+  // The one remaining current file can be appended to or finalized depending on the strategy.
+  void WorkerThread() {
+    // Step 1/4: Get the list of finalized files.
+    typedef std::vector<FileInfo<T_TIMESTAMP>> FileInfoVector;
+    FileInfoVector finalized_files_on_disk;
+    FileInfoVector current_files_on_disk;
+    const bool manifest_loaded =
+        !manifest_file_name_.empty() && LoadManifest(finalized_files_on_disk, current_files_on_disk);
+    if (!manifest_loaded) {
+      finalized_files_on_disk = ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+        return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(s, t) ||
+               ParseHighPriorityFileName(T_FILE_NAMING_STRATEGY::finalized, s, t);
+      });
+    }
+    status_.finalized.queue.assign(finalized_files_on_disk.begin(), finalized_files_on_disk.end());
+    status_.finalized.total_size = 0;
+    for (const auto& file : finalized_files_on_disk) {
+      status_.finalized.total_size += file.size;
+    }
+    // The current files of high priority are finalized right away, see `AppendHighPriorityMessage()`.
+    if (T_CONFIG::HighPriorityLane()) {
+      for (auto& f : ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+             return ParseHighPriorityFileName(T_FILE_NAMING_STRATEGY::current, s, t);
+           })) {
+        f.size = high_priority_append_strategy_->TruncateTornTail(f.full_path_name, f.size);
+        const std::string compressed = PrepareFileToFinalize(f.full_path_name);
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const auto finalized_file_info =
+            MoveToFinalized(f.full_path_name, f.timestamp, f.size, compressed, MessagePriority::High);
+        status_.finalized.queue.push_back(finalized_file_info);
+        status_.finalized.total_size += finalized_file_info.size;
+        PurgeFilesAsNecessary(lock);
+      }
+    }
+
+    // Step 2/4: Get the list of current files, and the recycled segments, if any.
+    if (T_CONFIG::SegmentSize()) {
+      LoadRecycledSegments();
+    }
+    if (!manifest_loaded) {
+      current_files_on_disk = ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+        return T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t);
+      });
+    }
+    // Truncate the messages torn by a crash, if the append strategy can tell them, see `AppendFramedRecords`.
+    for (auto& f : current_files_on_disk) {
+      f.size = T_FILE_APPEND_STRATEGY::TruncateTornTail(f.full_path_name, f.size);
+    }
+    if (!manifest_file_name_.empty()) {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      manifest_current_file_lines_.clear();
+      for (const auto& f : current_files_on_disk) {
+        manifest_current_file_lines_.push_back(CurrentFileManifestLine(f.name, f.timestamp));
+      }
+    }
+    if (!current_files_on_disk.empty()) {
+      const bool resume = T_FILE_RESUME_STRATEGY::ShouldResume();
+      const size_t number_of_files_to_finalize = current_files_on_disk.size() - (resume ? 1u : 0u);
+      for (size_t i = 0; i < number_of_files_to_finalize; ++i) {
+        const FileInfo<T_TIMESTAMP>& f = current_files_on_disk[i];
+        const std::string compressed = PrepareFileToFinalize(f.full_path_name);
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const auto finalized_file_info = MoveToFinalized(f.full_path_name, f.timestamp, f.size, compressed);
+        status_.finalized.queue.push_back(finalized_file_info);
+        status_.finalized.total_size += finalized_file_info.size;
+      }
+      if (resume) {
+        const FileInfo<T_TIMESTAMP>& c = current_files_on_disk.back();
+        status_.appended_file_timestamp = c.timestamp;
+        status_.appended_file_size = c.size;
+        current_file_name_ = c.full_path_name;
+        uint64_t data_size;
+        if (T_CONFIG::SegmentSize() && segments::ReadDataSize(current_file_name_, data_size)) {
+          // The segment is appended to right past its data, over the stale bytes, see `segments.h`.
+          current_file_ = OpenOutputFile(current_file_name_,
+                                         std::ofstream::in | std::ofstream::out | std::ofstream::binary);
+          current_file_->seekp(segments::kHeaderSize + c.size);
+          current_segment_.reset(new segments::SegmentHeader(current_file_name_));
+        } else {
+          current_file_ = OpenOutputFile(current_file_name_, std::ofstream::app | std::ofstream::binary);
+        }
+        last_current_file_timestamp_ = c.timestamp;
+      }
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      PurgeFilesAsNecessary(lock);
+    }
+    if (!manifest_file_name_.empty() && !manifest_loaded) {
+      // Start the manifest over, from what the scan has found.
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      RewriteManifest();
+    }
+
+    // Step 3/4: Signal that FSQ's status has been successfully parsed from disk and FSQ is ready to go.
+    {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      status_ready_ = true;
+      NotifyQueueStatusChanged();
+    }
+
+    // Step 4/4: Start processing finalized files via T_PROCESSOR, respecting retry strategy.
+    // With `ProcessingConcurrency()` above one, the worker thread is joined by the threads of the pool.
+    // With zero, the worker thread is done, as the files are processed via `ProcessNextFile()`.
+    if (!T_CONFIG::ProcessingConcurrency()) {
+      return;
+    }
+    std::vector<std::thread> processing_pool;
+    for (size_t i = 1; i < T_CONFIG::ProcessingConcurrency(); ++i) {
+      processing_pool.emplace_back(&FSQ::ProcessFiles, this, false);
+    }
+    ProcessFiles(true);
+    for (auto& thread : processing_pool) {
+      thread.join();
+    }
+  }
+
+  // Picks up the recycled segments left by the previous run. The manifest does not list them, thus
+  // the directory is scanned for them regardless, which only costs a `stat()` per recycled segment.
+  void LoadRecycledSegments() {
+    std::vector<std::pair<uint64_t, std::string>> recycled_segments;
+    T_FILE_SYSTEM::ScanDir(working_directory_, [this, &recycled_segments](const std::string& file_name) {
+      uint64_t index;
+      if (recycled_segment_naming_.ParseFileName(file_name, &index)) {
+        recycled_segments.emplace_back(index, T_FILE_SYSTEM::JoinPath(working_directory_, file_name));
+      }
+    });
+    std::sort(recycled_segments.begin(), recycled_segments.end());
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    for (const auto& segment : recycled_segments) {
+      next_recycled_segment_index_ = segment.first + 1;
+      if (recycled_segments_.size() < T_CONFIG::MaxRecycledSegments() &&
+          segments::IsReusableSegment(segment.second, T_CONFIG::SegmentSize())) {
+        recycled_segments_.push_back(segment.second);
+      } else {
+        T_FILE_SYSTEM::RemoveFile(segment.second, bricks::RemoveFileParameters::Silent);
+      }
+    }
+  }
+
+  // Hands the finalized files to T_PROCESSOR, one at a time, until FSQ is shutting down.
+  // Run by the worker thread, and by the threads of the processing pool, if any.
+  // The worker thread also checks the finalize strategy on the timer, if enabled, in between the files.
+  void ProcessFiles(bool check_finalization_on_timer) {
+    const bool finalization_timer =
+        check_finalization_on_timer && T_CONFIG::FinalizationCheckIntervalMilliseconds();
+    uint64_t next_finalization_check_ms =
+        static_cast<uint64_t>(bricks::time::Now()) + T_CONFIG::FinalizationCheckIntervalMilliseconds();
+    while (true) {
+      if (finalization_timer && static_cast<uint64_t>(bricks::time::Now()) >= next_finalization_check_ms) {
+        FinalizeCurrentFileIfDue();
+        next_finalization_check_ms =
+            static_cast<uint64_t>(bricks::time::Now()) + T_CONFIG::FinalizationCheckIntervalMilliseconds();
+      }
+      // Wait for a newly arrived file or another event to happen.
+      std::unique_ptr<FileInfo<T_TIMESTAMP>> next_file;
+      uint64_t number_of_failures_before;
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const bricks::time::EPOCH_MILLISECONDS begin_ms = bricks::time::Now();
+        bricks::time::MILLISECONDS_INTERVAL wait_ms;
+        const bool should_wait = T_RETRY_STRATEGY_INSTANCE::ShouldWait(&wait_ms);
+        const auto predicate = [this, should_wait, begin_ms, wait_ms]() {
+          if (force_worker_thread_shutdown_) {
+            return true;
+          } else if (force_processing_) {
+            return true;
+          } else if (processing_suspended_) {
+            return false;
+          } else if (should_wait && bricks::time::Now() - begin_ms < wait_ms) {
+            return false;
+          } else if (NextFileToProcess()) {
+            return true;
+          } else {
+            return false;
+          }
+        };
+        const uint64_t now_ms = static_cast<uint64_t>(bricks::time::Now());
+        const uint64_t ms_until_finalization_check =
+            next_finalization_check_ms > now_ms ? next_finalization_check_ms - now_ms : 0;
+        if (!predicate()) {
+          if (finalization_timer &&
+              (!should_wait || ms_until_finalization_check <= static_cast<uint64_t>(wait_ms))) {
+            // Wake up for the check of the finalize strategy, at the top of the loop, unless there is a file
+            // to process by then. The retry delay, if any, is what is left of it on the next iteration.
+            if (!queue_status_condition_variable_.wait_for(
+                    lock, std::chrono::milliseconds(ms_until_finalization_check), predicate)) {
+              continue;
+            }
+          } else if (should_wait) {
+            // Add one millisecond to avoid multiple runs of this loop when `wait_ms` is close to zero.
+            queue_status_condition_variable_.wait_for(
+                lock, std::chrono::milliseconds(static_cast<uint64_t>(wait_ms) + 1), predicate);
+          } else {
+            queue_status_condition_variable_.wait(lock, predicate);
+          }
+        }
+        const FileInfo<T_TIMESTAMP>* file = NextFileToProcess();
+        if (force_worker_thread_shutdown_) {
+          // By default, terminate immediately.
+          // However, allow the user to override this setting and have the queue
+          // processed in full before returning from FSQ's destructor.
+          if (!T_CONFIG::ProcessQueueToTheEndOnShutdown() || !file) {
+            return;
+          }
+        }
+        if (file) {
+          next_file = TakeFileForProcessing(*file, number_of_failures_before);
+        } else {
+          // Forced processing only applies to the files that are there, do not wait for the next one actively.
+          force_processing_ = false;
+        }
+      }
+
+      if (next_file) {
+        ProcessTakenFile(*next_file, number_of_failures_before);
+      }
+    }
+  }
+
+  // Marks the file as being processed, and returns a copy of it, along with the number of failures so far.
+  // MUTEX-LOCKED.
+  std::unique_ptr<FileInfo<T_TIMESTAMP>> TakeFileForProcessing(const FileInfo<T_TIMESTAMP>& file,
+                                                              uint64_t& number_of_failures_before) {
+    std::unique_ptr<FileInfo<T_TIMESTAMP>> result(new FileInfo<T_TIMESTAMP>(file));
+    number_of_failures_before = number_of_failures_;
+    in_flight_files_.insert(result->full_path_name);
+    return result;
+  }
+
+  // Passes the file taken for processing to T_PROCESSOR, and updates the queue and the retry strategy
+  // with the result.
+  void ProcessTakenFile(const FileInfo<T_TIMESTAMP>& file, uint64_t number_of_failures_before) {
+    // With the manifest, the file may be long gone, if FSQ has crashed right after removing it.
+    // Whatever may be left under its name is not the file the manifest lists, and is removed along with it.
+    if (!manifest_file_name_.empty() && FileDataSize(file.full_path_name) != file.size) {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      in_flight_files_.erase(file.full_path_name);
+      T_FILE_SYSTEM::RemoveFile(file.full_path_name, bricks::RemoveFileParameters::Silent);
+      if (purged_in_flight_files_.erase(file.full_path_name)) {
+        JournalRemovedFile(file.name);
+      } else {
+        RemoveFromQueue(file.full_path_name, false);
+      }
+      return;
+    }
+
+    const uint64_t begin_us = BeginEvent();
+    const FileProcessingResult result = PassFileToProcessor(file);
+    RecordProcessingResult(result);
+    EndEvent(metrics::Event::Process, begin_us, &metrics_.processing_latency, file.name, file.size);
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    // Important to clear force_processing_, in a locked way.
+    force_processing_ = false;
+    const std::string& file_name = file.full_path_name;
+    in_flight_files_.erase(file_name);
+    // The file may have been purged while being processed, in which case this thread is to remove it,
+    // and to journal its removal.
+    const bool purged = purged_in_flight_files_.erase(file_name) > 0;
+    if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
+      const bool remove_file = (result == FileProcessingResult::Success);
+      if (purged) {
+        if (remove_file) {
+          RecycleOrRemoveFile(file_name);
+        }
+        JournalRemovedFile(file.name);
+      } else if (T_CONFIG::RemoveProcessedFilesInOrder() || !cursors_.empty()) {
+        processed_files_[file_name] = remove_file;
+        RemoveProcessedFiles();
+      } else {
+        RemoveFromQueue(file_name, remove_file);
+      }
+      // A success only overrides the failures that have happened before this file was taken for processing.
+      if (number_of_failures_ == number_of_failures_before) {
+        processing_suspended_ = false;
+        T_RETRY_STRATEGY_INSTANCE::OnSuccess();
+      }
+    } else {
+      if (purged) {
+        RecycleOrRemoveFile(file_name);
+        JournalRemovedFile(file.name);
+      }
+      ++number_of_failures_;
+      if (result == FileProcessingResult::Unavailable) {
+        processing_suspended_ = true;
+      } else if (result == FileProcessingResult::FailureNeedRetry) {
+        T_RETRY_STRATEGY_INSTANCE::OnFailure();
+      } else {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+      }
+    }
+    CompactManifestIfNecessary();
+    // The file is available again, or there is room for one more in flight.
+    NotifyQueueStatusChanged();
+  }
+
+  void RecordProcessingResult(FileProcessingResult result) {
+    if (T_CONFIG::CollectMetrics()) {
+      if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
+        metrics::Counters::Increment(metrics_.files_processed);
+      } else if (result == FileProcessingResult::FailureNeedRetry) {
+        metrics::Counters::Increment(metrics_.processing_retries);
+      } else if (result == FileProcessingResult::Unavailable) {
+        metrics::Counters::Increment(metrics_.processing_unavailable);
+      }
+    }
+  }
+
+  // Passes the file to the processor, along with its view if the processor accepts one, see `file_view.h`.
+  FileProcessingResult PassFileToProcessor(const FileInfo<T_TIMESTAMP>& file) {
+    return PassFileToProcessor(
+        file, std::integral_constant<bool, ProcessorAcceptsFileView<T_PROCESSOR, T_TIMESTAMP>::value>());
+  }
+
+  FileProcessingResult PassFileToProcessor(const FileInfo<T_TIMESTAMP>& file, std::true_type) {
+    const FileView view(file.full_path_name, T_CONFIG::DecompressFilesForProcessor());
+    return processor_.OnFileReady(file, view, time_manager_.Now());
+  }
+
+  FileProcessingResult PassFileToProcessor(const FileInfo<T_TIMESTAMP>& file, std::false_type) {
+    return processor_.OnFileReady(file, time_manager_.Now());
+  }
+
+  // The oldest finalized file which is neither being processed nor already processed, or null if there is none.
+  // MUTEX-LOCKED.
+  // With the high priority lane, the oldest such file of high priority, if any, goes first.
+  const FileInfo<T_TIMESTAMP>* NextFileToProcess() const {
+    const FileInfo<T_TIMESTAMP>* result = nullptr;
+    for (const auto& file : status_.finalized.queue) {
+      if (!in_flight_files_.count(file.full_path_name) && !processed_files_.count(file.full_path_name)) {
+        if (!T_CONFIG::HighPriorityLane() || IsHighPriorityFileName(file.name)) {
+          return &file;
+        } else if (!result) {
+          result = &file;
+        }
+      }
+    }
+    return result;
+  }
+
+  // Removes the processed files all the cursors, if any, have passed. With `RemoveProcessedFilesInOrder()`,
+  // only from the front of the queue, see below. MUTEX-LOCKED.
+  void RemoveProcessedFiles() {
+    if (T_CONFIG::RemoveProcessedFilesInOrder()) {
+      RemoveProcessedFilesFromTheFront();
+    } else {
+      const auto& queue = status_.finalized.queue;
+      size_t i = 0;
+      while (!processed_files_.empty() && i < queue.size() && PassedByAllCursors(queue[i])) {
+        const auto processed = processed_files_.find(queue[i].full_path_name);
+        if (processed == processed_files_.end()) {
+          ++i;
+        } else {
+          const bool remove_file = processed->second;
+          processed_files_.erase(processed);
+          RemoveFromQueue(queue[i].full_path_name, remove_file);
+        }
+      }
+    }
+  }
+
+  // With `RemoveProcessedFilesInOrder()`, removes the processed files from the front of the queue,
+  // up to the first file that is yet to be processed, or yet to be passed by all the cursors. With the high
+  // priority lane, the order is kept within each lane: the processed files of high priority do not wait
+  // for the files of normal priority before them, and vice versa. MUTEX-LOCKED.
+  void RemoveProcessedFilesFromTheFront() {
+    // Whether a file of normal priority, and of high priority, yet to be processed, has been seen.
+    bool lane_blocked[2] = {false, !T_CONFIG::HighPriorityLane()};
+    size_t i = 0;
+    while (i < status_.finalized.queue.size() && !(lane_blocked[0] && lane_blocked[1])) {
+      const FileInfo<T_TIMESTAMP>& file = status_.finalized.queue[i];
+      bool& blocked = lane_blocked[IsHighPriorityFileName(file.name) ? 1 : 0];
+      const auto processed = blocked ? processed_files_.end() : processed_files_.find(file.full_path_name);
+      if (processed == processed_files_.end() || !PassedByAllCursors(file)) {
+        blocked = true;
+        ++i;
+      } else {
+        const bool remove_file = processed->second;
+        processed_files_.erase(processed);
+        RemoveFromQueue(file.full_path_name, remove_file);
+      }
+    }
+  }
+
+  // The cursors are persisted as "cursor-{name}" files, each holding the timestamp of the newest file passed,
+  // written via a temporary file and a rename. A cursor with no file has not passed any files yet.
+  static const std::string& CursorFilePrefix() {
+    static const std::string prefix = "cursor-";
+    return prefix;
+  }
+
+  std::string CursorFileName(const std::string& cursor_name) const {
+    return T_FILE_SYSTEM::JoinPath(working_directory_, CursorFilePrefix() + cursor_name);
+  }
+
+  static bool ParseCursorFileName(const std::string& file_name, T_TIMESTAMP* timestamp) {
+    if (file_name.compare(0, CursorFilePrefix().length(), CursorFilePrefix())) {
+      return false;
+    }
+    *timestamp = T_TIMESTAMP(0);
+    return true;
+  }
+
+  // The compressed finalized files, the rewritten manifest and the cursors are written under a temporary name,
+  // the suffix appended, and renamed once complete. A crash in between leaves the temporary file behind.
+  static const std::string& TemporaryFileSuffix() {
+    static const std::string suffix = ".tmp";
+    return suffix;
+  }
+
+  bool ParseTemporaryFileName(const std::string& file_name, T_TIMESTAMP* timestamp) const {
+    const std::string& suffix = TemporaryFileSuffix();
+    if (file_name.length() <= suffix.length() ||
+        file_name.compare(file_name.length() - suffix.length(), suffix.length(), suffix)) {
+      return false;
+    }
+    const std::string name = file_name.substr(0, file_name.length() - suffix.length());
+    *timestamp = T_TIMESTAMP(0);
+    return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(name, timestamp) ||
+           ParseHighPriorityFileName(T_FILE_NAMING_STRATEGY::finalized, name, timestamp) ||
+           ParseCursorFileName(name, timestamp) ||
+           (!T_CONFIG::ManifestFileName().empty() && name == T_CONFIG::ManifestFileName());
+  }
+
+  // Called from the constructor, before any of the threads that write the temporary files start.
+  void RemoveTemporaryFiles() {
+    for (const auto& file : ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+           return ParseTemporaryFileName(s, t);
+         })) {
+      T_FILE_SYSTEM::RemoveFile(file.full_path_name);
+    }
+  }
+
+  // Called from the constructor, before the worker thread starts.
+  void LoadCursors() {
+    for (const std::string& cursor_name : T_CONFIG::ConsumerCursors()) {
+      if (cursor_name.empty()) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();  // Empty cursor name provided.
+      }
+      Cursor& cursor = cursors_[cursor_name];
+      const std::string file_name = CursorFileName(cursor_name);
+      if (T_FILE_SYSTEM::GetFileSize(file_name)) {
+        bricks::strings::UnpackFromString(T_FILE_SYSTEM::ReadFileAsString(file_name), cursor.timestamp);
+        cursor.passed_any_file = true;
+      }
+    }
+  }
+
+  // MUTEX-LOCKED.
+  void SaveCursor(const std::string& cursor_name, T_TIMESTAMP timestamp) const {
+    const std::string file_name = CursorFileName(cursor_name);
+    const std::string temporary_file_name = file_name + TemporaryFileSuffix();
+    T_FILE_SYSTEM::WriteStringToFile(temporary_file_name, bricks::strings::PackToString(timestamp));
+    T_FILE_SYSTEM::RenameFile(temporary_file_name, file_name);
+  }
+
+  // MUTEX-LOCKED.
+  bool PassedByAllCursors(const FileInfo<T_TIMESTAMP>& file) const {
+    for (const auto& cursor : cursors_) {
+      if (!cursor.second.HasPassed(file)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Removes the processed file from the queue, and from disk if `remove_file` is set. MUTEX-LOCKED.
+  // Takes the name by value, as it may be the name of the very entry being removed.
+  void RemoveFromQueue(const std::string full_path_name, bool remove_file) {
+    for (auto it = status_.finalized.queue.begin(); it != status_.finalized.queue.end(); ++it) {
+      if (it->full_path_name == full_path_name) {
+        const std::string name = it->name;
+        status_.finalized.total_size -= it->size;
+        status_.finalized.queue.erase(it);
+        if (remove_file) {
+          RecycleOrRemoveFile(full_path_name);
+        }
+        JournalRemovedFile(name);
+        return;
+      }
+    }
+    // Only the threads processing files remove files from the queue other than by purging them.
+    T_ERROR_HANDLING_STRATEGY::HandleError();
+  }
+
+  // Removes the file from disk. With the segments, renames it into the pool of recycled segments instead,
+  // unless the pool is full, or the file is not a segment, or has grown past the size of the segment.
+  // MUTEX-LOCKED.
+  void RecycleOrRemoveFile(const std::string& full_path_name) {
+    if (T_CONFIG::SegmentSize() && recycled_segments_.size() < T_CONFIG::MaxRecycledSegments() &&
+        segments::IsReusableSegment(full_path_name, T_CONFIG::SegmentSize())) {
+      const std::string recycled_segment_name = T_FILE_SYSTEM::JoinPath(
+          working_directory_, recycled_segment_naming_.GenerateFileName(next_recycled_segment_index_++));
+      T_FILE_SYSTEM::RenameFile(full_path_name, recycled_segment_name);
+      recycled_segments_.push_back(recycled_segment_name);
+    } else {
+      T_FILE_SYSTEM::RemoveFile(full_path_name);
+    }
   }
 
   Status status_;
-  // Appending messages is single-threaded and thus lock-free.
+  // Appending messages is single-threaded and thus lock-free, serialized by the group commit,
+  // or done by the writer thread.
   // The status of the processing queue, on the other hand, should be guarded.
   mutable std::mutex status_mutex_;
   // Set to true and pings the variable once the initial directory scan is completed.
   bool status_ready_ = false;
   mutable std::condition_variable queue_status_condition_variable_;
+  // See `SetStatusChangedCallback()`.
+  std::function<void()> status_changed_callback_;
+
+  // See `GetMetrics()` and `SetTraceHook()`.
+  metrics::Counters metrics_;
+  std::shared_ptr<const metrics::TraceHook> trace_hook_;
+  std::atomic_bool has_trace_hook_{false};
 
   T_PROCESSOR& processor_;
   std::string working_directory_;
+  const std::string manifest_file_name_;
   const T_TIME_MANAGER& time_manager_;
   const T_FILE_SYSTEM& file_system_;
 
   std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> current_file_;
   std::string current_file_name_;
+  // Guards the current file with the timer-driven finalization or the group commit, see `LockCurrentFile()`.
+  std::mutex current_file_mutex_;
+  bool finalization_timer_stopped_ = false;
+  // With the segments, the header of the current file, see `RecordCurrentSegmentDataSize()`.
+  std::unique_ptr<segments::SegmentHeader> current_segment_;
+
+  // The high priority lane, see `AppendHighPriorityMessage()`. Its status has no finalized files.
+  std::mutex high_priority_mutex_;
+  std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> high_priority_file_;
+  std::string high_priority_file_name_;
+  Status high_priority_status_;
+  std::unique_ptr<T_FILE_APPEND_STRATEGY> high_priority_append_strategy_;
+  std::unique_ptr<T_FINALIZE_STRATEGY> high_priority_finalize_strategy_;
+
+  // Group commit, see `GroupCommitMessage()`. The group being written is only touched by the leader.
+  std::mutex group_commit_mutex_;
+  std::condition_variable group_commit_condition_variable_;
+  std::vector<T_MESSAGE> group_commit_staged_;
+  std::vector<T_MESSAGE> group_commit_group_;
+  uint64_t group_commit_number_of_staged_messages_ = 0;
+  uint64_t group_commit_number_of_written_messages_ = 0;
+  bool group_commit_write_in_progress_ = false;
+  // The errors of the failed groups not yet rethrown to all of their pushers, see `RethrowGroupCommitError()`.
+  struct GroupCommitError {
+    uint64_t first_ticket;
+    uint64_t last_ticket;
+    uint64_t number_of_pushers_to_rethrow_to;
+    std::exception_ptr error;
+  };
+  std::vector<GroupCommitError> group_commit_errors_;
+
+  // The writer thread, see `WriterThread()`. Commands wait on the same condition variable as blocked pushers.
+  std::mutex writer_mutex_;
+  std::condition_variable writer_condition_variable_;
+  std::condition_variable pushers_condition_variable_;
+  std::vector<StagedEntry> writer_staged_;
+  uint64_t writer_number_of_staged_entries_ = 0;
+  uint64_t writer_number_of_done_entries_ = 0;
+  bool writer_shutdown_ = false;
+  std::exception_ptr writer_error_;
+  std::thread writer_thread_;
+
+  // The background finalization, see `FinalizerThread()`. The files handed over for finalization,
+  // and the file pre-opened to switch to. The timestamp of the newest current file is only touched
+  // by the worker thread on startup, and by the finalizer thread afterwards.
+  struct FileToFinalize {
+    std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> file;
+    std::string file_name;
+    T_TIMESTAMP timestamp;
+    uint64_t size;
+  };
+  std::mutex finalizer_mutex_;
+  std::condition_variable finalizer_condition_variable_;
+  std::vector<FileToFinalize> files_to_finalize_;
+  uint64_t finalizer_number_of_handed_over_files_ = 0;
+  uint64_t finalizer_number_of_finalized_files_ = 0;
+  std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> spare_file_;
+  std::unique_ptr<segments::SegmentHeader> spare_segment_;
+  std::string spare_file_name_;
+  T_TIMESTAMP last_current_file_timestamp_ = T_TIMESTAMP(0);
+  bool finalizer_shutdown_ = false;
+  std::thread finalizer_thread_;
 
   std::thread worker_thread_;
+  // The files handed over to T_PROCESSOR and not yet returned, and those of them purged in the meantime.
+  std::set<std::string> in_flight_files_;
+  std::map<std::string, FileInfo<T_TIMESTAMP>> purged_in_flight_files_;
+  // With `RemoveProcessedFilesInOrder()`, or with the cursors, the processed files still waiting for the files
+  // before them, or for the cursors to pass them, along with whether to remove them from disk.
+  std::map<std::string, bool> processed_files_;
+  // The cursors, see `ConsumerCursors()` in the config, by name. The files are passed in the order
+  // of the queue, thus the cursor has passed the files up to, and including, the timestamp of the newest one.
+  struct Cursor {
+    bool passed_any_file = false;
+    T_TIMESTAMP timestamp = T_TIMESTAMP(0);
+    bool HasPassed(const FileInfo<T_TIMESTAMP>& file) const {
+      return passed_any_file && !(timestamp < file.timestamp);
+    }
+  };
+  std::map<std::string, Cursor> cursors_;
+  // The manifest, if enabled, kept open for appending, and the number of lines in it.
+  std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> manifest_;
+  size_t manifest_number_of_lines_ = 0;
+  // The lines of the current files: the one being appended to, those handed over for the background
+  // finalization, and the pre-opened one. Finalized, and thus removed from the front, in the order created.
+  std::deque<std::string> manifest_current_file_lines_;
+  enum : size_t { kMinManifestLinesToCompact = 1000 };
+  // With the segments, the processed ones kept for reuse, oldest first, and the index to name the next one by.
+  const strategy::DummyFileNamingToUnblockAlexFromMinsk::FileNamingSchema recycled_segment_naming_ =
+      strategy::DummyFileNamingToUnblockAlexFromMinsk::FileNamingSchema("recycled-", ".bin");
+  std::deque<std::string> recycled_segments_;
+  uint64_t next_recycled_segment_index_ = 0;
+  // The number of times processing has failed, so that the successes of the files taken for processing
+  // before the failure do not reset it.
+  uint64_t number_of_failures_ = 0;
   bool processing_suspended_ = false;
   bool force_processing_ = false;
   bool force_worker_thread_shutdown_ = false;
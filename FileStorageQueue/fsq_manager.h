@@ -0,0 +1,347 @@
+// Class FSQManager hosts many named queues of the same config, each an FSQ working in its own subdirectory
+// of the working directory of the manager, with its own processor and its own priority.
+//
+// The queues share a small pool of threads that process their files, instead of a thread or more per queue,
+// see `ProcessingConcurrency()` in `config.h`. Each queue has at most one file processed at a time, thus
+// the processors need not be thread safe, and the files of each queue are still processed in the FIFO order.
+// The queues of higher priority go first, and, of the same priority, the queue with the oldest file does.
+//
+// The queues share the quota on the total size of their files as well. Once it is exceeded, the oldest files
+// of the queues of the lowest priority are purged first. The quota is enforced by the threads of the pool,
+// as the files are finalized and in between the files they process, thus a pool busy with slow processors
+// may let the queues run over the quota for a while. The purge strategy of each queue still applies to it.
+//
+// With `FinalizationCheckIntervalMilliseconds()` in the config, the threads of the pool run the timer,
+// as the queues have no worker threads to run it.
+//
+// `GetStatus()` returns the totals of the queues, cheaply, see `QueueSummary` in `status.h`.
+// The status of each queue, with its files, is available via `GetQueueStatus()` of the queue itself.
+
+#ifndef FSQ_MANAGER_H
+#define FSQ_MANAGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fsq.h"
+
+namespace fsq {
+
+// The status of the queue hosted by `FSQManager`.
+template <typename TIMESTAMP>
+struct ManagedQueueStatus {
+  typedef TIMESTAMP T_TIMESTAMP;
+  std::string name;
+  int priority = 0;
+  QueueSummary<T_TIMESTAMP> summary;
+};
+
+// The status of all the queues hosted by `FSQManager` combined.
+template <typename TIMESTAMP>
+struct ManagerStatus {
+  typedef TIMESTAMP T_TIMESTAMP;
+  uint64_t total_size = 0;
+  size_t number_of_finalized_files = 0;
+  uint64_t quota = 0;
+  std::vector<ManagedQueueStatus<T_TIMESTAMP>> queues;  // Sorted by name.
+};
+
+template <class CONFIG>
+class FSQManager final {
+ public:
+  // The config of the hosted queues: the files are processed by the threads of the manager.
+  struct T_QUEUE_CONFIG : CONFIG {
+    inline static size_t ProcessingConcurrency() {
+      return 0;
+    }
+  };
+  typedef FSQ<T_QUEUE_CONFIG> T_FSQ;
+
+  typedef typename T_FSQ::T_PROCESSOR T_PROCESSOR;
+  typedef typename T_FSQ::T_ERROR_HANDLING_STRATEGY T_ERROR_HANDLING_STRATEGY;
+  typedef typename T_FSQ::T_FILE_SYSTEM T_FILE_SYSTEM;
+  typedef typename T_FSQ::T_TIME_MANAGER T_TIME_MANAGER;
+  typedef typename T_FSQ::T_TIMESTAMP T_TIMESTAMP;
+
+  typedef ManagerStatus<T_TIMESTAMP> Status;
+
+  // The constructor starts the threads of the pool. The queues are added via `AddQueue()`.
+  FSQManager(const std::string& working_directory,
+             uint64_t quota,
+             size_t number_of_processing_threads,
+             const T_TIME_MANAGER& time_manager,
+             const T_FILE_SYSTEM& file_system)
+      : working_directory_(working_directory),
+        quota_(quota),
+        time_manager_(time_manager),
+        file_system_(file_system),
+        next_finalization_check_ms_(static_cast<uint64_t>(bricks::time::Now()) +
+                                    T_CONFIG::FinalizationCheckIntervalMilliseconds()) {
+    for (size_t i = 0; i < std::max(number_of_processing_threads, static_cast<size_t>(1)); ++i) {
+      processing_threads_.emplace_back(&FSQManager::ProcessingThread, this);
+    }
+  }
+  FSQManager(const std::string& working_directory, uint64_t quota, size_t number_of_processing_threads = 2)
+      : FSQManager(working_directory,
+                   quota,
+                   number_of_processing_threads,
+                   default_time_manager_,
+                   default_file_system_) {
+  }
+
+  // Destructor terminates the threads of the pool, and then the queues.
+  ~FSQManager() {
+    {
+      std::unique_lock<std::mutex> lock(pool_mutex_);
+      pool_shutdown_ = true;
+      pool_condition_variable_.notify_all();
+    }
+    for (auto& thread : processing_threads_) {
+      thread.join();
+    }
+  }
+
+  // Adds the queue, working in the subdirectory `name` of the working directory, created if not there.
+  // The queues of higher priority are processed first, and purged last.
+  // Returns the queue to push messages into. It lives as long as the manager.
+  // Adding the queue under the name already taken is an error, which returns the existing queue.
+  T_FSQ& AddQueue(const std::string& name, T_PROCESSOR& processor, int priority = 0) {
+    T_FSQ* fsq;
+    {
+      // The queue is created under the lock, so that two queues never work in the same directory.
+      std::unique_lock<std::mutex> lock(queues_mutex_);
+      const auto existing = queues_.find(name);
+      if (existing != queues_.end()) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+        return existing->second->fsq;
+      }
+      const std::string directory = T_FILE_SYSTEM::JoinPath(working_directory_, name);
+      T_FILE_SYSTEM::CreateDirectory(directory);
+      std::unique_ptr<Queue> queue(
+          new Queue(name, priority, processor, directory, time_manager_, file_system_));
+      fsq = &queue->fsq;
+      fsq->SetStatusChangedCallback([this]() { OnQueueStatusChanged(); });
+      queues_.emplace(name, std::move(queue));
+    }
+    OnQueueStatusChanged();
+    return *fsq;
+  }
+
+  // The queue by its name, or null if there is no such queue.
+  T_FSQ* FindQueue(const std::string& name) {
+    std::unique_lock<std::mutex> lock(queues_mutex_);
+    const auto queue = queues_.find(name);
+    return queue != queues_.end() ? &queue->second->fsq : nullptr;
+  }
+
+  Status GetStatus() const {
+    Status status;
+    status.quota = quota_;
+    for (const Queue* queue : Queues()) {
+      ManagedQueueStatus<T_TIMESTAMP> queue_status;
+      queue_status.name = queue->name;
+      queue_status.priority = queue->priority;
+      queue_status.summary = queue->fsq.GetQueueSummary();
+      status.total_size += queue_status.summary.total_size;
+      status.number_of_finalized_files += queue_status.summary.number_of_finalized_files;
+      status.queues.push_back(queue_status);
+    }
+    return status;
+  }
+
+ private:
+  typedef CONFIG T_CONFIG;
+
+  struct Queue {
+    Queue(const std::string& name,
+          int priority,
+          T_PROCESSOR& processor,
+          const std::string& working_directory,
+          const T_TIME_MANAGER& time_manager,
+          const T_FILE_SYSTEM& file_system)
+        : name(name), priority(priority), fsq(processor, working_directory, time_manager, file_system) {
+    }
+    const std::string name;
+    const int priority;
+    T_FSQ fsq;
+    // Set while a thread of the pool processes a file of the queue, to keep it to one file at a time.
+    std::atomic_bool busy{false};
+  };
+
+  // The queues, in the order of their names. Never removed until the manager is destroyed,
+  // thus the pointers remain valid once the mutex is released.
+  std::vector<Queue*> Queues() const {
+    std::unique_lock<std::mutex> lock(queues_mutex_);
+    std::vector<Queue*> result;
+    result.reserve(queues_.size());
+    for (const auto& queue : queues_) {
+      result.push_back(queue.second.get());
+    }
+    return result;
+  }
+
+  // Invoked by the queues with their status mutexes held, thus only signals the threads of the pool.
+  void OnQueueStatusChanged() {
+    std::unique_lock<std::mutex> lock(pool_mutex_);
+    queues_changed_ = true;
+    pool_condition_variable_.notify_all();
+  }
+
+  // Checks the timer, enforces the quota, and processes one file at a time, until the manager is destroyed.
+  // Waits for the queues to change once there is nothing to process, or for the retry delay, or for the timer.
+  void ProcessingThread() {
+    const uint64_t finalization_check_interval_ms = T_CONFIG::FinalizationCheckIntervalMilliseconds();
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(pool_mutex_);
+        if (pool_shutdown_) {
+          return;
+        }
+        queues_changed_ = false;
+      }
+      if (finalization_check_interval_ms) {
+        const uint64_t now_ms = static_cast<uint64_t>(bricks::time::Now());
+        uint64_t due_ms = next_finalization_check_ms_;
+        // Only one of the threads checks the queues for each tick of the timer.
+        if (now_ms >= due_ms && next_finalization_check_ms_.compare_exchange_strong(
+                                    due_ms, now_ms + finalization_check_interval_ms)) {
+          for (Queue* queue : Queues()) {
+            queue->fsq.FinalizeCurrentFileIfDue();
+          }
+        }
+      }
+      EnforceQuota();
+      uint64_t retry_wait_ms = 0;
+      if (ProcessNextFile(retry_wait_ms)) {
+        continue;
+      }
+      uint64_t wait_ms = retry_wait_ms;
+      if (finalization_check_interval_ms) {
+        const uint64_t now_ms = static_cast<uint64_t>(bricks::time::Now());
+        const uint64_t due_ms = next_finalization_check_ms_;
+        const uint64_t ms_until_finalization_check = due_ms > now_ms ? due_ms - now_ms : 0;
+        if (!wait_ms || ms_until_finalization_check < wait_ms) {
+          // Add one millisecond to have the timer due by then.
+          wait_ms = ms_until_finalization_check + 1;
+        }
+      }
+      std::unique_lock<std::mutex> lock(pool_mutex_);
+      const auto predicate = [this]() { return queues_changed_ || pool_shutdown_; };
+      if (wait_ms) {
+        pool_condition_variable_.wait_for(lock, std::chrono::milliseconds(wait_ms), predicate);
+      } else {
+        pool_condition_variable_.wait(lock, predicate);
+      }
+    }
+  }
+
+  // Processes the next file of the queue of the highest priority that has one ready and is not busy.
+  // Returns false if there is none, with the shortest retry delay of the queues waiting for one, if any.
+  bool ProcessNextFile(uint64_t& retry_wait_ms) {
+    std::vector<std::pair<Queue*, QueueSummary<T_TIMESTAMP>>> candidates;
+    for (Queue* queue : Queues()) {
+      const QueueSummary<T_TIMESTAMP> summary = queue->fsq.GetQueueSummary();
+      if (summary.number_of_finalized_files) {
+        candidates.emplace_back(queue, summary);
+      }
+    }
+    std::sort(candidates.begin(),
+              candidates.end(),
+              [](const std::pair<Queue*, QueueSummary<T_TIMESTAMP>>& lhs,
+                 const std::pair<Queue*, QueueSummary<T_TIMESTAMP>>& rhs) {
+      return lhs.first->priority != rhs.first->priority
+                 ? lhs.first->priority > rhs.first->priority
+                 : lhs.second.oldest_finalized_file_timestamp < rhs.second.oldest_finalized_file_timestamp;
+    });
+    for (const auto& candidate : candidates) {
+      Queue& queue = *candidate.first;
+      bool busy = false;
+      if (!queue.busy.compare_exchange_strong(busy, true)) {
+        continue;
+      }
+      bricks::time::MILLISECONDS_INTERVAL wait_ms = static_cast<bricks::time::MILLISECONDS_INTERVAL>(0);
+      const bool processed = queue.fsq.ProcessNextFile(&wait_ms);
+      queue.busy = false;
+      if (processed) {
+        return true;
+      }
+      const uint64_t queue_retry_wait_ms = static_cast<uint64_t>(wait_ms);
+      if (queue_retry_wait_ms && (!retry_wait_ms || queue_retry_wait_ms < retry_wait_ms)) {
+        retry_wait_ms = queue_retry_wait_ms;
+      }
+    }
+    return false;
+  }
+
+  // Purges the oldest files of the queues of the lowest priority until the queues fit the quota.
+  // The current files count towards the quota, but are never purged.
+  void EnforceQuota() {
+    std::unique_lock<std::mutex> lock(quota_mutex_);
+    const std::vector<Queue*> queues = Queues();
+    std::vector<QueueSummary<T_TIMESTAMP>> summaries;
+    summaries.reserve(queues.size());
+    uint64_t total_size = 0;
+    for (const Queue* queue : queues) {
+      summaries.push_back(queue->fsq.GetQueueSummary());
+      total_size += summaries.back().total_size;
+    }
+    while (total_size > quota_) {
+      size_t victim = queues.size();
+      for (size_t i = 0; i < queues.size(); ++i) {
+        if (!summaries[i].number_of_finalized_files) {
+          continue;
+        }
+        const T_TIMESTAMP oldest = summaries[i].oldest_finalized_file_timestamp;
+        if (victim == queues.size() || queues[i]->priority < queues[victim]->priority ||
+            (queues[i]->priority == queues[victim]->priority &&
+             oldest < summaries[victim].oldest_finalized_file_timestamp)) {
+          victim = i;
+        }
+      }
+      if (victim == queues.size()) {
+        return;
+      }
+      queues[victim]->fsq.PurgeOldestFile();
+      total_size -= summaries[victim].total_size;
+      summaries[victim] = queues[victim]->fsq.GetQueueSummary();
+      total_size += summaries[victim].total_size;
+    }
+  }
+
+  const T_TIME_MANAGER default_time_manager_ = T_TIME_MANAGER();
+  const T_FILE_SYSTEM default_file_system_ = T_FILE_SYSTEM();
+
+  const std::string working_directory_;
+  const uint64_t quota_;
+  const T_TIME_MANAGER& time_manager_;
+  const T_FILE_SYSTEM& file_system_;
+
+  // Declared before the queues, as the queues signal the threads of the pool until they are destroyed.
+  std::mutex pool_mutex_;
+  std::condition_variable pool_condition_variable_;
+  bool queues_changed_ = false;
+  bool pool_shutdown_ = false;
+  std::atomic<uint64_t> next_finalization_check_ms_;
+
+  mutable std::mutex queues_mutex_;
+  std::map<std::string, std::unique_ptr<Queue>> queues_;
+  std::mutex quota_mutex_;
+
+  std::vector<std::thread> processing_threads_;
+
+  FSQManager(const FSQManager&) = delete;
+  FSQManager(FSQManager&&) = delete;
+  void operator=(const FSQManager&) = delete;
+  void operator=(FSQManager&&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_MANAGER_H
@@ -0,0 +1,72 @@
+#ifndef FSQ_JITTERED_RETRY_STRATEGY_H
+#define FSQ_JITTERED_RETRY_STRATEGY_H
+
+#include <algorithm>
+#include <random>
+
+#include "exception.h"
+#include "exponential_retry_strategy.h"
+#include "retry_state.h"
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace strategy {
+
+// Jittered retry strategy for the processing of finalized files, suited to concurrent processing.
+// On `Success`, processes files as they arrive without any delays.
+// On a failure, retries after a delay drawn uniformly between the min and three times the previous delay,
+// capped by the max, the "decorrelated jitter": the delays grow with consecutive failures, and the retries
+// of the many queues and processes failing against the same destination at once do not happen in lockstep.
+// The min defaults to 1 second and the max defaults to 15 minutes.
+//
+// The backoff is per destination: each FSQ, thus each queue of `FSQManager`, keeps its own, and, with
+// `ProcessingConcurrency()` above one, the failures of the files that were in flight as the backoff began
+// do not escalate it further, as they tell nothing new about the destination.
+template <typename FILE_SYSTEM_FOR_RETRY_STRATEGY, typename ERROR_HANDLING_STRATEGY = DefaultErrorHandling>
+class JitteredDelayRetryStrategy
+    : public PersistedRetryState<FILE_SYSTEM_FOR_RETRY_STRATEGY, ERROR_HANDLING_STRATEGY> {
+ public:
+  typedef PersistedRetryState<FILE_SYSTEM_FOR_RETRY_STRATEGY, ERROR_HANDLING_STRATEGY> T_PERSISTED_STATE;
+  typedef FILE_SYSTEM_FOR_RETRY_STRATEGY T_FILE_SYSTEM;
+  typedef ERROR_HANDLING_STRATEGY T_ERROR_HANDLING_STRATEGY;
+  explicit JitteredDelayRetryStrategy(const T_FILE_SYSTEM& file_system,
+                                      const double min = 1e3,
+                                      const double max = 15 * 60 * 1e3)
+      : T_PERSISTED_STATE(file_system),
+        min_(min),
+        max_(std::max(min, max)),
+        previous_delay_(min),
+        rng_(StatefulRandSeed::GetRandSeed()) {
+  }
+  // OnSuccess(): Clear all retry delays, cruising at full speed, and start over from the min on failure.
+  void OnSuccess() {
+    this->last_update_time_ = bricks::time::Now();
+    this->time_to_be_ready_to_process_ = this->last_update_time_;
+    previous_delay_ = min_;
+    this->OnStateUpdated();
+  }
+  // OnFailure(): Back off for the next delay, unless backing off already.
+  void OnFailure() {
+    const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+    if (now < this->time_to_be_ready_to_process_) {
+      return;
+    }
+    std::uniform_real_distribution<double> distribution(min_, std::min(max_, previous_delay_ * 3));
+    const double delay = distribution(rng_);
+    previous_delay_ = delay;
+    this->time_to_be_ready_to_process_ = now + static_cast<bricks::time::MILLISECONDS_INTERVAL>(delay);
+    this->last_update_time_ = now;
+    this->OnStateUpdated();
+  }
+
+ private:
+  const double min_;
+  const double max_;
+  double previous_delay_;
+  std::mt19937 rng_;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_JITTERED_RETRY_STRATEGY_H
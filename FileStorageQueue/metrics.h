@@ -0,0 +1,185 @@
+// The metrics of FSQ, see `CollectMetrics()` in `config.h` and `GetMetrics()` in `fsq.h`.
+//
+// The counters are atomics, updated with relaxed increments by the threads that push messages, and finalize,
+// process and purge files. They are read the same way into the `Snapshot`, without taking any of the locks
+// of FSQ. Thus, the snapshot is cheap to poll, and is not a consistent cut: the counters are read one by one.
+//
+// The latencies are measured with `std::chrono::steady_clock`, regardless of the time manager of FSQ,
+// in microseconds, and are kept in the histograms of power of two buckets.
+//
+// The trace hook, if set, is called for every event with its span: the kind of the event, when it began and
+// ended, and the file and the number of bytes involved. It is called by the thread of the event, possibly with
+// the mutexes of FSQ held, thus it should be quick and thread safe, and should never call back into FSQ.
+
+#ifndef FSQ_METRICS_H
+#define FSQ_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace fsq {
+namespace metrics {
+
+inline uint64_t NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bucket zero is for zero, and bucket `i` is for [2^(i-1), 2^i) microseconds, the last one being open-ended.
+enum : size_t { kNumberOfBuckets = 33 };
+
+struct HistogramSnapshot {
+  uint64_t count = 0;
+  uint64_t total_us = 0;
+  uint64_t max_us = 0;
+  uint64_t buckets[kNumberOfBuckets] = {};
+
+  double AverageMicroseconds() const {
+    return count ? static_cast<double>(total_us) / count : 0.0;
+  }
+
+  // The upper bound of the bucket the percentile falls into, capped by the maximum. Zero if there is no data.
+  uint64_t PercentileMicroseconds(double percentile) const {
+    const uint64_t rank = static_cast<uint64_t>(count * percentile / 100);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+        return i + 1 < kNumberOfBuckets ? std::min(static_cast<uint64_t>(1) << i, max_us) : max_us;
+      }
+    }
+    return max_us;
+  }
+};
+
+class Histogram final {
+ public:
+  Histogram() {
+    for (auto& bucket : buckets_) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Record(uint64_t us) {
+    const size_t bucket = us ? static_cast<size_t>(64 - __builtin_clzll(us)) : 0;
+    buckets_[bucket < kNumberOfBuckets ? bucket : kNumberOfBuckets - 1].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_us_.fetch_add(us, std::memory_order_relaxed);
+    uint64_t max_us = max_us_.load(std::memory_order_relaxed);
+    while (us > max_us && !max_us_.compare_exchange_weak(max_us, us, std::memory_order_relaxed)) {
+    }
+  }
+
+  HistogramSnapshot Snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.count = count_.load(std::memory_order_relaxed);
+    snapshot.total_us = total_us_.load(std::memory_order_relaxed);
+    snapshot.max_us = max_us_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[kNumberOfBuckets];
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> total_us_{0};
+  std::atomic<uint64_t> max_us_{0};
+};
+
+enum class Event { Push, Finalize, Process, Purge };
+
+inline const char* EventName(Event event) {
+  switch (event) {
+    case Event::Push:
+      return "push";
+    case Event::Finalize:
+      return "finalize";
+    case Event::Process:
+      return "process";
+    case Event::Purge:
+      return "purge";
+  }
+  return "";
+}
+
+// The span of the event, passed to the trace hook. The file name is empty for the pushes.
+struct Span {
+  Event event;
+  uint64_t begin_us;
+  uint64_t end_us;
+  const std::string& file_name;
+  uint64_t bytes;
+};
+
+typedef std::function<void(const Span&)> TraceHook;
+
+struct Snapshot {
+  uint64_t messages_pushed = 0;
+  uint64_t bytes_pushed = 0;
+  HistogramSnapshot push_latency;
+  uint64_t files_finalized = 0;
+  HistogramSnapshot finalize_latency;
+  uint64_t files_processed = 0;
+  HistogramSnapshot processing_latency;
+  uint64_t processing_retries = 0;      // The files the processor has returned `FailureNeedRetry` for.
+  uint64_t processing_unavailable = 0;  // The files the processor has returned `Unavailable` for.
+  uint64_t files_purged = 0;
+  uint64_t bytes_purged = 0;
+  // The backlog of the finalized files, as of the last change of the queue. The age is that of the oldest file,
+  // in the units of the time manager of FSQ, milliseconds by default, and zero if there are no finalized files.
+  uint64_t backlog_files = 0;
+  uint64_t backlog_bytes = 0;
+  uint64_t backlog_age = 0;
+};
+
+// The counters FSQ keeps. The backlog is kept regardless of `CollectMetrics()`.
+struct Counters {
+  std::atomic<uint64_t> messages_pushed{0};
+  std::atomic<uint64_t> bytes_pushed{0};
+  Histogram push_latency;
+  std::atomic<uint64_t> files_finalized{0};
+  Histogram finalize_latency;
+  std::atomic<uint64_t> files_processed{0};
+  Histogram processing_latency;
+  std::atomic<uint64_t> processing_retries{0};
+  std::atomic<uint64_t> processing_unavailable{0};
+  std::atomic<uint64_t> files_purged{0};
+  std::atomic<uint64_t> bytes_purged{0};
+  std::atomic<uint64_t> backlog_files{0};
+  std::atomic<uint64_t> backlog_bytes{0};
+  std::atomic<uint64_t> oldest_finalized_file_timestamp{0};
+
+  // The age of the backlog is left for FSQ to fill in, as it takes the current time.
+  Snapshot TakeSnapshot() const {
+    Snapshot snapshot;
+    snapshot.messages_pushed = messages_pushed.load(std::memory_order_relaxed);
+    snapshot.bytes_pushed = bytes_pushed.load(std::memory_order_relaxed);
+    snapshot.push_latency = push_latency.Snapshot();
+    snapshot.files_finalized = files_finalized.load(std::memory_order_relaxed);
+    snapshot.finalize_latency = finalize_latency.Snapshot();
+    snapshot.files_processed = files_processed.load(std::memory_order_relaxed);
+    snapshot.processing_latency = processing_latency.Snapshot();
+    snapshot.processing_retries = processing_retries.load(std::memory_order_relaxed);
+    snapshot.processing_unavailable = processing_unavailable.load(std::memory_order_relaxed);
+    snapshot.files_purged = files_purged.load(std::memory_order_relaxed);
+    snapshot.bytes_purged = bytes_purged.load(std::memory_order_relaxed);
+    snapshot.backlog_files = backlog_files.load(std::memory_order_relaxed);
+    snapshot.backlog_bytes = backlog_bytes.load(std::memory_order_relaxed);
+    return snapshot;
+  }
+
+  static void Increment(std::atomic<uint64_t>& counter, uint64_t delta = 1) {
+    counter.fetch_add(delta, std::memory_order_relaxed);
+  }
+};
+
+}  // namespace metrics
+}  // namespace fsq
+
+#endif  // FSQ_METRICS_H
@@ -0,0 +1,141 @@
+#ifndef FSQ_RETRY_STATE_H
+#define FSQ_RETRY_STATE_H
+
+#include <algorithm>
+#include <string>
+
+#include "exception.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace strategy {
+
+// How the retry strategies attached to a file keep it up to date.
+enum class RetryStatePersistence {
+  // Rewrite the file in place on every success and on every failure.
+  EveryUpdate,
+  // Only write the file when it no longer tells whether to wait: as the backoff begins, or as it is cut short
+  // by a success. The failures while backing off already, of the files that were in flight when the backoff
+  // began, are not written, thus after a crash the backoff may resume shorter than it was.
+  // Written via a temporary file and a rename, so that a crash never leaves a torn file.
+  OnBackoffChange
+};
+
+// The state the retry strategies share: when the state was last updated, and when to resume processing,
+// persisted to the file, if attached, to survive restarts. The strategies update the state on success
+// and on failure, and call `OnStateUpdated()`.
+template <typename FILE_SYSTEM_FOR_RETRY_STRATEGY, typename ERROR_HANDLING_STRATEGY = DefaultErrorHandling>
+class PersistedRetryState {
+ public:
+  typedef FILE_SYSTEM_FOR_RETRY_STRATEGY T_FILE_SYSTEM;
+  typedef ERROR_HANDLING_STRATEGY T_ERROR_HANDLING_STRATEGY;
+
+  explicit PersistedRetryState(const T_FILE_SYSTEM& file_system)
+      : file_system_(file_system),
+        last_update_time_(bricks::time::Now()),
+        time_to_be_ready_to_process_(last_update_time_),
+        persisted_time_to_be_ready_to_process_(last_update_time_) {
+  }
+  void AttachToFile(const std::string& filename,
+                    RetryStatePersistence persistence = RetryStatePersistence::EveryUpdate) {
+    if (!filename.empty()) {
+      persistence_filename_ = filename;
+      persistence_ = persistence;
+      // The temporary file, if any, is left by a crash before the rename, and is not to be trusted.
+      file_system_.RemoveFile(TemporaryFileName(), bricks::RemoveFileParameters::Silent);
+      // First, resume delay, is possible.
+      // Then, save it to a) ensure the file exists, and b) update its timestamp.
+      ResumeStateFromFile();
+      SaveStateToFile();
+    } else {
+      T_ERROR_HANDLING_STRATEGY::HandleError();  // Empty filename provided.
+    }
+  }
+  bool ShouldWait(bricks::time::MILLISECONDS_INTERVAL* output_wait_ms) {
+    const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+    if (now >= time_to_be_ready_to_process_) {
+      return false;
+    } else {
+      *output_wait_ms = time_to_be_ready_to_process_ - now;
+      return true;
+    }
+  }
+
+ protected:
+  // Saves the updated state to the file, if attached, as `RetryStatePersistence` says.
+  void OnStateUpdated() {
+    if (!persistence_filename_.empty()) {
+      if (persistence_ == RetryStatePersistence::EveryUpdate) {
+        SaveStateToFile();
+      } else {
+        const bool backing_off = time_to_be_ready_to_process_ > last_update_time_;
+        const bool persisted_backing_off = persisted_time_to_be_ready_to_process_ > last_update_time_;
+        if (backing_off != persisted_backing_off) {
+          SaveStateToFile();
+        }
+      }
+    }
+  }
+  void ResumeStateFromFile() const {
+    using typename bricks::time::EPOCH_MILLISECONDS;
+    const EPOCH_MILLISECONDS now = bricks::time::Now();
+    try {
+      const std::string contents = std::move(file_system_.ReadFileAsString(persistence_filename_));
+      constexpr size_t w = bricks::strings::FixedSizeSerializer<EPOCH_MILLISECONDS>::size_in_bytes;
+      // File format is "${update_time} ${time_to_be_ready_to_process}".
+      if (contents.length() == w * 2 + 1 && contents[w] == ' ') {
+        EPOCH_MILLISECONDS last_update_time;
+        EPOCH_MILLISECONDS time_to_be_ready_to_process;
+        bricks::strings::UnpackFromString(contents.substr(0, w), last_update_time);
+        bricks::strings::UnpackFromString(contents.substr(w + 1, w), time_to_be_ready_to_process);
+        if (last_update_time <= now) {
+          last_update_time_ = now;
+          time_to_be_ready_to_process_ = std::max(time_to_be_ready_to_process_, time_to_be_ready_to_process);
+        } else {
+          // TODO(dkorolev): Log an error message, time skew detected, not resuming from file,
+          // overwriting it with "no delay" instead.
+        }
+      } else {
+        // TODO(dkorolev): Log an error message, file format is incorrect.
+      }
+    } catch (const bricks::FileException&) {
+      // TODO(dkorolev): Log an error message, could not read the file.
+    }
+  }
+  void SaveStateToFile() const {
+    using bricks::strings::PackToString;
+    try {
+      const std::string contents =
+          PackToString(last_update_time_) + ' ' + PackToString(time_to_be_ready_to_process_);
+      if (persistence_ == RetryStatePersistence::EveryUpdate) {
+        file_system_.WriteStringToFile(persistence_filename_.c_str(), contents);
+      } else {
+        const std::string temporary_filename = TemporaryFileName();
+        file_system_.WriteStringToFile(temporary_filename, contents);
+        file_system_.RenameFile(temporary_filename, persistence_filename_);
+      }
+      persisted_time_to_be_ready_to_process_ = time_to_be_ready_to_process_;
+    } catch (const bricks::FileException&) {
+      // TODO(dkorolev): Log an error message, could not read the file.
+    }
+  }
+
+  std::string TemporaryFileName() const {
+    return persistence_filename_ + ".tmp";
+  }
+
+  const T_FILE_SYSTEM& file_system_;
+  mutable typename bricks::time::EPOCH_MILLISECONDS last_update_time_;
+  mutable typename bricks::time::EPOCH_MILLISECONDS time_to_be_ready_to_process_;
+
+ private:
+  mutable typename bricks::time::EPOCH_MILLISECONDS persisted_time_to_be_ready_to_process_;
+  std::string persistence_filename_;
+  RetryStatePersistence persistence_ = RetryStatePersistence::EveryUpdate;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_RETRY_STATE_H
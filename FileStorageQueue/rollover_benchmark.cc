@@ -0,0 +1,151 @@
+// A benchmark for the latency of `PushMessage()` across file rollovers.
+//
+// Pushes --messages messages of --message_length bytes each from one thread, pausing for --push_interval_us
+// microseconds before each push. Files are finalized once they reach --file_size_kb kilobytes, and, as the
+// processor is unavailable, the oldest files are purged once there are more than --max_files of them.
+// Thus, every rollover renames a file and removes another one.
+//
+// Runs with the files finalized by the pushing thread, as by default, and with `FinalizeFilesInBackground()`,
+// and reports the percentiles of the latency of all the pushes, and of the pushes that finalize files alone.
+//
+// With --segments, the messages are appended to preallocated segments, and the purged ones are recycled.
+//
+// The pause is on by default. Without it, on a single core, the finalizer thread only gets to run once
+// the pushing thread waits for it, thus finalizing files in the background can not help there, and
+// only adds the handoff to the latency. Run with --push_interval_us=0 to see the back-to-back pushes.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fsq.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+
+DEFINE_int32(messages, 200000, "The total number of messages to push.");
+DEFINE_int32(message_length, 100, "The length of each message, in bytes.");
+DEFINE_int32(file_size_kb, 16, "The size to finalize files at, in kilobytes.");
+DEFINE_int32(max_files, 10, "The number of finalized files to keep, purging the older ones.");
+DEFINE_int32(push_interval_us, 10, "The pause between the pushes, in microseconds, to mimic the real load.");
+DEFINE_bool(compress, false, "Compress the files as they are finalized.");
+DEFINE_bool(segments, false, "Append to preallocated segments of --file_size_kb, recycling the purged ones.");
+DEFINE_string(dir,
+              "build/rollover_benchmark_data",
+              "The directory for FSQ to work in. Created if does not exist.");
+
+struct UnavailableProcessor {
+  template <typename T_TIMESTAMP>
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<T_TIMESTAMP>&, T_TIMESTAMP) {
+    return fsq::FileProcessingResult::Unavailable;
+  }
+};
+
+struct FinalizeBySizeFromFlags {
+  template <typename T_TIMESTAMP>
+  bool ShouldFinalize(const fsq::QueueStatus<T_TIMESTAMP>& status, const T_TIMESTAMP) const {
+    return status.appended_file_size >= static_cast<uint64_t>(FLAGS_file_size_kb) * 1024;
+  }
+};
+
+struct PurgeByNumberOfFilesFromFlags {
+  template <typename T_TIMESTAMP>
+  bool ShouldPurge(const fsq::QueueStatus<T_TIMESTAMP>& status) const {
+    return status.finalized.queue.size() > static_cast<size_t>(FLAGS_max_files);
+  }
+};
+
+template <bool BACKGROUND>
+struct BenchmarkConfig : fsq::Config<UnavailableProcessor> {
+  typedef fsq::strategy::AppendToFileWithSeparator T_FILE_APPEND_STRATEGY;
+  typedef FinalizeBySizeFromFlags T_FINALIZE_STRATEGY;
+  typedef PurgeByNumberOfFilesFromFlags T_PURGE_STRATEGY;
+  inline static bool FinalizeFilesInBackground() {
+    return BACKGROUND;
+  }
+  inline static bool CompressFinalizedFiles() {
+    return FLAGS_compress;
+  }
+  inline static uint64_t SegmentSize() {
+    return FLAGS_segments ? static_cast<uint64_t>(FLAGS_file_size_kb) * 1024 + fsq::segments::kHeaderSize : 0;
+  }
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE& instance) {
+    instance.SetSeparator("\n");
+  }
+};
+
+void PrintPercentiles(const char* mode, const char* pushes, std::vector<uint64_t>& latencies_ns) {
+  std::sort(latencies_ns.begin(), latencies_ns.end());
+  const auto percentile_us = [&latencies_ns](double p) {
+    return latencies_ns.empty()
+               ? 0.0
+               : 1e-3 * latencies_ns[std::min(static_cast<size_t>(latencies_ns.size() * p / 100),
+                                              latencies_ns.size() - 1)];
+  };
+  std::printf("%-10s %-9s %8d pushes, us: p50 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f\n",
+              mode,
+              pushes,
+              static_cast<int>(latencies_ns.size()),
+              percentile_us(50),
+              percentile_us(99),
+              percentile_us(99.9),
+              percentile_us(100));
+}
+
+template <bool BACKGROUND>
+void RunBenchmark(const char* mode) {
+  UnavailableProcessor processor;
+  typedef fsq::FSQ<BenchmarkConfig<BACKGROUND>> FSQ;
+  FSQ(processor, FLAGS_dir).ShutdownAndRemoveAllFSQFiles();
+
+  const std::string message(FLAGS_message_length, '.');
+  const uint64_t message_size = message.length() + 1;
+  const uint64_t file_size = static_cast<uint64_t>(FLAGS_file_size_kb) * 1024;
+  // Tracks the size of the current file as FSQ does, to tell which pushes finalize it, see `AppendMessage()`.
+  uint64_t appended_file_size = 0;
+  std::vector<uint64_t> all_latencies_ns;
+  std::vector<uint64_t> rollover_latencies_ns;
+  all_latencies_ns.reserve(FLAGS_messages);
+  {
+    FSQ fsq(processor, FLAGS_dir);
+    fsq.GetQueueStatus();  // Wait for the initial scan of the directory to complete.
+    for (int i = 0; i < FLAGS_messages; ++i) {
+      bool rollover = false;
+      if (appended_file_size + message_size >= file_size) {
+        rollover = true;
+        appended_file_size = 0;
+      }
+      appended_file_size += message_size;
+      if (appended_file_size >= file_size) {
+        rollover = true;
+        appended_file_size = 0;
+      }
+      if (FLAGS_push_interval_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(FLAGS_push_interval_us));
+      }
+      const auto begin = std::chrono::steady_clock::now();
+      fsq.PushMessage(message);
+      const uint64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - begin).count();
+      all_latencies_ns.push_back(latency_ns);
+      if (rollover) {
+        rollover_latencies_ns.push_back(latency_ns);
+      }
+    }
+    fsq.ShutdownAndRemoveAllFSQFiles();
+  }
+  PrintPercentiles(mode, "all", all_latencies_ns);
+  PrintPercentiles(mode, "rollover", rollover_latencies_ns);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  bricks::FileSystem::CreateDirectory(FLAGS_dir);
+
+  RunBenchmark<false>("Inline");
+  RunBenchmark<true>("Background");
+}
@@ -0,0 +1,174 @@
+// The preallocated, recycled segment files of FSQ, see `SegmentSize()` in `config.h`.
+//
+// A segment is a file of a fixed size, preallocated with `posix_fallocate()` when it is created, so that
+// appending to it neither allocates extents nor changes the size of the file. As the size of the file no longer
+// tells where its data ends, the segment starts with a header: the eight magic bytes and the 8-byte
+// little-endian size of the data that follows. The bytes past the data are stale, or zeroes.
+//
+// FSQ records the size of the data into the header once per write to the current file, after the data itself.
+// Thus, if FSQ crashes, the messages written past the recorded size are discarded, and never torn.
+//
+// Once finalized, the segment is truncated to its header and its data, so that the finalized files take up
+// on disk what the status, and thus the purge strategy, counts them for. Only the files to append to
+// are preallocated.
+//
+// Once processed, the segments are not removed, but renamed into the pool of recycled segments, to be renamed
+// into the next current files, and preallocated again. Their headers are reset before that, so that their stale
+// data is never taken for the data of the current file.
+//
+// `FileView` exposes the data of the segments only. The processors that read the files on their own
+// can use `ReadSegmentData()`.
+
+#ifndef FSQ_SEGMENTS_H
+#define FSQ_SEGMENTS_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../Bricks/file/file.h"
+
+namespace fsq {
+namespace segments {
+
+enum : size_t { kMagicSize = 8, kHeaderSize = 16 };
+
+inline const char* Magic() {
+  return "\x89" "FSQSEG\n";
+}
+
+inline void MakeHeader(uint64_t data_size, char (&header)[kHeaderSize]) {
+  std::memcpy(header, Magic(), kMagicSize);
+  for (int i = 0; i < 8; ++i) {
+    header[kMagicSize + i] = static_cast<char>((data_size >> (8 * i)) & 0xff);
+  }
+}
+
+// Parses the header of the file of `file_size` bytes. Returns false if the file is not a segment.
+// The size of the data is capped by the size of the file, should the header be damaged.
+inline bool ParseHeader(const char* header, uint64_t file_size, uint64_t& data_size) {
+  if (file_size < kHeaderSize || std::memcmp(header, Magic(), kMagicSize)) {
+    return false;
+  }
+  data_size = 0;
+  for (int i = 0; i < 8; ++i) {
+    data_size |= static_cast<uint64_t>(static_cast<uint8_t>(header[kMagicSize + i])) << (8 * i);
+  }
+  if (data_size > file_size - kHeaderSize) {
+    data_size = file_size - kHeaderSize;
+  }
+  return true;
+}
+
+// Reads the size of the data from the header of the file. Returns false if the file is not a segment.
+inline bool ReadDataSize(const std::string& file_name, uint64_t& data_size) {
+  const int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char header[kHeaderSize];
+  struct stat info;
+  const bool result = !::fstat(fd, &info) && ::pread(fd, header, kHeaderSize, 0) == kHeaderSize &&
+                      ParseHeader(header, static_cast<uint64_t>(info.st_size), data_size);
+  ::close(fd);
+  return result;
+}
+
+// Creates the segment of `segment_size` bytes, header included, with no data. Returns false on failure.
+// The segment still works if the space could not be preallocated, it just grows as it is appended to.
+inline bool CreateSegment(const std::string& file_name, uint64_t segment_size) {
+  const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  ::posix_fallocate(fd, 0, static_cast<off_t>(segment_size));
+  char header[kHeaderSize];
+  MakeHeader(0, header);
+  const bool result = ::pwrite(fd, header, kHeaderSize, 0) == kHeaderSize;
+  ::close(fd);
+  return result;
+}
+
+// Preallocates the segment back to `segment_size` bytes, header included, for it to be reused.
+// The segment still works if the space could not be preallocated, it just grows as it is appended to.
+inline void PreallocateSegment(const std::string& file_name, uint64_t segment_size) {
+  const int fd = ::open(file_name.c_str(), O_WRONLY);
+  if (fd >= 0) {
+    ::posix_fallocate(fd, 0, static_cast<off_t>(segment_size));
+    ::close(fd);
+  }
+}
+
+// Truncates the segment to its header and its data, releasing the space preallocated past them.
+// Returns false if the file is not a segment, or could not be truncated.
+inline bool TruncateSegmentToData(const std::string& file_name) {
+  uint64_t data_size;
+  return ReadDataSize(file_name, data_size) &&
+         !::truncate(file_name.c_str(), static_cast<off_t>(kHeaderSize + data_size));
+}
+
+// Whether the file is a segment of at most `segment_size` bytes, header included, and thus can be reused.
+inline bool IsReusableSegment(const std::string& file_name, uint64_t segment_size) {
+  uint64_t data_size;
+  return ReadDataSize(file_name, data_size) && bricks::FileSystem::GetFileSize(file_name) <= segment_size;
+}
+
+// The header of the segment being appended to, kept open to record the size of the data as it grows.
+// Remains valid as the segment is renamed.
+class SegmentHeader final {
+ public:
+  explicit SegmentHeader(const std::string& file_name) : fd_(::open(file_name.c_str(), O_WRONLY)) {
+  }
+
+  ~SegmentHeader() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  // Records the size of the data, unless it is the one recorded last. Returns false on failure.
+  bool SetDataSize(uint64_t data_size) {
+    if (recorded_ && data_size == data_size_) {
+      return true;
+    }
+    char header[kHeaderSize];
+    MakeHeader(data_size, header);
+    if (fd_ < 0 || ::pwrite(fd_, header, kHeaderSize, 0) != kHeaderSize) {
+      return false;
+    }
+    recorded_ = true;
+    data_size_ = data_size;
+    return true;
+  }
+
+ private:
+  const int fd_;
+  bool recorded_ = false;
+  uint64_t data_size_ = 0;
+
+  SegmentHeader(const SegmentHeader&) = delete;
+  SegmentHeader(SegmentHeader&&) = delete;
+  void operator=(const SegmentHeader&) = delete;
+  void operator=(SegmentHeader&&) = delete;
+};
+
+// The data of the file, without the header and the stale bytes if it is a segment.
+// For the processors that read files on their own.
+inline std::string ReadSegmentData(const std::string& file_name) {
+  const std::string contents = bricks::ReadFileAsString(file_name);
+  uint64_t data_size;
+  if (ParseHeader(contents.data(), contents.length(), data_size)) {
+    return contents.substr(kHeaderSize, static_cast<size_t>(data_size));
+  } else {
+    return contents;
+  }
+}
+
+}  // namespace segments
+}  // namespace fsq
+
+#endif  // FSQ_SEGMENTS_H
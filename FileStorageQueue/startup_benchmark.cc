@@ -0,0 +1,89 @@
+// A benchmark for the startup of FSQ with many finalized files on disk.
+//
+// Creates --files finalized files of --file_size bytes each, and measures the time from constructing FSQ
+// to its status being ready, which is what PushMessage() and GetQueueStatus() wait for:
+//
+//   1) Scan:     Without the manifest, the directory is scanned, as it always used to be.
+//   2) Manifest: With the manifest, once it has been written by a previous run of FSQ, it is read instead.
+//
+// Each is measured --runs times, and the median is reported.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "fsq.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+
+DEFINE_int32(files, 10000, "The number of finalized files to start with.");
+DEFINE_int32(file_size, 100, "The size of each file, in bytes.");
+DEFINE_int32(runs, 5, "The number of times to start FSQ for each mode.");
+DEFINE_string(dir,
+              "build/startup_benchmark_data",
+              "The directory for FSQ to work in. Created if does not exist.");
+
+struct UnavailableProcessor {
+  template <typename T_TIMESTAMP>
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<T_TIMESTAMP>&, T_TIMESTAMP) {
+    return fsq::FileProcessingResult::Unavailable;
+  }
+};
+
+// Never purges the files, to start with all of them every time.
+struct ScanConfig : fsq::Config<UnavailableProcessor> {
+  typedef fsq::strategy::SimplePurgeStrategy<static_cast<uint64_t>(1) << 40, 1000000> T_PURGE_STRATEGY;
+};
+
+struct ManifestConfig : ScanConfig {
+  inline static std::string ManifestFileName() {
+    return "manifest.txt";
+  }
+};
+
+template <typename CONFIG>
+double MedianStartupMilliseconds() {
+  std::vector<double> milliseconds;
+  for (int i = 0; i < FLAGS_runs; ++i) {
+    UnavailableProcessor processor;
+    const auto begin = std::chrono::steady_clock::now();
+    fsq::FSQ<CONFIG> fsq(processor, FLAGS_dir);
+    const size_t number_of_files = fsq.GetQueueStatus().finalized.queue.size();
+    milliseconds.push_back(
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+    if (number_of_files != static_cast<size_t>(FLAGS_files)) {
+      std::fprintf(stderr, "Expected %d files, got %d.\n", FLAGS_files, static_cast<int>(number_of_files));
+    }
+  }
+  std::sort(milliseconds.begin(), milliseconds.end());
+  return milliseconds[milliseconds.size() / 2];
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  bricks::FileSystem::CreateDirectory(FLAGS_dir);
+
+  UnavailableProcessor processor;
+  fsq::FSQ<ManifestConfig>(processor, FLAGS_dir).ShutdownAndRemoveAllFSQFiles();
+  const std::string contents(FLAGS_file_size, '.');
+  for (int i = 0; i < FLAGS_files; ++i) {
+    const std::string name = fsq::strategy::DummyFileNamingToUnblockAlexFromMinsk().finalized.GenerateFileName(
+        static_cast<bricks::time::EPOCH_MILLISECONDS>(i + 1));
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_dir, name), contents);
+  }
+
+  std::printf(
+      "Scan:     %9.2f ms to start with %d files.\n", MedianStartupMilliseconds<ScanConfig>(), FLAGS_files);
+  {
+    // Have FSQ write the manifest, by scanning the directory once.
+    fsq::FSQ<ManifestConfig> fsq(processor, FLAGS_dir);
+    fsq.GetQueueStatus();
+  }
+  std::printf(
+      "Manifest: %9.2f ms to start with %d files.\n", MedianStartupMilliseconds<ManifestConfig>(), FLAGS_files);
+
+  fsq::FSQ<ManifestConfig>(processor, FLAGS_dir).ShutdownAndRemoveAllFSQFiles();
+}
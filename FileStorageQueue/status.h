@@ -47,6 +47,15 @@ struct QueueStatus {
   QueueFinalizedFilesStatus<T_TIMESTAMP> finalized;
 };
 
+// The totals of the status, cheaper to get than the status itself, which copies the whole queue.
+template <typename TIMESTAMP>
+struct QueueSummary {
+  typedef TIMESTAMP T_TIMESTAMP;
+  uint64_t total_size = 0;  // The finalized files and the current one combined.
+  size_t number_of_finalized_files = 0;
+  T_TIMESTAMP oldest_finalized_file_timestamp = T_TIMESTAMP(0);  // Also zero if there are no finalized files.
+};
+
 }  // namespace fsq
 
 #endif  // FSQ_STATUS_H
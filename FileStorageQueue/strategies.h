@@ -3,8 +3,14 @@
 
 #include <string>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "status.h"
 #include "exception.h"
+#include "file_view.h"
+#include "framed_records.h"
+#include "segments.h"
 
 #include "../Bricks/util/util.h"
 #include "../Bricks/file/file.h"
@@ -15,26 +21,50 @@ namespace fsq {
 namespace strategy {
 
 // Default file append strategy: Appends data to files in raw format, without separators.
+// Flushes each message, which costs a `write()` syscall per message. See `BufferedAppendToFile` below.
 struct JustAppendToFile {
   void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
-    // TODO(dkorolev): Should we flush each record? Make it part of the strategy?
     fo << message << std::flush;
   }
   uint64_t MessageSizeInBytes(const std::string& message) const {
     return message.length();
   }
+  // Nothing is ever buffered, thus nothing to flush.
+  void FlushToFile(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushToFileIfDue(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushBeforeClosingFile(bricks::FileSystem::OutputFile&, const std::string&) const {
+  }
+  void SyncFile(const std::string&) const {
+  }
+  // Raw bytes have no framing to tell a torn tail by, thus the current file is resumed as is.
+  uint64_t TruncateTornTail(const std::string&, uint64_t size) const {
+    return size;
+  }
 };
 
 // Another simple file append strategy: Append messages adding a separator after each of them.
 class AppendToFileWithSeparator {
  public:
   void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
-    // TODO(dkorolev): Should we flush each record? Make it part of the strategy?
     fo << message << separator_ << std::flush;
   }
   uint64_t MessageSizeInBytes(const std::string& message) const {
     return message.length() + separator_.length();
   }
+  void FlushToFile(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushToFileIfDue(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushBeforeClosingFile(bricks::FileSystem::OutputFile&, const std::string&) const {
+  }
+  void SyncFile(const std::string&) const {
+  }
+  // A message torn by a crash can not be told from a complete one, thus the current file is resumed as is.
+  uint64_t TruncateTornTail(const std::string&, uint64_t size) const {
+    return size;
+  }
   void SetSeparator(const std::string& separator) {
     separator_ = separator;
   }
@@ -43,6 +73,137 @@ class AppendToFileWithSeparator {
   std::string separator_ = "";
 };
 
+// Buffered file append strategy: Collects messages, with an optional separator after each of them,
+// in a user-space buffer, and writes the buffer out in one go, as the durability policy dictates:
+// * FLUSH_EVERY_N_BYTES:        Once the buffer holds at least this many bytes. Zero to not flush by size.
+// * FLUSH_EVERY_T_MILLISECONDS: Once this many milliseconds have passed since the last flush. Zero to not flush
+//                               by time. Checked as messages are appended, and, with
+//                               `FinalizationCheckIntervalMilliseconds()` in the config, on that timer too,
+//                               so that the buffered messages are written out once no more are pushed.
+// * FSYNC_ON_FINALIZE:          Also `fsync()` the file before it is finalized, and before FSQ is destructed.
+// The buffer is always flushed before the file is finalized, and before FSQ is destructed.
+// With all the parameters set to zero, the messages are only written out on finalize.
+//
+// The messages in the buffer are lost if the process crashes. That is the price of not making a syscall
+// per message. With `GroupCommitConcurrentPushes()` in the config, FSQ flushes the buffer once per group
+// of concurrently pushed messages instead, see `fsq.h`.
+template <uint64_t FLUSH_EVERY_N_BYTES, uint64_t FLUSH_EVERY_T_MILLISECONDS, bool FSYNC_ON_FINALIZE>
+class BufferedAppendToFile {
+ public:
+  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) {
+    buffer_.append(message);
+    buffer_.append(separator_);
+    if (FLUSH_EVERY_N_BYTES && buffer_.length() >= FLUSH_EVERY_N_BYTES) {
+      FlushToFile(fo);
+    } else if (FLUSH_EVERY_T_MILLISECONDS && MillisecondsSinceLastFlush() >= FLUSH_EVERY_T_MILLISECONDS) {
+      FlushToFile(fo);
+    }
+  }
+  uint64_t MessageSizeInBytes(const std::string& message) const {
+    return message.length() + separator_.length();
+  }
+  // Writes out the buffer, if not empty. Keeps its capacity for the messages to come.
+  void FlushToFile(bricks::FileSystem::OutputFile& fo) {
+    if (!buffer_.empty()) {
+      fo.write(buffer_.data(), buffer_.length());
+      fo.flush();
+      buffer_.clear();
+    }
+    if (FLUSH_EVERY_T_MILLISECONDS) {
+      last_flush_timestamp_ = bricks::time::Now();
+    }
+  }
+  // Writes out the buffer if the time policy says so. Called by FSQ on the timer, if any.
+  void FlushToFileIfDue(bricks::FileSystem::OutputFile& fo) {
+    if (FLUSH_EVERY_T_MILLISECONDS && !buffer_.empty() &&
+        MillisecondsSinceLastFlush() >= FLUSH_EVERY_T_MILLISECONDS) {
+      FlushToFile(fo);
+    }
+  }
+  void FlushBeforeClosingFile(bricks::FileSystem::OutputFile& fo, const std::string& file_name) {
+    FlushToFile(fo);
+    SyncFile(file_name);
+  }
+  // Does not touch the buffer, thus can be called for the file that has been flushed, from another thread.
+  void SyncFile(const std::string& file_name) const {
+    if (FSYNC_ON_FINALIZE) {
+      // `std::ofstream` does not expose its file descriptor, and `fsync()` of any descriptor of the file does.
+      const int fd = ::open(file_name.c_str(), O_WRONLY);
+      if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+      }
+    }
+  }
+  uint64_t TruncateTornTail(const std::string&, uint64_t size) const {
+    return size;
+  }
+  void SetSeparator(const std::string& separator) {
+    separator_ = separator;
+  }
+
+ private:
+  uint64_t MillisecondsSinceLastFlush() const {
+    return static_cast<uint64_t>(bricks::time::Now() - last_flush_timestamp_);
+  }
+
+  std::string separator_ = "";
+  std::string buffer_;
+  bricks::time::EPOCH_MILLISECONDS last_flush_timestamp_ = bricks::time::Now();
+};
+
+// Record-framed file append strategy: Writes each message as a record of its length, its checksum
+// and itself, see `framed_records.h`. The messages may contain any bytes, separators included,
+// and the processors split the files back into messages via `FramedRecords`, without copying them.
+// On startup, the records torn by a crash at the end of the current files are truncated away.
+struct AppendFramedRecords {
+  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
+    char header[framed_records::kHeaderSize];
+    framed_records::MakeHeader(message.data(), message.length(), header);
+    fo.write(header, sizeof(header));
+    fo.write(message.data(), message.length());
+    fo.flush();
+  }
+  uint64_t MessageSizeInBytes(const std::string& message) const {
+    return framed_records::kHeaderSize + message.length();
+  }
+  void FlushToFile(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushToFileIfDue(bricks::FileSystem::OutputFile&) const {
+  }
+  void FlushBeforeClosingFile(bricks::FileSystem::OutputFile&, const std::string&) const {
+  }
+  void SyncFile(const std::string&) const {
+  }
+  // Truncates the file to its valid records, and returns its new size. For the segments, see `segments.h`,
+  // records the new size of the data into the header instead.
+  // If the file could not be mapped, it is read into memory, and left as is if it could not be read.
+  uint64_t TruncateTornTail(const std::string& file_name, uint64_t size) const {
+    size_t valid_size;
+    bool segment;
+    {
+      const FileView view(file_name);
+      if (view.IsMapped()) {
+        valid_size = FramedRecords(view.Data(), view.Size()).ValidPrefixSize();
+      } else {
+        std::string contents;
+        if (!view.ReadContents(contents)) {
+          return size;
+        }
+        valid_size = FramedRecords(contents.data(), contents.length()).ValidPrefixSize();
+      }
+      segment = view.IsSegment();
+    }
+    if (valid_size < size) {
+      if (segment ? segments::SegmentHeader(file_name).SetDataSize(valid_size)
+                  : !::truncate(file_name.c_str(), static_cast<off_t>(valid_size))) {
+        return valid_size;
+      }
+    }
+    return size;
+  }
+};
+
 // Default resume strategy: Always resume.
 struct AlwaysResume {
   inline static bool ShouldResume() {
@@ -148,6 +309,78 @@ typedef SimpleFinalizationStrategy<bricks::time::EPOCH_MILLISECONDS,
                                    bricks::time::MILLISECONDS_INTERVAL(10 * 60 * 1000)>
     KeepFilesAround100KBUnlessNoBacklog;
 
+// Adaptive file finalization strategy: Sizes the files to the observed rate of pushes, so that both the time
+// from a push to the processing of its file and the number of files per hour are bounded, whatever the rate.
+// * With no backlog, finalizes the file once it is REALTIME_MAX_FILE_AGE old, or once it reaches the target
+//   size: the number of bytes pushed, at the observed rate, in 1/MAX_FILES_PER_HOUR of an hour,
+//   kept between MIN_FILE_SIZE and MAX_FILE_SIZE. Thus, a steady rate makes for MAX_FILES_PER_HOUR files,
+//   unless they would be over MAX_FILE_SIZE, and a rate going down makes for files of REALTIME_MAX_FILE_AGE.
+// * With backlog, the processor is behind anyway, thus the files are only finalized once they reach
+//   MAX_FILE_SIZE or BACKLOG_MAX_FILE_AGE, for fewer, larger files.
+// The rate is the moving average over the recent files, updated as they are finalized.
+// With `FinalizationCheckIntervalMilliseconds()` in the config, the ages are honored with no pushes as well.
+// Like `SimpleFinalizationStrategy`, only supports timestamps in milliseconds.
+template <typename TIMESTAMP,
+          typename TIME_SPAN,
+          uint64_t MIN_FILE_SIZE,
+          uint64_t MAX_FILE_SIZE,
+          uint64_t MAX_FILES_PER_HOUR,
+          TIME_SPAN REALTIME_MAX_FILE_AGE,
+          TIME_SPAN BACKLOG_MAX_FILE_AGE>
+class AdaptiveFinalizationStrategy {
+ public:
+  typedef TIMESTAMP T_TIMESTAMP;
+  typedef TIME_SPAN T_TIME_SPAN;
+  bool ShouldFinalize(const QueueStatus<T_TIMESTAMP>& status, const T_TIMESTAMP now) {
+    bool should_finalize;
+    if (status.appended_file_size >= MAX_FILE_SIZE ||
+        (now - status.appended_file_timestamp) > BACKLOG_MAX_FILE_AGE) {
+      should_finalize = true;
+    } else if (!status.finalized.queue.empty()) {
+      should_finalize = false;
+    } else {
+      should_finalize = (status.appended_file_size >= TargetFileSize() ||
+                         (now - status.appended_file_timestamp) > REALTIME_MAX_FILE_AGE);
+    }
+    // No file is open if nothing has been appended or if it has no timestamp yet, thus nothing to learn
+    // the rate from.
+    if (should_finalize && status.appended_file_size && status.appended_file_timestamp != T_TIMESTAMP(0)) {
+      const uint64_t age_ms = static_cast<uint64_t>(now - status.appended_file_timestamp);
+      const double bytes_per_millisecond =
+          static_cast<double>(status.appended_file_size) / static_cast<double>(age_ms ? age_ms : 1);
+      bytes_per_millisecond_ =
+          rate_known_ ? (bytes_per_millisecond_ + bytes_per_millisecond) / 2 : bytes_per_millisecond;
+      rate_known_ = true;
+    }
+    return should_finalize;
+  }
+
+  // The size to finalize the files at with no backlog, as of the rate observed so far.
+  uint64_t TargetFileSize() const {
+    const double target_size = bytes_per_millisecond_ * (60.0 * 60 * 1000 / MAX_FILES_PER_HOUR);
+    if (target_size <= MIN_FILE_SIZE) {
+      return MIN_FILE_SIZE;
+    } else if (target_size >= MAX_FILE_SIZE) {
+      return MAX_FILE_SIZE;
+    } else {
+      return static_cast<uint64_t>(target_size);
+    }
+  }
+
+ private:
+  bool rate_known_ = false;
+  double bytes_per_millisecond_ = 0;
+};
+
+typedef AdaptiveFinalizationStrategy<bricks::time::EPOCH_MILLISECONDS,
+                                     bricks::time::MILLISECONDS_INTERVAL,
+                                     10 * 1024,
+                                     10 * 1024 * 1024,
+                                     60,
+                                     bricks::time::MILLISECONDS_INTERVAL(10 * 60 * 1000),
+                                     bricks::time::MILLISECONDS_INTERVAL(24 * 60 * 60 * 1000)>
+    AdaptFilesToPushRateAround60PerHour;
+
 // Default file purge strategy: Keeps under 1K files of under 20MB of total size.
 template <uint64_t MAX_TOTAL_SIZE, size_t MAX_FILES>
 struct SimplePurgeStrategy {
@@ -1,8 +1,18 @@
 // TODO(dkorolev): Add a more purge test(s), code coverage should show which.
 
 #include <atomic>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "fsq.h"
+#include "fsq_manager.h"
+#include "jittered_retry_strategy.h"
 
 #include "../Bricks/file/file.h"
 
@@ -538,3 +548,1681 @@ TEST(FileSystemQueueTest, IgnoredRetryDelaySetFromTheFuture) {
   bricks::time::MILLISECONDS_INTERVAL interval;
   ASSERT_FALSE(fsq.ShouldWait(&interval));
 }
+
+// Only writes the retry state as the backoff begins or ends, with `RetryStatePersistence::OnBackoffChange`.
+TEST(FileSystemQueueTest, SavesRetryStateOnBackoffChangeOnly) {
+  const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
+  bricks::RemoveFile(state_file_name, bricks::RemoveFileParameters::Silent);
+
+  typedef fsq::strategy::ExponentialDelayRetryStrategy<bricks::FileSystem> ExpRetry;
+  const bricks::FileSystem file_system;
+  ExpRetry retry(file_system, ExpRetry::DistributionParams(1500, 1000, 2000));
+  retry.AttachToFile(state_file_name, fsq::strategy::RetryStatePersistence::OnBackoffChange);
+  const std::string initial_contents = bricks::ReadFileAsString(state_file_name);
+  ASSERT_EQ(41u, initial_contents.length());  // 20 + 1 + 20.
+
+  // Successes with no backoff to end leave the file as is.
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  retry.OnSuccess();
+  retry.OnSuccess();
+  EXPECT_EQ(initial_contents, bricks::ReadFileAsString(state_file_name));
+
+  // The first failure begins the backoff, the failures while backing off already are not written.
+  retry.OnFailure();
+  const std::string backoff_contents = bricks::ReadFileAsString(state_file_name);
+  EXPECT_NE(initial_contents, backoff_contents);
+  std::istringstream is(backoff_contents);
+  uint64_t update_time, time_to_be_ready_to_process;
+  is >> update_time >> time_to_be_ready_to_process;
+  EXPECT_GE(time_to_be_ready_to_process, update_time + 1000);
+  EXPECT_LE(time_to_be_ready_to_process, update_time + 2000);
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  retry.OnFailure();
+  EXPECT_EQ(backoff_contents, bricks::ReadFileAsString(state_file_name));
+
+  // A success ends the backoff, and is written, via a temporary file that is gone after the rename.
+  retry.OnSuccess();
+  EXPECT_NE(backoff_contents, bricks::ReadFileAsString(state_file_name));
+  bricks::time::MILLISECONDS_INTERVAL wait_ms;
+  EXPECT_FALSE(retry.ShouldWait(&wait_ms));
+  EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(state_file_name + ".tmp"));
+
+  // The next run resumes with no backoff, and removes the temporary file left by a crash before the rename.
+  bricks::WriteStringToFile(state_file_name + ".tmp", backoff_contents);
+  ExpRetry resumed(file_system, ExpRetry::DistributionParams(1500, 1000, 2000));
+  resumed.AttachToFile(state_file_name, fsq::strategy::RetryStatePersistence::OnBackoffChange);
+  EXPECT_FALSE(resumed.ShouldWait(&wait_ms));
+  EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(state_file_name + ".tmp"));
+}
+
+// Grows the jittered delays with consecutive failures, but not with the failures while backing off already.
+TEST(FileSystemQueueTest, JitteredRetryDelays) {
+  typedef fsq::strategy::JitteredDelayRetryStrategy<bricks::FileSystem> JitteredRetry;
+  const bricks::FileSystem file_system;
+  JitteredRetry retry(file_system, 10, 1000);
+  bricks::time::MILLISECONDS_INTERVAL wait_ms;
+  EXPECT_FALSE(retry.ShouldWait(&wait_ms));
+
+  // The first delay is between the min and three times the min.
+  retry.OnFailure();
+  ASSERT_TRUE(retry.ShouldWait(&wait_ms));
+  const uint64_t first_wait_ms = static_cast<uint64_t>(wait_ms);
+  EXPECT_LE(first_wait_ms, 30u);
+
+  // The concurrent failures do not escalate the backoff.
+  retry.OnFailure();
+  retry.OnFailure();
+  ASSERT_TRUE(retry.ShouldWait(&wait_ms));
+  EXPECT_LE(static_cast<uint64_t>(wait_ms), first_wait_ms);
+
+  // Once the backoff is over, the next failure backs off again, for up to three times the previous delay.
+  std::this_thread::sleep_for(std::chrono::milliseconds(first_wait_ms + 1));
+  EXPECT_FALSE(retry.ShouldWait(&wait_ms));
+  retry.OnFailure();
+  ASSERT_TRUE(retry.ShouldWait(&wait_ms));
+  EXPECT_LE(static_cast<uint64_t>(wait_ms), (first_wait_ms + 1) * 3);
+
+  // A success clears the backoff.
+  retry.OnSuccess();
+  EXPECT_FALSE(retry.ShouldWait(&wait_ms));
+}
+
+// Buffers messages in memory until the file is finalized, or until the buffer holds FLUSH_EVERY_N_BYTES bytes.
+template <uint64_t FLUSH_EVERY_N_BYTES>
+struct BufferedMockConfig : MockConfig {
+  typedef fsq::strategy::BufferedAppendToFile<FLUSH_EVERY_N_BYTES, 0, false> T_FILE_APPEND_STRATEGY;
+};
+
+TEST(FileSystemQueueTest, BufferedAppendWritesOnFinalize) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<BufferedMockConfig<0>> fsq(processor, kTestDir, mock_wall_time);
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  fsq.PushMessage("bar");
+
+  // The messages are accounted for, but are not in the file yet.
+  EXPECT_EQ(8ull, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(current_file_name));
+
+  // Finalizing the file writes them out.
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(1u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000000001.bin", processor.filenames);
+  EXPECT_EQ("foo\nbar\n", processor.contents);
+}
+
+TEST(FileSystemQueueTest, BufferedAppendFlushesEveryNBytes) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<BufferedMockConfig<10>> fsq(processor, kTestDir, mock_wall_time);
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  fsq.PushMessage("bar");
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(current_file_name));
+
+  fsq.PushMessage("baz");
+  EXPECT_EQ(12ull, bricks::FileSystem::GetFileSize(current_file_name));
+
+  fsq.PushMessage("meh");
+  EXPECT_EQ(12ull, bricks::FileSystem::GetFileSize(current_file_name));
+  EXPECT_EQ(16ull, fsq.GetQueueStatus().appended_file_size);
+}
+
+// Buffers messages for up to 200 milliseconds, and has the worker thread check the policy every millisecond.
+struct BufferedOnTimerMockConfig : MockConfig {
+  typedef fsq::strategy::BufferedAppendToFile<0, 200, false> T_FILE_APPEND_STRATEGY;
+  inline static uint64_t FinalizationCheckIntervalMilliseconds() {
+    return 1;
+  }
+};
+
+TEST(FileSystemQueueTest, BufferedAppendFlushesOnTimerWithNoPushes) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<BufferedOnTimerMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(current_file_name));
+
+  // With no more messages pushed, the buffered one is written out once it is due.
+  while (bricks::FileSystem::GetFileSize(current_file_name) != 4ull) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ("foo\n", bricks::ReadFileAsString(current_file_name));
+  EXPECT_EQ(0u, processor.finalized_count);
+}
+
+// Pushes "{thread} {index}\n" messages from several threads at once.
+static void PushConcurrently(std::function<void(const std::string&)> push, size_t threads, size_t messages) {
+  std::vector<std::thread> pushers;
+  for (size_t t = 0; t < threads; ++t) {
+    pushers.emplace_back([&push, t, messages]() {
+      for (size_t i = 0; i < messages; ++i) {
+        push(std::to_string(t) + ' ' + std::to_string(i));
+      }
+    });
+  }
+  for (auto& pusher : pushers) {
+    pusher.join();
+  }
+}
+
+// Confirms all the messages pushed by `PushConcurrently()` are there, in the order each thread has pushed them.
+static void ExpectAllMessagesInOrder(const std::string& contents, size_t threads, size_t messages) {
+  std::istringstream is(contents);
+  std::vector<size_t> next(threads, 0);
+  size_t t, i;
+  while (is >> t >> i) {
+    ASSERT_LT(t, threads);
+    EXPECT_EQ(next[t], i);
+    next[t] = i + 1;
+  }
+  EXPECT_EQ(std::vector<size_t>(threads, messages), next);
+}
+
+// Never finalizes or purges files on its own.
+struct NeverFinalizeOrPurgeMockConfig : BufferedMockConfig<0> {
+  typedef fsq::strategy::SimpleFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                                    MockTime::T_TIME_SPAN,
+                                                    1000000,
+                                                    MockTime::T_TIME_SPAN(1000000),
+                                                    1000000,
+                                                    MockTime::T_TIME_SPAN(1000000)> T_FINALIZE_STRATEGY;
+  typedef fsq::strategy::SimplePurgeStrategy<1000000, 1000> T_PURGE_STRATEGY;
+};
+
+// Commits concurrent pushes in groups.
+struct GroupCommitMockConfig : NeverFinalizeOrPurgeMockConfig {
+  inline static bool GroupCommitConcurrentPushes() {
+    return true;
+  }
+};
+
+TEST(FileSystemQueueTest, GroupCommitOfConcurrentPushes) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<GroupCommitMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+
+  mock_wall_time.now = 1;
+  PushConcurrently([&fsq](const std::string& message) { fsq.PushMessage(message); }, 4, 250);
+
+  // Each push has returned only once its message was flushed.
+  const std::string contents = bricks::ReadFileAsString(current_file_name);
+  EXPECT_EQ(fsq.GetQueueStatus().appended_file_size, contents.length());
+  ExpectAllMessagesInOrder(contents, 4, 250);
+}
+
+// Ticks on every call, so that the files finalized one after another are named apart.
+struct TickingTime {
+  typedef uint64_t T_TIMESTAMP;
+  typedef int64_t T_TIME_SPAN;
+  mutable std::atomic<uint64_t> now{0};
+  T_TIMESTAMP Now() const {
+    return ++now;
+  }
+};
+
+struct GroupCommitTickingTimeMockConfig : GroupCommitMockConfig {
+  typedef TickingTime T_TIME_MANAGER;
+};
+
+TEST(FileSystemQueueTest, GroupCommitWithConcurrentFinalization) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  TickingTime ticking_time;
+  fsq::FSQ<GroupCommitTickingTimeMockConfig> fsq(processor, kTestDir, ticking_time);
+
+  // Another thread keeps finalizing the current file while the messages are being appended to it.
+  std::atomic_bool done(false);
+  std::thread finalizer([&fsq, &done]() {
+    while (!done) {
+      fsq.FinalizeCurrentFile();
+    }
+  });
+  PushConcurrently([&fsq](const std::string& message) { fsq.PushMessage(message); }, 4, 100);
+  done = true;
+  finalizer.join();
+  fsq.FinalizeCurrentFile();
+
+  const size_t number_of_files = fsq.GetQueueStatus().finalized.queue.size();
+  processor.SetMimicUnavailable(false);
+  fsq.ForceProcessing();
+  while (processor.finalized_count != number_of_files) {
+    std::this_thread::yield();
+  }
+  std::string contents = processor.contents;
+  const std::string separator = "FILE SEPARATOR\n";
+  for (size_t i = contents.find(separator); i != std::string::npos; i = contents.find(separator)) {
+    contents.erase(i, separator.length());
+  }
+  ExpectAllMessagesInOrder(contents, 4, 100);
+}
+
+// Throws on errors even with ALEX_FROM_MINSK_NO_EXCEPTIONS, for the tests of the errors mid-way.
+struct ThrowingErrorHandling {
+  static void HandleError() {
+    throw std::runtime_error("FSQ error.");
+  }
+};
+
+// Makes the file go bad once "bad" is appended to it, so that the following appends fail.
+struct BreakingAppendToFile : fsq::strategy::AppendToFileWithSeparator {
+  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
+    fsq::strategy::AppendToFileWithSeparator::AppendToFile(fo, message);
+    if (message == "bad") {
+      fo.setstate(std::ios::badbit);
+    }
+  }
+};
+
+struct BreakingGroupCommitMockConfig : GroupCommitMockConfig {
+  typedef BreakingAppendToFile T_FILE_APPEND_STRATEGY;
+  typedef ThrowingErrorHandling T_ERROR_HANDLING_STRATEGY;
+};
+
+TEST(FileSystemQueueTest, GroupCommitReleasesPushersOnError) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<BreakingGroupCommitMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("bad");
+
+  // No message can be appended to the bad file, and the error of each group is rethrown to all of its pushers.
+  std::atomic_size_t errors(0);
+  PushConcurrently([&fsq, &errors](const std::string& message) {
+    try {
+      fsq.PushMessage(message);
+    } catch (const std::runtime_error&) {
+      ++errors;
+    }
+  }, 4, 100);
+  EXPECT_EQ(400u, errors.load());
+
+  // The next pusher leads a group of its own.
+  EXPECT_THROW(fsq.PushMessage("foo"), std::runtime_error);
+}
+
+// Stages pushes for the writer thread.
+struct WriterThreadMockConfig : NeverFinalizeOrPurgeMockConfig {
+  inline static bool PushMessagesViaWriterThread() {
+    return true;
+  }
+  inline static size_t WriterThreadMaxStagedMessages() {
+    return 10;
+  }
+};
+
+TEST(FileSystemQueueTest, WriterThreadAppendsConcurrentPushes) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<WriterThreadMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  PushConcurrently([&fsq](const std::string& message) { fsq.PushMessage(message); }, 4, 250);
+
+  // Finalizing goes through the writer thread, after the messages pushed before.
+  fsq.FinalizeCurrentFile();
+  EXPECT_EQ(0ull, fsq.GetQueueStatus().appended_file_size);
+  ASSERT_EQ(1u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ("finalized-00000000000000000001.bin", fsq.GetQueueStatus().finalized.queue.front().name);
+
+  processor.SetMimicUnavailable(false);
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(1u, processor.finalized_count);
+  ExpectAllMessagesInOrder(processor.contents, 4, 250);
+}
+
+TEST(FileSystemQueueTest, WriterThreadDrainsOnShutdown) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  {
+    fsq::FSQ<WriterThreadMockConfig> fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 1;
+    for (size_t i = 0; i < 100; ++i) {
+      fsq.PushMessage("0 " + std::to_string(i));
+    }
+  }
+
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+  ExpectAllMessagesInOrder(bricks::ReadFileAsString(current_file_name), 1, 100);
+}
+
+// Holds the thread appending "slow" until the gate is opened.
+struct GatedAppendToFile : fsq::strategy::AppendToFileWithSeparator {
+  static std::atomic_bool& Open() {
+    static std::atomic_bool open(false);
+    return open;
+  }
+  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
+    while (message == "slow" && !Open()) {
+      std::this_thread::yield();
+    }
+    fsq::strategy::AppendToFileWithSeparator::AppendToFile(fo, message);
+  }
+};
+
+struct GatedWriterThreadMockConfig : WriterThreadMockConfig {
+  typedef GatedAppendToFile T_FILE_APPEND_STRATEGY;
+};
+
+TEST(FileSystemQueueTest, WriterThreadTimerCheckDoesNotWait) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<GatedWriterThreadMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  GatedAppendToFile::Open() = false;
+  fsq.PushMessage("slow");
+
+  // The writer thread is held appending the message, and the timer-driven check is staged with no wait for it.
+  fsq.FinalizeCurrentFileIfDue();
+  GatedAppendToFile::Open() = true;
+
+  fsq.FinalizeCurrentFile();
+  while (!processor.finalized_count) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ("slow\n", processor.contents);
+}
+
+struct BreakingWriterThreadMockConfig : WriterThreadMockConfig {
+  typedef BreakingAppendToFile T_FILE_APPEND_STRATEGY;
+  typedef ThrowingErrorHandling T_ERROR_HANDLING_STRATEGY;
+};
+
+TEST(FileSystemQueueTest, WriterThreadErrorIsRethrownToCallers) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<BreakingWriterThreadMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("bad");
+  fsq.PushMessage("foo");
+
+  // The writer thread fails to append "foo", and carries on. The command waiting for it gets the error.
+  EXPECT_THROW(fsq.FinalizeCurrentFile(), std::runtime_error);
+}
+
+// Processes files concurrently, holding the first file until the second one has been processed.
+struct ConcurrentTestProcessor {
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info, uint64_t) {
+    const size_t in_flight = ++files_in_flight;
+    size_t max = max_files_in_flight;
+    while (in_flight > max && !max_files_in_flight.compare_exchange_weak(max, in_flight)) {
+      ;
+    }
+    if (file_info.name == "finalized-00000000000000000001.bin") {
+      while (!release_first_file) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    } else {
+      ++processed_count;
+    }
+    --files_in_flight;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t files_in_flight{0};
+  atomic_size_t max_files_in_flight{0};
+  atomic_size_t processed_count{0};
+  std::atomic_bool release_first_file{false};
+};
+
+template <bool IN_ORDER>
+struct ConcurrentMockConfig : MockConfig {
+  typedef ConcurrentTestProcessor T_PROCESSOR;
+  inline static size_t ProcessingConcurrency() {
+    return 2;
+  }
+  inline static bool RemoveProcessedFilesInOrder() {
+    return IN_ORDER;
+  }
+};
+
+TEST(FileSystemQueueTest, ConcurrentProcessingRemovesFilesInOrder) {
+  CleanupOldFiles();
+
+  ConcurrentTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<ConcurrentMockConfig<true>> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("one");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 2;
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+
+  // The second file is processed while the first one is still being processed, but is kept in the queue.
+  while (processor.processed_count != 1) {
+    ;  // Spin lock.
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(2u, processor.max_files_in_flight);
+  EXPECT_EQ(2u, fsq.GetQueueStatus().finalized.queue.size());
+
+  // Both are removed once the first one is processed.
+  processor.release_first_file = true;
+  while (!fsq.GetQueueStatus().finalized.queue.empty()) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+}
+
+TEST(FileSystemQueueTest, ConcurrentProcessingRemovesFilesOutOfOrder) {
+  CleanupOldFiles();
+
+  ConcurrentTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<ConcurrentMockConfig<false>> fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("one");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 2;
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+
+  // The second file is removed while the first one is still being processed.
+  while (fsq.GetQueueStatus().finalized.queue.size() != 1u) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(1u, processor.processed_count);
+  EXPECT_EQ("finalized-00000000000000000001.bin", fsq.GetQueueStatus().finalized.queue.front().name);
+
+  processor.release_first_file = true;
+  while (!fsq.GetQueueStatus().finalized.queue.empty()) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+}
+
+// Journals the files into the manifest, and trusts it on startup.
+struct ManifestMockConfig : MockConfig {
+  inline static std::string ManifestFileName() {
+    return "manifest.txt";
+  }
+};
+
+static void CreateFilesWithManifest() {
+  CleanupOldFiles();
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "manifest.txt"),
+                     bricks::RemoveFileParameters::Silent);
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<ManifestMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("one");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 2;
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 3;
+  fsq.PushMessage("three");
+}
+
+TEST(FileSystemQueueTest, ManifestIsTrustedOnStartup) {
+  CreateFilesWithManifest();
+
+  // A file the manifest does not know about is not picked up, since the directory is not scanned.
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000000.bin"),
+                            "stray\n");
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<ManifestMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  const auto status = fsq.GetQueueStatus();
+  ASSERT_EQ(2u, status.finalized.queue.size());
+  EXPECT_EQ("finalized-00000000000000000001.bin", status.finalized.queue.front().name);
+  EXPECT_EQ("finalized-00000000000000000002.bin", status.finalized.queue.back().name);
+  EXPECT_EQ(8ul, status.finalized.total_size);
+  EXPECT_EQ(6ull, status.appended_file_size);
+  EXPECT_EQ(3ull, status.appended_file_timestamp);
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000000.bin"));
+}
+
+TEST(FileSystemQueueTest, ManifestMismatchFallsBackToScan) {
+  CreateFilesWithManifest();
+
+  // With the newest finalized file gone, the manifest is not trusted, and the directory is scanned.
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000002.bin"));
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000000.bin"),
+                            "stray\n");
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<ManifestMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  const auto status = fsq.GetQueueStatus();
+  ASSERT_EQ(2u, status.finalized.queue.size());
+  EXPECT_EQ("finalized-00000000000000000000.bin", status.finalized.queue.front().name);
+  EXPECT_EQ("finalized-00000000000000000001.bin", status.finalized.queue.back().name);
+  EXPECT_EQ(10ul, status.finalized.total_size);
+  EXPECT_EQ(6ull, status.appended_file_size);
+  EXPECT_EQ(3ull, status.appended_file_timestamp);
+}
+
+struct PurgeWhileProcessingMockConfig : ManifestMockConfig {
+  typedef ConcurrentTestProcessor T_PROCESSOR;
+};
+
+TEST(FileSystemQueueTest, ManifestJournalsPurgedFileBeingProcessedOnceRemoved) {
+  CleanupOldFiles();
+  const std::string manifest_file_name = bricks::FileSystem::JoinPath(kTestDir, "manifest.txt");
+  bricks::RemoveFile(manifest_file_name, bricks::RemoveFileParameters::Silent);
+  const std::string first_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000001.bin");
+
+  ConcurrentTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<PurgeWhileProcessingMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("one");
+  fsq.FinalizeCurrentFile();
+  while (processor.files_in_flight != 1) {
+    std::this_thread::yield();
+  }
+
+  // With more than three files, the oldest two are purged, the first one while it is being processed.
+  for (uint64_t t = 2; t <= 5; ++t) {
+    mock_wall_time.now = t;
+    fsq.PushMessage("more");
+    fsq.FinalizeCurrentFile();
+  }
+  EXPECT_EQ(3u, fsq.GetQueueStatus().finalized.queue.size());
+
+  // The first file is still on disk, thus its removal is not journaled yet.
+  EXPECT_EQ(4ull, bricks::FileSystem::GetFileSize(first_file_name));
+  std::string manifest = bricks::ReadFileAsString(manifest_file_name);
+  EXPECT_EQ(std::string::npos, manifest.find("R finalized-00000000000000000001.bin\n"));
+  EXPECT_NE(std::string::npos, manifest.find("R finalized-00000000000000000002.bin\n"));
+
+  // Once processed, the first file is removed, and then its removal is journaled.
+  processor.release_first_file = true;
+  while (manifest.find("R finalized-00000000000000000001.bin\n") == std::string::npos) {
+    std::this_thread::yield();
+    manifest = bricks::ReadFileAsString(manifest_file_name);
+  }
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(first_file_name));
+}
+
+TEST(FileSystemQueueTest, ManifestSizeMismatchRemovesFile) {
+  CleanupOldFiles();
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "manifest.txt"),
+                     bricks::RemoveFileParameters::Silent);
+  {
+    TestOutputFilesProcessor processor;
+    processor.SetMimicUnavailable();
+    MockTime mock_wall_time;
+    fsq::FSQ<ManifestMockConfig> fsq(processor, kTestDir, mock_wall_time);
+    for (uint64_t t = 1; t <= 3; ++t) {
+      mock_wall_time.now = t;
+      fsq.PushMessage("foo");
+      fsq.FinalizeCurrentFile();
+    }
+  }
+
+  // Of the three files, the one in the middle is not what the manifest says, which is not checked on startup.
+  const std::string second_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000002.bin");
+  bricks::WriteStringToFile(second_file_name, "corrupted\n");
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<ManifestMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  while (!fsq.GetQueueStatus().finalized.queue.empty()) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ("finalized-00000000000000000001.bin|finalized-00000000000000000003.bin", processor.filenames);
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(second_file_name));
+}
+
+TEST(FileSystemQueueTest, FileViewReadsInChunks) {
+  const std::string file_name = bricks::FileSystem::JoinPath(kTestDir, "file_view_test.bin");
+  bricks::WriteStringToFile(file_name, "0123456789");
+  {
+    const fsq::FileView view(file_name);
+    ASSERT_TRUE(view.IsOpen());
+    ASSERT_TRUE(view.IsMapped());
+    EXPECT_EQ("0123456789", std::string(view.Data(), view.Size()));
+    std::vector<std::string> chunks;
+    EXPECT_TRUE(view.ForEachChunk([&chunks](const char* data, size_t size) {
+      chunks.emplace_back(data, size);
+      return true;
+    }, 4));
+    EXPECT_EQ((std::vector<std::string>{"0123", "4567", "89"}), chunks);
+    chunks.clear();
+    EXPECT_FALSE(view.ForEachChunk([&chunks](const char* data, size_t size) {
+      chunks.emplace_back(data, size);
+      return false;
+    }, 4));
+    EXPECT_EQ(1u, chunks.size());
+    std::string contents;
+    EXPECT_TRUE(view.ReadContents(contents));
+    EXPECT_EQ("0123456789", contents);
+  }
+
+  // An empty file can not be mapped, and has no chunks.
+  bricks::WriteStringToFile(file_name, "");
+  {
+    const fsq::FileView view(file_name);
+    EXPECT_TRUE(view.IsOpen());
+    EXPECT_FALSE(view.IsMapped());
+    EXPECT_EQ(0u, view.Size());
+    EXPECT_TRUE(view.ForEachChunk([](const char*, size_t) { return false; }));
+  }
+
+  bricks::RemoveFile(file_name);
+  EXPECT_FALSE(fsq::FileView(file_name).IsOpen());
+  std::string contents;
+  EXPECT_FALSE(fsq::FileView(file_name).ReadContents(contents));
+}
+
+// Reads the files via the view FSQ passes along, instead of reading them on its own.
+struct FileViewTestProcessor {
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info,
+                                        const fsq::FileView& view,
+                                        uint64_t) {
+    EXPECT_EQ(file_info.size, view.Size());
+    std::string file_contents;
+    view.ForEachChunk([&file_contents](const char* data, size_t size) {
+      file_contents.append(data, size);
+      return true;
+    }, 5);
+    EXPECT_EQ(file_contents, std::string(view.Data(), view.Size()));
+    contents += file_contents;
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count{0};
+  string contents = "";
+};
+
+struct FileViewMockConfig : MockConfig {
+  typedef FileViewTestProcessor T_PROCESSOR;
+};
+
+TEST(FileSystemQueueTest, ProcessorReceivesFileView) {
+  static_assert(fsq::ProcessorAcceptsFileView<FileViewTestProcessor, uint64_t>::value, "");
+  static_assert(!fsq::ProcessorAcceptsFileView<TestOutputFilesProcessor, uint64_t>::value, "");
+
+  CleanupOldFiles();
+
+  FileViewTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<FileViewMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  mock_wall_time.now = 2;
+  fsq.PushMessage("bar");
+  mock_wall_time.now = 3;
+  fsq.PushMessage("baz");
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("foo\nbar\nbaz\n", processor.contents);
+}
+
+// Splits the files into messages via the views FSQ passes along.
+struct FramedRecordsTestProcessor {
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>&, const fsq::FileView& view, uint64_t) {
+    if (mimic_unavailable_) {
+      return fsq::FileProcessingResult::Unavailable;
+    }
+    for (const auto& record : fsq::FramedRecords(view.Data(), view.Size())) {
+      messages.push_back(record.ToString());
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count{0};
+  std::vector<std::string> messages;
+  bool mimic_unavailable_ = false;
+};
+
+struct FramedRecordsMockConfig : MockConfig {
+  typedef FramedRecordsTestProcessor T_PROCESSOR;
+  typedef fsq::strategy::AppendFramedRecords T_FILE_APPEND_STRATEGY;
+  // Keep all the messages of the test in one file.
+  typedef fsq::strategy::SimpleFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                                    MockTime::T_TIME_SPAN,
+                                                    1000,
+                                                    MockTime::T_TIME_SPAN(10 * 1000),
+                                                    1000,
+                                                    MockTime::T_TIME_SPAN(60 * 1000)> T_FINALIZE_STRATEGY;
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE&) {
+  }
+};
+
+TEST(FileSystemQueueTest, FramedRecordsRoundTrip) {
+  CleanupOldFiles();
+
+  FramedRecordsTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<FramedRecordsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  fsq.PushMessage(std::string("a\0b\n", 4));
+  fsq.PushMessage("");
+  EXPECT_EQ(8u * 3 + 3 + 4, fsq.GetQueueStatus().appended_file_size);
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ((std::vector<std::string>{"foo", std::string("a\0b\n", 4), ""}), processor.messages);
+
+  // The iteration stops at the first damaged record.
+  std::string records;
+  for (const std::string message : {"one", "two", "three"}) {
+    char header[fsq::framed_records::kHeaderSize];
+    fsq::framed_records::MakeHeader(message.data(), message.length(), header);
+    records += std::string(header, sizeof(header)) + message;
+  }
+  records[8 + 3 + 8] = 'T';
+  std::vector<std::string> messages;
+  for (const auto& record : fsq::FramedRecords(records.data(), records.length())) {
+    messages.push_back(record.ToString());
+  }
+  EXPECT_EQ(std::vector<std::string>{"one"}, messages);
+  EXPECT_EQ(8u + 3, fsq::FramedRecords(records.data(), records.length()).ValidPrefixSize());
+}
+
+TEST(FileSystemQueueTest, FramedRecordsTornTailIsTruncatedOnStartup) {
+  CleanupOldFiles();
+
+  std::string contents;
+  for (const std::string message : {"one", "two", "three"}) {
+    char header[fsq::framed_records::kHeaderSize];
+    fsq::framed_records::MakeHeader(message.data(), message.length(), header);
+    contents += std::string(header, sizeof(header)) + message;
+  }
+  // Have the last record torn in the middle of the message.
+  contents.resize(contents.length() - 2);
+  const std::string current_file_name =
+      fsq::strategy::DummyFileNamingToUnblockAlexFromMinsk().current.GenerateFileName(
+          static_cast<bricks::time::EPOCH_MILLISECONDS>(1));
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, current_file_name), contents);
+
+  FramedRecordsTestProcessor processor;
+  processor.mimic_unavailable_ = true;
+  MockTime mock_wall_time;
+  fsq::FSQ<FramedRecordsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(2u * (8 + 3), fsq.GetQueueStatus().appended_file_size);
+  mock_wall_time.now = 2;
+  fsq.PushMessage("four");
+  processor.mimic_unavailable_ = false;
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ((std::vector<std::string>{"one", "two", "four"}), processor.messages);
+}
+
+TEST(FileSystemQueueTest, CompressionRoundTrip) {
+  std::string text;
+  for (int i = 0; i < 1000; ++i) {
+    text += "{\"event\":\"page_view\",\"user\":" + std::to_string(i % 37) + ",\"page\":\"/index.html\"}\n";
+  }
+  std::string noise;
+  uint32_t state = 42;
+  for (int i = 0; i < 10000; ++i) {
+    state = state * 1664525u + 1013904223u;
+    noise += static_cast<char>(state >> 24);
+  }
+  for (const std::string& original : {std::string(), std::string("a"), std::string(1000, 'x'), text, noise}) {
+    const std::string compressed = fsq::compression::Compress(original.data(), original.length());
+    EXPECT_TRUE(fsq::compression::IsCompressed(compressed.data(), compressed.length()));
+    std::string decompressed;
+    ASSERT_TRUE(fsq::compression::Decompress(compressed.data(), compressed.length(), decompressed));
+    EXPECT_EQ(original, decompressed);
+  }
+  const std::string compressed = fsq::compression::Compress(text.data(), text.length());
+  EXPECT_LT(compressed.length() * 5, text.length());
+
+  // The truncated input is detected, as the sizes do not add up.
+  std::string decompressed;
+  EXPECT_FALSE(fsq::compression::Decompress(compressed.data(), compressed.length() / 2, decompressed));
+  EXPECT_FALSE(fsq::compression::Decompress(text.data(), text.length(), decompressed));
+
+  // The uncompressed input that happens to start with the magic bytes does not get the size from its header
+  // reserved up front.
+  std::string magic_then_huge_size = std::string(fsq::compression::Magic(), fsq::compression::kMagicSize);
+  magic_then_huge_size += std::string(7, '\xff') + '\x3f' + "not really compressed";
+  EXPECT_FALSE(
+      fsq::compression::Decompress(magic_then_huge_size.data(), magic_then_huge_size.length(), decompressed));
+  EXPECT_LT(decompressed.capacity(), 1000000u);
+}
+
+// Collects the files as the views FSQ passes along expose them.
+struct CompressedFilesTestProcessor {
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>&, const fsq::FileView& view, uint64_t) {
+    if (mimic_unavailable_) {
+      return fsq::FileProcessingResult::Unavailable;
+    }
+    contents = std::string(view.Data(), view.Size());
+    decompressed = view.IsDecompressed();
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count{0};
+  string contents = "";
+  bool decompressed = false;
+  bool mimic_unavailable_ = false;
+};
+
+struct CompressedFilesMockConfig : MockConfig {
+  typedef CompressedFilesTestProcessor T_PROCESSOR;
+  typedef fsq::strategy::SimpleFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                                    MockTime::T_TIME_SPAN,
+                                                    10000,
+                                                    MockTime::T_TIME_SPAN(10 * 1000),
+                                                    10000,
+                                                    MockTime::T_TIME_SPAN(60 * 1000)> T_FINALIZE_STRATEGY;
+  typedef fsq::strategy::SimplePurgeStrategy<10000, 3> T_PURGE_STRATEGY;
+  inline static bool CompressFinalizedFiles() {
+    return true;
+  }
+};
+
+TEST(FileSystemQueueTest, CompressedFinalizedFiles) {
+  CleanupOldFiles();
+
+  CompressedFilesTestProcessor processor;
+  processor.mimic_unavailable_ = true;
+  MockTime mock_wall_time;
+  fsq::FSQ<CompressedFilesMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  std::string expected_contents;
+  for (int i = 0; i < 100; ++i) {
+    mock_wall_time.now = i + 1;
+    const std::string message = "Event number " + std::to_string(i % 10) + " happened.";
+    fsq.PushMessage(message);
+    expected_contents += message + '\n';
+  }
+  EXPECT_EQ(expected_contents.length(), fsq.GetQueueStatus().appended_file_size);
+  fsq.FinalizeCurrentFile();
+
+  // The status reports the size of the compressed file.
+  const auto status = fsq.GetQueueStatus();
+  ASSERT_EQ(1u, status.finalized.queue.size());
+  const auto& file = status.finalized.queue.front();
+  EXPECT_EQ(file.size, status.finalized.total_size);
+  EXPECT_EQ(file.size, bricks::FileSystem::GetFileSize(file.full_path_name));
+  EXPECT_LT(file.size * 5, expected_contents.length());
+  EXPECT_EQ(expected_contents, fsq::compression::ReadFileDecompressed(file.full_path_name));
+
+  // The processor gets the file decompressed.
+  processor.mimic_unavailable_ = false;
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_TRUE(processor.decompressed);
+  EXPECT_EQ(expected_contents, processor.contents);
+}
+
+// With the manifest, to have the pre-opened files journaled as well.
+struct BackgroundFinalizationMockConfig : ManifestMockConfig {
+  inline static bool FinalizeFilesInBackground() {
+    return true;
+  }
+};
+
+static size_t NumberOfCurrentFiles() {
+  size_t number_of_current_files = 0;
+  bricks::FileSystem::ScanDir(kTestDir, [&number_of_current_files](const std::string& file_name) {
+    uint64_t timestamp;
+    if (fsq::strategy::DummyFileNamingToUnblockAlexFromMinsk().current.ParseFileName(file_name, &timestamp)) {
+      ++number_of_current_files;
+    }
+  });
+  return number_of_current_files;
+}
+
+TEST(FileSystemQueueTest, BackgroundFinalization) {
+  CleanupOldFiles();
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "manifest.txt"),
+                     bricks::RemoveFileParameters::Silent);
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  {
+    fsq::FSQ<BackgroundFinalizationMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+    // The finalizer thread pre-opens the file for the first message.
+    while (NumberOfCurrentFiles() != 1u) {
+      std::this_thread::yield();
+    }
+
+    // Over 20 bytes, the file is handed over to the finalizer thread, and the next one is pre-opened.
+    mock_wall_time.now = 1;
+    fsq.PushMessage("this is a long message");
+    mock_wall_time.now = 2;
+    fsq.PushMessage("short");
+    fsq.FinalizeCurrentFile();
+    const auto status = fsq.GetQueueStatus();
+    ASSERT_EQ(2u, status.finalized.queue.size());
+    EXPECT_EQ("finalized-00000000000000000001.bin", status.finalized.queue.front().name);
+    EXPECT_EQ("finalized-00000000000000000002.bin", status.finalized.queue.back().name);
+    EXPECT_EQ(29ul, status.finalized.total_size);
+    EXPECT_EQ(0ull, status.appended_file_size);
+
+    processor.SetMimicUnavailable(false);
+    fsq.ForceProcessing();
+    while (processor.finalized_count != 2) {
+      ;  // Spin lock.
+    }
+    EXPECT_EQ("this is a long message\nFILE SEPARATOR\nshort\n", processor.contents);
+
+    mock_wall_time.now = 3;
+    fsq.PushMessage("resumed");
+    while (NumberOfCurrentFiles() != 2u) {
+      std::this_thread::yield();
+    }
+  }
+
+  // The pre-opened file is removed on shutdown, and the current one is resumed, as per the manifest.
+  EXPECT_EQ(1u, NumberOfCurrentFiles());
+  processor.ClearStats();
+  fsq::FSQ<BackgroundFinalizationMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(8ull, fsq.GetQueueStatus().appended_file_size);
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("resumed\n", processor.contents);
+}
+
+struct SegmentsMockConfig : FileViewMockConfig {
+  inline static uint64_t SegmentSize() {
+    return 1024;
+  }
+};
+
+TEST(FileSystemQueueTest, SegmentsAreRecycled) {
+  CleanupOldFiles();
+
+  const std::string recycled_segment_name =
+      bricks::FileSystem::JoinPath(kTestDir, "recycled-00000000000000000000.bin");
+  FileViewTestProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<SegmentsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  // Over 20 bytes, the segment is finalized, truncated to its data, processed, and renamed into the pool.
+  mock_wall_time.now = 1;
+  fsq.PushMessage("this is a long message");
+  while (bricks::FileSystem::GetFileSize(recycled_segment_name) != fsq::segments::kHeaderSize + 23u) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ("this is a long message\n", processor.contents);
+
+  // The next current file is the recycled segment, preallocated again, with its stale data past the new data.
+  mock_wall_time.now = 2;
+  fsq.PushMessage("short");
+  EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(recycled_segment_name));
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000002.bin");
+  EXPECT_EQ(1024u, bricks::FileSystem::GetFileSize(current_file_name));
+  EXPECT_EQ("short\n", fsq::segments::ReadSegmentData(current_file_name));
+  EXPECT_EQ(6ull, fsq.GetQueueStatus().appended_file_size);
+
+  // Only the data is passed to the processor.
+  processor.contents.clear();
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("short\n", processor.contents);
+}
+
+TEST(FileSystemQueueTest, SegmentResumesFromRecordedSize) {
+  CleanupOldFiles();
+
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+  FileViewTestProcessor processor;
+  MockTime mock_wall_time;
+  {
+    fsq::FSQ<SegmentsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 1;
+    fsq.PushMessage("one");
+  }
+  uint64_t data_size;
+  ASSERT_TRUE(fsq::segments::ReadDataSize(current_file_name, data_size));
+  EXPECT_EQ(4ull, data_size);
+  EXPECT_EQ(1024u, bricks::FileSystem::GetFileSize(current_file_name));
+
+  // Mimic the crash right after a message was written, before its size was recorded: the message is discarded.
+  {
+    std::fstream file(current_file_name, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(fsq::segments::kHeaderSize + data_size);
+    file << "lost\n";
+  }
+
+  fsq::FSQ<SegmentsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(4ull, fsq.GetQueueStatus().appended_file_size);
+  mock_wall_time.now = 2;
+  fsq.PushMessage("two");
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("one\ntwo\n", processor.contents);
+}
+
+struct FinalizationTimerMockConfig : MockConfig {
+  inline static uint64_t FinalizationCheckIntervalMilliseconds() {
+    return 1;
+  }
+};
+
+struct FinalizationTimerViaWriterThreadMockConfig : FinalizationTimerMockConfig {
+  inline static bool PushMessagesViaWriterThread() {
+    return true;
+  }
+};
+
+template <typename CONFIG>
+static void RunFinalizationTimerTest() {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<CONFIG> fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("foo");
+  fsq.GetQueueStatus();
+  EXPECT_EQ(0u, processor.finalized_count);
+
+  // Over 10 seconds old, the file is finalized with no more messages pushed.
+  mock_wall_time.now = 10002;
+  while (!processor.finalized_count) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ("foo\n", processor.contents);
+  EXPECT_EQ("finalized-00000000000000000001.bin", processor.filenames);
+}
+
+TEST(FileSystemQueueTest, FinalizedByTimerWithNoPushes) {
+  RunFinalizationTimerTest<FinalizationTimerMockConfig>();
+  RunFinalizationTimerTest<FinalizationTimerViaWriterThreadMockConfig>();
+}
+
+TEST(FileSystemQueueTest, AdaptiveFinalizationStrategy) {
+  // Files of 100 bytes to 10KB, 3600 files per hour, thus one per second, and at most 5 or 60 seconds old.
+  fsq::strategy::AdaptiveFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                              MockTime::T_TIME_SPAN,
+                                              100,
+                                              10000,
+                                              3600,
+                                              MockTime::T_TIME_SPAN(5 * 1000),
+                                              MockTime::T_TIME_SPAN(60 * 1000)> strategy;
+  fsq::QueueStatus<uint64_t> status;
+  status.appended_file_timestamp = 1000;
+
+  // With no rate observed yet, the files are of the minimum size.
+  EXPECT_EQ(100u, strategy.TargetFileSize());
+  status.appended_file_size = 99;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 1010));
+  status.appended_file_size = 100;
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 1010));
+
+  // At 10 bytes per millisecond, files of 10KB make for one per second.
+  EXPECT_EQ(10000u, strategy.TargetFileSize());
+  status.appended_file_size = 5000;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 1500));
+  status.appended_file_size = 10000;
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 2000));
+
+  // As the rate goes down, the file is finalized by age, and the target size follows, as the average
+  // of 10 and 0.01 bytes per millisecond.
+  status.appended_file_size = 50;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 6000));
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 6001));
+  EXPECT_EQ(5004u, strategy.TargetFileSize());
+
+  // With backlog, the files are kept until the maximum size or age.
+  status.finalized.queue.emplace_back("finalized", "finalized", 1, 1);
+  status.appended_file_size = 9999;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 60000));
+  status.appended_file_size = 10000;
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 60000));
+}
+
+struct AdaptiveFinalizationMockConfig : MockConfig {
+  // Files of 100 bytes to 2KB, 36000 files per hour, thus one per 100 milliseconds, and at most 5 or 60 seconds
+  // old. The purge strategy of `MockConfig` keeps no backlog, as the files are over 50 bytes.
+  typedef fsq::strategy::AdaptiveFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                                      MockTime::T_TIME_SPAN,
+                                                      100,
+                                                      2000,
+                                                      36000,
+                                                      MockTime::T_TIME_SPAN(5 * 1000),
+                                                      MockTime::T_TIME_SPAN(60 * 1000)> T_FINALIZE_STRATEGY;
+};
+
+// The file opened after each rollover does not count as aged since the epoch, which would drag the rate down.
+TEST(FileSystemQueueTest, AdaptiveFinalizationTargetIsStableAcrossRollovers) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<AdaptiveFinalizationMockConfig> fsq(processor, kTestDir, mock_wall_time);
+
+  // Ten bytes per millisecond, for files of a thousand bytes or slightly more, finalized ten times per second.
+  for (uint64_t t = 100000; t < 101000; ++t) {
+    mock_wall_time.now = t;
+    fsq.PushMessage("123456789");
+    if (t >= 100200) {
+      ASSERT_GE(fsq.TargetFileSize(), 1000u) << t;
+      ASSERT_LE(fsq.TargetFileSize(), 1200u) << t;
+    }
+  }
+  EXPECT_LE(fsq.GetQueueStatus().appended_file_size, 1200u);
+}
+
+// Logs the files of its queue into the log shared by the queues of the manager. Can mimic being unavailable,
+// and can be blocked, to have the thread of the manager wait in it.
+struct ManagedQueueProcessor {
+  ManagedQueueProcessor(const std::string& name, std::vector<std::string>& log, std::mutex& log_mutex)
+      : name(name), log(log), log_mutex(log_mutex) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info, uint64_t) {
+    entered = true;
+    while (blocked) {
+      std::this_thread::yield();
+    }
+    if (unavailable) {
+      return fsq::FileProcessingResult::Unavailable;
+    }
+    std::unique_lock<std::mutex> lock(log_mutex);
+    log.push_back(name + ":" + bricks::ReadFileAsString(file_info.full_path_name));
+    return fsq::FileProcessingResult::Success;
+  }
+
+  const std::string name;
+  std::vector<std::string>& log;
+  std::mutex& log_mutex;
+  std::atomic_bool entered{false};
+  std::atomic_bool blocked{false};
+  std::atomic_bool unavailable{false};
+};
+
+// Counts the errors instead of throwing them, for the tests to check the errors with and without exceptions.
+struct CountingErrorHandling {
+  static void HandleError() {
+    ++number_of_errors;
+  }
+  static std::atomic<size_t> number_of_errors;
+};
+std::atomic<size_t> CountingErrorHandling::number_of_errors(0);
+
+struct ManagerMockConfig : MockConfig {
+  typedef ManagedQueueProcessor T_PROCESSOR;
+  typedef CountingErrorHandling T_ERROR_HANDLING_STRATEGY;
+  // The quota of the manager is what purges the files.
+  typedef fsq::strategy::SimplePurgeStrategy<1000, 100> T_PURGE_STRATEGY;
+};
+
+typedef fsq::FSQManager<ManagerMockConfig> FSQManager;
+
+const char* const kManagerTestDir = "build/manager";
+
+static void CleanupManagerFiles(const std::vector<std::string>& queue_names) {
+  bricks::FileSystem::CreateDirectory(kManagerTestDir);
+  for (const auto& name : queue_names) {
+    const std::string directory = bricks::FileSystem::JoinPath(kManagerTestDir, name);
+    bricks::FileSystem::CreateDirectory(directory);
+    TestOutputFilesProcessor processor;
+    FSQ(processor, directory).ShutdownAndRemoveAllFSQFiles();
+  }
+}
+
+TEST(FileSystemQueueTest, ManagerPurgesLowPriorityQueuesFirst) {
+  CleanupManagerFiles({"high", "low"});
+
+  std::vector<std::string> log;
+  std::mutex log_mutex;
+  ManagedQueueProcessor high_processor("high", log, log_mutex);
+  ManagedQueueProcessor low_processor("low", log, log_mutex);
+  high_processor.unavailable = true;
+  low_processor.unavailable = true;
+  MockTime mock_wall_time;
+  bricks::FileSystem file_system;
+  // Up to three files of 11 bytes each, across the queues.
+  FSQManager manager(kManagerTestDir, 40, 1, mock_wall_time, file_system);
+  auto& high = manager.AddQueue("high", high_processor, 1);
+  auto& low = manager.AddQueue("low", low_processor, 0);
+
+  const auto push_and_finalize = [&mock_wall_time](FSQManager::T_FSQ& fsq, uint64_t now) {
+    mock_wall_time.now = now;
+    fsq.PushMessage("0123456789");
+    fsq.FinalizeCurrentFile();
+  };
+  const auto wait_for_quota = [&manager]() {
+    while (manager.GetStatus().total_size > 40) {
+      std::this_thread::yield();
+    }
+  };
+  push_and_finalize(low, 1);
+  push_and_finalize(high, 2);
+  push_and_finalize(low, 3);
+  push_and_finalize(high, 4);
+  wait_for_quota();
+
+  // The oldest file of the low priority queue is purged first.
+  FSQManager::Status status = manager.GetStatus();
+  EXPECT_EQ(33u, status.total_size);
+  EXPECT_EQ(3u, status.number_of_finalized_files);
+  EXPECT_EQ(40u, status.quota);
+  ASSERT_EQ(2u, status.queues.size());
+  EXPECT_EQ("high", status.queues[0].name);
+  EXPECT_EQ(1, status.queues[0].priority);
+  EXPECT_EQ(2u, status.queues[0].summary.number_of_finalized_files);
+  EXPECT_EQ(2u, status.queues[0].summary.oldest_finalized_file_timestamp);
+  EXPECT_EQ("low", status.queues[1].name);
+  EXPECT_EQ(1u, status.queues[1].summary.number_of_finalized_files);
+  EXPECT_EQ(3u, status.queues[1].summary.oldest_finalized_file_timestamp);
+
+  // Then the rest of the files of the low priority queue, even though the high priority one has older files.
+  push_and_finalize(high, 5);
+  wait_for_quota();
+  EXPECT_EQ(3u, high.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0u, low.GetQueueStatus().finalized.queue.size());
+
+  // And only then the files of the high priority queue.
+  push_and_finalize(high, 6);
+  wait_for_quota();
+  ASSERT_EQ(3u, high.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(4u, high.GetQueueStatus().finalized.queue.front().timestamp);
+  EXPECT_TRUE(log.empty());
+
+  // Once available, the files are processed by the thread of the manager.
+  high_processor.unavailable = false;
+  high.ResumeProcessing();
+  while (manager.GetStatus().number_of_finalized_files) {
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(log_mutex);
+  EXPECT_EQ(3u, log.size());
+}
+
+TEST(FileSystemQueueTest, ManagerProcessesHighPriorityQueuesFirst) {
+  CleanupManagerFiles({"blocker", "high", "low"});
+
+  std::vector<std::string> log;
+  std::mutex log_mutex;
+  ManagedQueueProcessor blocker_processor("blocker", log, log_mutex);
+  ManagedQueueProcessor high_processor("high", log, log_mutex);
+  ManagedQueueProcessor low_processor("low", log, log_mutex);
+  MockTime mock_wall_time;
+  bricks::FileSystem file_system;
+  FSQManager manager(kManagerTestDir, 1000, 1, mock_wall_time, file_system);
+  auto& blocker = manager.AddQueue("blocker", blocker_processor, 2);
+  auto& high = manager.AddQueue("high", high_processor, 1);
+  auto& low = manager.AddQueue("low", low_processor, 0);
+  EXPECT_EQ(&high, manager.FindQueue("high"));
+  EXPECT_EQ(nullptr, manager.FindQueue("medium"));
+
+  // Keep the only thread of the manager busy while the files of the other queues are finalized.
+  blocker_processor.blocked = true;
+  mock_wall_time.now = 1;
+  blocker.PushMessage("blocker");
+  blocker.FinalizeCurrentFile();
+  while (!blocker_processor.entered) {
+    std::this_thread::yield();
+  }
+  mock_wall_time.now = 2;
+  low.PushMessage("older");
+  low.FinalizeCurrentFile();
+  mock_wall_time.now = 3;
+  high.PushMessage("newer");
+  high.FinalizeCurrentFile();
+  blocker_processor.blocked = false;
+
+  // The high priority queue goes first, even though the low priority one has the older file.
+  while (manager.GetStatus().number_of_finalized_files) {
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(log_mutex);
+  ASSERT_EQ(3u, log.size());
+  EXPECT_EQ("blocker:blocker\n", log[0]);
+  EXPECT_EQ("high:newer\n", log[1]);
+  EXPECT_EQ("low:older\n", log[2]);
+}
+
+TEST(FileSystemQueueTest, ManagerAddsQueueOnceUnderConcurrentAdds) {
+  CleanupManagerFiles({"shared"});
+
+  std::vector<std::string> log;
+  std::mutex log_mutex;
+  ManagedQueueProcessor processor("shared", log, log_mutex);
+  MockTime mock_wall_time;
+  bricks::FileSystem file_system;
+  FSQManager manager(kManagerTestDir, 1000, 1, mock_wall_time, file_system);
+
+  // All the callers but one hit the error, and get the very queue the one has added.
+  CountingErrorHandling::number_of_errors = 0;
+  const size_t kThreads = 8;
+  std::vector<FSQManager::T_FSQ*> queues(kThreads, nullptr);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; ++i) {
+    threads.emplace_back(
+        [&manager, &processor, &queues, i]() { queues[i] = &manager.AddQueue("shared", processor); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(kThreads - 1, CountingErrorHandling::number_of_errors);
+  for (FSQManager::T_FSQ* queue : queues) {
+    EXPECT_EQ(manager.FindQueue("shared"), queue);
+  }
+  ASSERT_EQ(1u, manager.GetStatus().queues.size());
+
+  mock_wall_time.now = 1;
+  queues.back()->PushMessage("once");
+  queues.back()->FinalizeCurrentFile();
+  while (manager.GetStatus().number_of_finalized_files) {
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(log_mutex);
+  ASSERT_EQ(1u, log.size());
+  EXPECT_EQ("shared:once\n", log[0]);
+}
+
+struct HighPriorityLaneMockConfig : MockConfig {
+  inline static bool HighPriorityLane() {
+    return true;
+  }
+};
+
+typedef fsq::FSQ<HighPriorityLaneMockConfig> HighPriorityLaneFSQ;
+
+TEST(FileSystemQueueTest, HighPriorityLaneIsProcessedFirst) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  HighPriorityLaneFSQ fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 1;
+  fsq.PushMessage("telemetry");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 2;
+  fsq.PushMessage("more telemetry");
+  mock_wall_time.now = 3;
+  fsq.PushMessage("crash", fsq::MessagePriority::High);
+  fsq.FinalizeCurrentFile();
+  ASSERT_EQ(3u, fsq.GetQueueStatus().finalized.queue.size());
+
+  // The file of high priority goes first, and then the rest, in the order they were finalized.
+  processor.SetMimicUnavailable(false);
+  fsq.ResumeProcessing();
+  while (processor.finalized_count != 3) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(
+      "high-finalized-00000000000000000003.bin|finalized-00000000000000000001.bin|"
+      "finalized-00000000000000000002.bin",
+      processor.filenames);
+  EXPECT_EQ("crash\nFILE SEPARATOR\ntelemetry\nFILE SEPARATOR\nmore telemetry\n", processor.contents);
+}
+
+TEST(FileSystemQueueTest, HighPriorityLaneIsPurgedLast) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  {
+    HighPriorityLaneFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 1;
+    fsq.PushMessage("billing", fsq::MessagePriority::High);
+    fsq.FinalizeCurrentFile();
+    // Over three files, the oldest file of normal priority is purged, not the older one of high priority.
+    for (uint64_t t = 2; t <= 4; ++t) {
+      mock_wall_time.now = t;
+      fsq.PushMessage("telemetry");
+      fsq.FinalizeCurrentFile();
+    }
+    const auto status = fsq.GetQueueStatus();
+    ASSERT_EQ(3u, status.finalized.queue.size());
+    EXPECT_EQ("high-finalized-00000000000000000001.bin", status.finalized.queue[0].name);
+    EXPECT_EQ("finalized-00000000000000000003.bin", status.finalized.queue[1].name);
+    EXPECT_EQ("finalized-00000000000000000004.bin", status.finalized.queue[2].name);
+    // The current file of high priority is left behind.
+    mock_wall_time.now = 5;
+    fsq.PushMessage("crash", fsq::MessagePriority::High);
+  }
+
+  // On startup, the files of high priority are told apart, and the current one is finalized, with the oldest
+  // file of normal priority purged for it.
+  HighPriorityLaneFSQ fsq(processor, kTestDir, mock_wall_time);
+  const auto status = fsq.GetQueueStatus();
+  ASSERT_EQ(3u, status.finalized.queue.size());
+  EXPECT_EQ("high-finalized-00000000000000000001.bin", status.finalized.queue[0].name);
+  EXPECT_EQ("finalized-00000000000000000004.bin", status.finalized.queue[1].name);
+  EXPECT_EQ("high-finalized-00000000000000000005.bin", status.finalized.queue[2].name);
+  EXPECT_EQ("crash\n", bricks::ReadFileAsString(status.finalized.queue[2].full_path_name));
+}
+
+struct MetricsMockConfig : MockConfig {
+  inline static bool CollectMetrics() {
+    return true;
+  }
+};
+
+TEST(FileSystemQueueTest, MetricsAndTraceSpans) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  fsq::FSQ<MetricsMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  std::mutex spans_mutex;
+  std::map<std::string, size_t> spans;
+  fsq.SetTraceHook([&spans_mutex, &spans](const fsq::metrics::Span& span) {
+    std::lock_guard<std::mutex> lock(spans_mutex);
+    ++spans[fsq::metrics::EventName(span.event)];
+  });
+
+  // Four files, the oldest of which is purged.
+  mock_wall_time.now = 100001;
+  fsq.PushMessage("one");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100002;
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100003;
+  fsq.PushMessage("three");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100004;
+  fsq.PushMessage("four");
+  fsq.FinalizeCurrentFile();
+
+  mock_wall_time.now = 100010;
+  const fsq::metrics::Snapshot metrics = fsq.GetMetrics();
+  EXPECT_EQ(4u, metrics.messages_pushed);
+  EXPECT_EQ(19u, metrics.bytes_pushed);  // strlen("one\ntwo\nthree\nfour\n").
+  EXPECT_EQ(4u, metrics.push_latency.count);
+  EXPECT_EQ(4u, metrics.files_finalized);
+  EXPECT_EQ(4u, metrics.finalize_latency.count);
+  EXPECT_EQ(1u, metrics.files_purged);
+  EXPECT_EQ(4u, metrics.bytes_purged);
+  EXPECT_EQ(3u, metrics.backlog_files);
+  EXPECT_EQ(15u, metrics.backlog_bytes);
+  EXPECT_EQ(8u, metrics.backlog_age);
+  {
+    std::lock_guard<std::mutex> lock(spans_mutex);
+    EXPECT_EQ(4u, spans["push"]);
+    EXPECT_EQ(4u, spans["finalize"]);
+    EXPECT_EQ(1u, spans["purge"]);
+  }
+
+  processor.SetMimicUnavailable(false);
+  fsq.ResumeProcessing();
+  while (fsq.GetMetrics().files_processed != 3) {
+    std::this_thread::yield();
+  }
+  while (fsq.GetMetrics().backlog_files) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(0u, fsq.GetMetrics().backlog_age);
+  EXPECT_LE(3u, fsq.GetMetrics().processing_latency.count);  // The attempts while unavailable count too.
+  EXPECT_EQ(0u, fsq.GetMetrics().processing_retries);
+  std::lock_guard<std::mutex> lock(spans_mutex);
+  EXPECT_LE(3u, spans["process"]);
+}
+
+struct CursorsMockConfig : MockConfig {
+  inline static std::vector<std::string> ConsumerCursors() {
+    return {"aggregator", "dump"};
+  }
+};
+
+typedef fsq::FSQ<CursorsMockConfig> CursorsFSQ;
+
+TEST(FileSystemQueueTest, ProcessedFilesAreKeptForCursors) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FileInfo<uint64_t> file("", "", 0, 0);
+  {
+    CursorsFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 1;
+    fsq.PushMessage("one");
+    fsq.FinalizeCurrentFile();
+    mock_wall_time.now = 2;
+    fsq.PushMessage("two");
+    fsq.FinalizeCurrentFile();
+    while (processor.finalized_count != 2) {
+      std::this_thread::yield();
+    }
+    // Processed, but kept for the cursors.
+    EXPECT_EQ(2u, fsq.GetQueueStatus().finalized.queue.size());
+
+    ASSERT_TRUE(fsq.NextFileForCursor("aggregator", file));
+    EXPECT_EQ("finalized-00000000000000000001.bin", file.name);
+    EXPECT_EQ("one\n", bricks::ReadFileAsString(file.full_path_name));
+    fsq.AdvanceCursor("aggregator", file);
+    EXPECT_EQ(2u, fsq.GetQueueStatus().finalized.queue.size());
+
+    // Once the last cursor has passed the file, it is removed.
+    ASSERT_TRUE(fsq.NextFileForCursor("dump", file));
+    EXPECT_EQ("finalized-00000000000000000001.bin", file.name);
+    fsq.AdvanceCursor("dump", file);
+    const auto status = fsq.GetQueueStatus();
+    ASSERT_EQ(1u, status.finalized.queue.size());
+    EXPECT_EQ("finalized-00000000000000000002.bin", status.finalized.queue.front().name);
+    EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(file.full_path_name));
+
+    ASSERT_TRUE(fsq.NextFileForCursor("aggregator", file));
+    EXPECT_EQ("finalized-00000000000000000002.bin", file.name);
+    fsq.AdvanceCursor("aggregator", file);
+    EXPECT_FALSE(fsq.NextFileForCursor("aggregator", file));
+  }
+
+  // The cursors are persisted. The file processed, but not removed, before the restart is processed again.
+  CursorsFSQ fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_FALSE(fsq.NextFileForCursor("aggregator", file));
+  ASSERT_TRUE(fsq.NextFileForCursor("dump", file));
+  EXPECT_EQ("finalized-00000000000000000002.bin", file.name);
+  while (processor.finalized_count != 3) {
+    std::this_thread::yield();
+  }
+  fsq.AdvanceCursor("dump", file);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ("one\nFILE SEPARATOR\ntwo\nFILE SEPARATOR\ntwo\n", processor.contents);
+}
+
+struct TemporaryFilesMockConfig : ManifestMockConfig {
+  inline static std::vector<std::string> ConsumerCursors() {
+    return {"aggregator"};
+  }
+};
+
+TEST(FileSystemQueueTest, StaleTemporaryFilesAreRemoved) {
+  CleanupOldFiles();
+
+  // The temporary files of the compressed finalized files, the manifest and the cursors, as left by a crash.
+  const std::vector<std::string> stale_files = {"finalized-00000000000000000001.bin.tmp",
+                                                "high-finalized-00000000000000000002.bin.tmp",
+                                                "manifest.txt.tmp",
+                                                "cursor-aggregator.tmp"};
+  for (const std::string& name : stale_files) {
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, name), "stale");
+  }
+  // The files FSQ does not write are left alone.
+  const std::string unrelated_file = bricks::FileSystem::JoinPath(kTestDir, "unrelated.tmp");
+  bricks::WriteStringToFile(unrelated_file, "unrelated");
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  fsq::FSQ<TemporaryFilesMockConfig> fsq(processor, kTestDir, mock_wall_time);
+  for (const std::string& name : stale_files) {
+    EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(bricks::FileSystem::JoinPath(kTestDir, name))) << name;
+  }
+  EXPECT_EQ("unrelated", bricks::ReadFileAsString(unrelated_file));
+
+  // The ones left while running are removed along with the rest of the files.
+  const std::string stale_file = bricks::FileSystem::JoinPath(kTestDir, stale_files.front());
+  bricks::WriteStringToFile(stale_file, "stale");
+  fsq.ShutdownAndRemoveAllFSQFiles();
+  EXPECT_EQ(0u, bricks::FileSystem::GetFileSize(stale_file));
+  EXPECT_EQ("unrelated", bricks::ReadFileAsString(unrelated_file));
+  bricks::RemoveFile(unrelated_file);
+}